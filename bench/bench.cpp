@@ -0,0 +1,263 @@
+// Standalone benchmarks for the BSP engine. Builds the synthetic scenes from
+// generators.h, times each stage of the engine separately and prints one JSON
+// object per scene so runs can be compared by scripts. See the Makefile for
+// building, and run with --help for the options.
+
+#include "bsp.h"
+#include "generators.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <random>
+
+struct bench_options {
+  std::vector<std::string> scenes;
+  size_t size = 0;
+  size_t threads = 1;
+  size_t repeat = 3;
+  size_t probes = 3;
+  bool single = false;
+  bsp_types::BuildStrategy strategy = bsp_types::FIRST;
+  std::string strategy_name = "first";
+  bsp_types::CoverageMode coverage = bsp_types::COVERAGE_OFF;
+  std::string coverage_name = "off";
+  bool silhouettes = false;
+};
+
+// The timings of a stage, in milliseconds, over all repetitions
+struct stage_timing {
+  std::vector<double> runs;
+
+  double min() const { return *std::min_element(runs.begin(), runs.end()); }
+  double median() const {
+    std::vector<double> sorted = runs;
+    std::sort(sorted.begin(), sorted.end());
+    return sorted[sorted.size() / 2];
+  }
+};
+
+template <typename Stage>
+static void time_stage(stage_timing& timing, Stage stage) {
+  auto start = std::chrono::steady_clock::now();
+  stage();
+  auto end = std::chrono::steady_clock::now();
+  timing.runs.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+}
+
+// Sizes are chosen so every scene runs in a few seconds with the first
+// strategy. The soup and the stacked planes fragment heavily when cut by the
+// view and light, so small inputs already make for expensive scenes
+static size_t default_size(const std::string& scene) {
+  if (scene == "sphere") return 40;
+  if (scene == "terrain") return 60;
+  if (scene == "soup") return 1000;
+  if (scene == "planes") return 16;
+  return 0;
+}
+
+template <typename T>
+static bool generate(const std::string& scene, size_t size, std::vector<triangle_t<T> >& out) {
+  if (scene == "sphere") {
+    generate_sphere(out, size);
+  } else if (scene == "terrain") {
+    generate_terrain(out, size);
+  } else if (scene == "soup") {
+    generate_soup(out, size);
+  } else if (scene == "planes") {
+    generate_stacked_planes(out, size);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static void print_timing(const char* name, const stage_timing& timing, bool last) {
+  std::printf("    \"%s\": {\"min_ms\": %.3f, \"median_ms\": %.3f}%s\n", name, timing.min(),
+              timing.median(), last ? "" : ",");
+}
+
+// The viewpoint and light sit outside the bounding box of every scene, looking
+// at it from above at an angle so that parts of it are hidden. The area light
+// is a quad around the point light
+template <typename T>
+static void run_scene(const std::string& scene, size_t size, const bench_options& options,
+                      bool last) {
+  typedef point_t<T> point;
+  typedef indexed_triangle_t<T> indexed_triangle;
+  std::vector<triangle_t<T> > input;
+  generate(scene, size, input);
+  std::shuffle(input.begin(), input.end(), std::default_random_engine(1));
+  point view(3, 2, 1.5);
+  point light(-2, 3, 2.5);
+  area_light_t<T> area(light, vec3_t<T>(0.5, 0, 0), vec3_t<T>(0, 0.5, 0),
+                       area_light_t<T>::QUAD, 64, options.probes);
+
+  stage_timing build, look, shine, shine_area, sort;
+  size_t nodes = 0, depth = 0, fragments = 0, visible = 0, lit = 0, emitted = 0;
+  for (size_t i = 0; i < options.repeat; ++i) {
+    std::vector<triangle_t<T> > list = input;
+    bsp_t<T> tree;
+    time_stage(build, [&]() { tree.build_tree(list, options.strategy, options.threads); });
+    tree.set_coverage(options.coverage);
+    if (options.silhouettes) tree.set_neighbours(generated_neighbours(input));
+    nodes = tree.node_count();
+    depth = tree.depth();
+    fragments = tree.size();
+
+    bsp_t<T> looked = tree;
+    time_stage(look, [&]() { looked.look_from(view, frustum_t<T>(), options.threads); });
+
+    bsp_t<T> shone = tree;
+    time_stage(shine, [&]() { shone.shine_light(light); });
+
+    bsp_t<T> shone_area = tree;
+    time_stage(shine_area, [&]() { shone_area.shine_area_light(area, 1, options.threads); });
+
+    std::vector<indexed_triangle> sorted;
+    time_stage(sort, [&]() { looked.near_to_far(view, sorted); });
+    emitted = sorted.size();
+    visible = std::count_if(sorted.begin(), sorted.end(), [](const indexed_triangle& tri) {
+      return tri.is_visible() && !tri.is_back_facing();
+    });
+    lit = 0;
+    std::vector<indexed_triangle> shone_sorted;
+    shone.near_to_far(light, shone_sorted);
+    for (auto iter = shone_sorted.begin(); iter != shone_sorted.end(); ++iter) {
+      if (iter->light() > 0) ++lit;
+    }
+  }
+
+  std::printf("  {\n");
+  std::printf("    \"scene\": \"%s\",\n", scene.c_str());
+  std::printf("    \"size\": %zu,\n", size);
+  std::printf("    \"precision\": \"%s\",\n", options.single ? "single" : "double");
+  std::printf("    \"strategy\": \"%s\",\n", options.strategy_name.c_str());
+  std::printf("    \"coverage\": \"%s\",\n", options.coverage_name.c_str());
+  std::printf("    \"silhouettes\": %s,\n", options.silhouettes ? "true" : "false");
+  std::printf("    \"threads\": %zu,\n", options.threads);
+  std::printf("    \"repeat\": %zu,\n", options.repeat);
+  std::printf("    \"probes\": %zu,\n", options.probes);
+  std::printf("    \"triangles\": %zu,\n", input.size());
+  std::printf("    \"nodes\": %zu,\n", nodes);
+  std::printf("    \"depth\": %zu,\n", depth);
+  std::printf("    \"tree_fragments\": %zu,\n", fragments);
+  std::printf("    \"split_fragments\": %zu,\n", fragments - input.size());
+  std::printf("    \"view_fragments\": %zu,\n", emitted);
+  std::printf("    \"visible_fragments\": %zu,\n", visible);
+  std::printf("    \"lit_fragments\": %zu,\n", lit);
+  print_timing("build_tree", build, false);
+  print_timing("look_from", look, false);
+  print_timing("shine_light", shine, false);
+  print_timing("shine_area_light", shine_area, false);
+  print_timing("near_to_far", sort, true);
+  std::printf("  }%s\n", last ? "" : ",");
+}
+
+static void usage() {
+  std::printf(
+    "Usage: bench [options] [scene ...]\n"
+    "\n"
+    "Scenes: sphere, terrain, soup, planes (default: all)\n"
+    "\n"
+    "Options:\n"
+    "  --size N        size passed to the generators, overriding the default\n"
+    "                  of each scene\n"
+    "  --strategy S    first, sample or thorough (default: first)\n"
+    "  --precision P   double or single (default: double)\n"
+    "  --threads N     threads used for building the tree, the view and area lights\n"
+    "                  (default: 1)\n"
+    "  --coverage C    auto, on or off: whether hidden triangles are skipped with a\n"
+    "                  coverage cube, auto for large scenes only (default: off)\n"
+    "  --silhouettes   build shadow volumes from the silhouette edges of the scene\n"
+    "  --probes N      probes along each side of the area light, or 0 for every\n"
+    "                  one of its 64 samples (default: 3)\n"
+    "  --repeat N      repetitions of every stage (default: 3)\n"
+  );
+}
+
+int main(int argc, char** argv) {
+  bench_options options;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--help" || arg == "-h") {
+      usage();
+      return 0;
+    } else if (arg == "--silhouettes") {
+      options.silhouettes = true;
+    } else if (arg == "--size" && has_value) {
+      options.size = std::strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "--threads" && has_value) {
+      options.threads = std::max<size_t>(1, std::strtoul(argv[++i], nullptr, 10));
+    } else if (arg == "--probes" && has_value) {
+      options.probes = std::strtoul(argv[++i], nullptr, 10);
+      if (options.probes == 1) {
+        std::fprintf(stderr, "The area light takes 0 or at least 2 probes\n");
+        return 1;
+      }
+    } else if (arg == "--repeat" && has_value) {
+      options.repeat = std::max<size_t>(1, std::strtoul(argv[++i], nullptr, 10));
+    } else if (arg == "--precision" && has_value) {
+      std::string precision = argv[++i];
+      if (precision != "double" && precision != "single") {
+        std::fprintf(stderr, "Unknown precision: %s\n", precision.c_str());
+        return 1;
+      }
+      options.single = precision == "single";
+    } else if (arg == "--strategy" && has_value) {
+      options.strategy_name = argv[++i];
+      if (options.strategy_name == "first") {
+        options.strategy = bsp_types::FIRST;
+      } else if (options.strategy_name == "sample") {
+        options.strategy = bsp_types::SAMPLE;
+      } else if (options.strategy_name == "thorough") {
+        options.strategy = bsp_types::THOROUGH;
+      } else {
+        std::fprintf(stderr, "Unknown build strategy: %s\n", options.strategy_name.c_str());
+        return 1;
+      }
+    } else if (arg == "--coverage" && has_value) {
+      options.coverage_name = argv[++i];
+      if (options.coverage_name == "auto") {
+        options.coverage = bsp_types::COVERAGE_AUTO;
+      } else if (options.coverage_name == "on") {
+        options.coverage = bsp_types::COVERAGE_ON;
+      } else if (options.coverage_name == "off") {
+        options.coverage = bsp_types::COVERAGE_OFF;
+      } else {
+        std::fprintf(stderr, "Unknown coverage mode: %s\n", options.coverage_name.c_str());
+        return 1;
+      }
+    } else if (arg.compare(0, 2, "--") == 0) {
+      std::fprintf(stderr, "Unknown option: %s\n", arg.c_str());
+      return 1;
+    } else if (default_size(arg) == 0) {
+      std::fprintf(stderr, "Unknown scene: %s\n", arg.c_str());
+      return 1;
+    } else {
+      options.scenes.push_back(arg);
+    }
+  }
+  if (options.scenes.empty()) {
+    options.scenes = {"sphere", "terrain", "soup", "planes"};
+  }
+
+  std::printf("[\n");
+  for (size_t i = 0; i < options.scenes.size(); ++i) {
+    const std::string& scene = options.scenes[i];
+    size_t size = options.size > 0 ? options.size : default_size(scene);
+    bool last = i + 1 == options.scenes.size();
+    if (options.single) {
+      run_scene<float>(scene, size, options, last);
+    } else {
+      run_scene<double>(scene, size, options, last);
+    }
+    std::fflush(stdout);
+  }
+  std::printf("]\n");
+  return 0;
+}
@@ -0,0 +1,286 @@
+// Regression checks for the BSP engine. Every check builds a synthetic scene
+// from generators.h, runs the engine on it and compares the result with what
+// it must be. Failing checks are printed and give a non-zero exit status. See
+// the Makefile for building and running them.
+
+#include "bsp.h"
+#include "coverage.h"
+#include "generators.h"
+
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <random>
+
+static int n_failed = 0;
+
+static void expect(bool ok, const std::string& what) {
+  std::printf("%s %s\n", ok ? "ok  " : "FAIL", what.c_str());
+  if (!ok) ++n_failed;
+}
+
+// Whether the segment from eye to p passes through tri, not counting its ends
+template <typename T>
+static bool blocks(const point_t<T>& eye, const point_t<T>& p, const triangle_t<T>& tri) {
+  typedef vec3_t<T> vec3;
+  vec3 d = p - eye;
+  vec3 e1 = tri.b() - tri.a();
+  vec3 e2 = tri.c() - tri.a();
+  vec3 h = d.cross(e2);
+  T det = e1.dot(h);
+  if (std::abs(det) < 1e-14) return false;
+  vec3 s = eye - tri.a();
+  T u = s.dot(h) / det;
+  if (u < 0 || u > 1) return false;
+  vec3 q = s.cross(e1);
+  T v = d.dot(q) / det;
+  if (v < 0 || u + v > 1) return false;
+  T t = e2.dot(q) / det;
+  return t > 1e-9 && t < 1 - 1e-9;
+}
+
+// The number of front facing triangles whose centre can be seen from eye, as
+// found by casting a ray through every other triangle, that come out of the
+// tree without any visible area
+template <typename T>
+static size_t count_missing(const std::vector<triangle_t<T> >& input, const point_t<T>& eye) {
+  typedef point_t<T> point;
+  std::vector<triangle_t<T> > list = input;
+  bsp_t<T> tree(list);
+  tree.look_from(eye);
+  std::vector<triangle_t<T> > result;
+  tree.near_to_far(eye, result);
+  std::vector<T> visible;
+  for (auto iter = result.begin(); iter != result.end(); ++iter) {
+    if (!iter->is_visible() || iter->is_back_facing()) continue;
+    if (size_t(iter->id()) >= visible.size()) visible.resize(iter->id() + 1, 0);
+    visible[iter->id()] += iter->area();
+  }
+
+  size_t missing = 0;
+  for (auto iter = input.begin(); iter != input.end(); ++iter) {
+    if (iter->normal().dot(eye - iter->a()) <= 0) continue;
+    point centre((iter->a().x + iter->b().x + iter->c().x) / 3,
+                 (iter->a().y + iter->b().y + iter->c().y) / 3,
+                 (iter->a().z + iter->b().z + iter->c().z) / 3);
+    bool seen = true;
+    for (auto other = input.begin(); other != input.end() && seen; ++other) {
+      seen = other == iter || !blocks(eye, centre, *other);
+    }
+    if (seen && (size_t(iter->id()) >= visible.size() || visible[iter->id()] == 0)) ++missing;
+  }
+  return missing;
+}
+
+// Slivers of spheres seen almost edge-on once cast shadows over everything
+// behind them, as their sides fell within the tolerance of each other
+static void check_edge_on_slivers() {
+  std::vector<triangle_t<double> > input;
+  for (int i = 0; i < 30; ++i) {
+    generate_sphere(input, 16, point_t<double>(i % 6 * 0.5, i / 6 * 0.5, (i % 3) * 0.4), 0.3);
+  }
+  std::shuffle(input.begin(), input.end(), std::default_random_engine(1));
+  size_t missing = count_missing(input, point_t<double>(10, 3, 2));
+  expect(missing == 0, "edge-on slivers leave what is behind them visible (" +
+         std::to_string(missing) + " seen triangles hidden)");
+}
+
+// A sliver far smaller than a pixel once closed its own outline and had the
+// whole pixel taken as covered, hiding a much larger triangle behind it
+static void check_coverage_sliver() {
+  double eye[3] = {0, 0, 0};
+  double low[3] = {-1, -1, 10};
+  double high[3] = {1, 1, 12};
+  coverage_cube coverage(eye, low, high, 1);
+  double sliver[3][3] = {{0.01, 0.01, 10}, {0.01002, 0.01, 10}, {0.01, 0.01002, 10}};
+  coverage.add(sliver);
+  double behind[3][3] = {{0.011, 0.011, 11}, {0.0113, 0.011, 11}, {0.011, 0.0113, 11}};
+  expect(!coverage.is_covered(behind), "a sliver doesn't cover the pixel it lies in");
+}
+
+// The visible fragments as seen from eye with coverage in the given mode, along
+// with the number of triangles coverage found hidden
+template <typename T>
+static std::vector<triangle_t<T> > visible_with(const std::vector<triangle_t<T> >& input,
+                                                const point_t<T>& eye,
+                                                bsp_types::CoverageMode mode, size_t& covered) {
+  std::vector<triangle_t<T> > list = input;
+  bsp_t<T> tree(list);
+  tree.set_coverage(mode);
+  tree.look_from(eye);
+  covered = tree.stats().covered;
+  std::vector<triangle_t<T> > result;
+  tree.near_to_far(eye, result);
+  result.erase(std::remove_if(result.begin(), result.end(), [](const triangle_t<T>& tri) {
+    return !tri.is_visible() || tri.is_back_facing();
+  }), result.end());
+  return result;
+}
+
+// Coverage only skips triangles that are hidden anyway, so the visible
+// fragments are the same whether it is used or not. Both scenes are small
+// enough for coverage to be off by default
+static void check_coverage_on_off() {
+  typedef point_t<double> point;
+  for (int scene = 0; scene < 2; ++scene) {
+    std::vector<triangle_t<double> > input;
+    if (scene == 0) {
+      generate_soup(input, 1000);
+    } else {
+      generate_stacked_planes(input, 16);
+    }
+    std::shuffle(input.begin(), input.end(), std::default_random_engine(1));
+    point eye(3, 2, 1.5);
+    size_t covered = 0, unused = 0;
+    std::vector<triangle_t<double> > on =
+      visible_with(input, eye, bsp_types::COVERAGE_ON, covered);
+    std::vector<triangle_t<double> > off =
+      visible_with(input, eye, bsp_types::COVERAGE_OFF, unused);
+    bool same = on.size() == off.size();
+    for (size_t i = 0; same && i < on.size(); ++i) {
+      same = on[i].id() == off[i].id() && on[i].a() == off[i].a() && on[i].b() == off[i].b() &&
+        on[i].c() == off[i].c();
+    }
+    expect(covered > 0 && same, std::string(scene == 0 ? "soup" : "stacked planes") +
+           " is seen the same with coverage on and off (" + std::to_string(covered) +
+           " triangles covered)");
+  }
+}
+
+// The fragments seen from eye, or lit by a point light there, with shadow
+// volumes built from silhouette edges or from every triangle
+template <typename T>
+static std::vector<triangle_t<T> > reached_with(const std::vector<triangle_t<T> >& input,
+                                                const point_t<T>& eye, bool light,
+                                                bool silhouettes, size_t& shadow_nodes) {
+  std::vector<triangle_t<T> > list = input;
+  bsp_t<T> tree(list);
+  if (silhouettes) tree.set_neighbours(generated_neighbours(input));
+  if (light) {
+    tree.shine_light(eye, 1);
+  } else {
+    tree.look_from(eye);
+  }
+  shadow_nodes = tree.stats().shadow_nodes.back();
+  std::vector<triangle_t<T> > result;
+  tree.near_to_far(eye, result);
+  result.erase(std::remove_if(result.begin(), result.end(), [&](const triangle_t<T>& tri) {
+    return light ? tri.light() == 0 : !tri.is_visible() || tri.is_back_facing();
+  }), result.end());
+  return result;
+}
+
+// The area seen or lit of every triangle, weighted by its light when lit
+template <typename T>
+static std::vector<T> area_by_id(const std::vector<triangle_t<T> >& fragments, bool light) {
+  std::vector<T> area;
+  for (auto iter = fragments.begin(); iter != fragments.end(); ++iter) {
+    if (size_t(iter->id()) >= area.size()) area.resize(iter->id() + 1, 0);
+    area[iter->id()] += iter->area() * (light ? iter->light() : 1);
+  }
+  return area;
+}
+
+// Silhouette volumes only drop planes that lie on a partition already, so the
+// same triangles are seen and lit with the same area either way, on closed
+// meshes as well as on open ones. A soup has no shared edges and falls back to
+// every plane. The fragments themselves can differ where a point is cut by one
+// plane rather than the other within their tolerance
+static void check_silhouettes() {
+  typedef point_t<double> point;
+  const char* names[] = {"spheres", "terrain", "soup"};
+  for (int scene = 0; scene < 3; ++scene) {
+    std::vector<triangle_t<double> > input;
+    if (scene == 0) {
+      for (int i = 0; i < 8; ++i) {
+        generate_sphere(input, 12, point(i % 4 * 0.7, i / 4 * 0.7, (i % 3) * 0.4), 0.3);
+      }
+    } else if (scene == 1) {
+      generate_terrain(input, 30);
+    } else {
+      generate_soup(input, 500);
+    }
+    std::shuffle(input.begin(), input.end(), std::default_random_engine(1));
+    for (int light = 0; light < 2; ++light) {
+      point eye = light ? point(-2, 4, 3) : point(3, 2, 1.5);
+      size_t nodes_on = 0, nodes_off = 0;
+      std::vector<double> on = area_by_id(reached_with(input, eye, light, true, nodes_on), light);
+      std::vector<double> off = area_by_id(reached_with(input, eye, light, false, nodes_off), light);
+      on.resize(std::max(on.size(), off.size()), 0);
+      off.resize(on.size(), 0);
+      double total = 0, worst = 0;
+      bool same = true;
+      for (size_t i = 0; i < on.size(); ++i) {
+        total += off[i];
+        worst = std::max(worst, std::abs(on[i] - off[i]));
+        same = same && (on[i] > 0) == (off[i] > 0);
+      }
+      same = same && total > 0 && worst <= 1e-6 * total;
+      bool fewer = scene == 2 ? nodes_on <= nodes_off : nodes_on < nodes_off;
+      expect(same && fewer, std::string(names[scene]) +
+             (light ? " is lit" : " is seen") + " the same with silhouette shadow volumes (" +
+             std::to_string(nodes_on) + " shadow nodes rather than " + std::to_string(nodes_off) +
+             ")");
+    }
+  }
+}
+
+// Whether bytes read back as a tree
+static bool reads_as_tree(const std::string& bytes) {
+  bsp_t<double> tree;
+  try {
+    tree.read(bytes.data(), bytes.data() + bytes.size());
+  } catch (const std::runtime_error&) {
+    return false;
+  }
+  return true;
+}
+
+// Records of a written tree that don't describe a tree used to be read back,
+// leaving later traversals to run outside the arrays of the tree
+static void check_corrupt_tree() {
+  std::vector<triangle_t<double> > input;
+  generate_sphere(input, 8);
+  bsp_t<double> tree(input);
+  std::ostringstream written;
+  tree.write(written);
+  std::string bytes = written.str();
+  std::ostringstream written_leaf;
+  bsp_t<double>().write(written_leaf);
+  expect(reads_as_tree(bytes) && reads_as_tree(written_leaf.str()),
+         "written trees read back, including a single empty leaf");
+
+  // The counts of nodes and ranges come first, then the tolerance, the nodes
+  // and the ranges
+  uint64_t n_nodes = 0;
+  std::memcpy(&n_nodes, bytes.data(), sizeof(n_nodes));
+  size_t nodes_at = 5 * sizeof(uint64_t) + sizeof(double);
+  size_t ranges_at = nodes_at + n_nodes * (3 * sizeof(uint32_t) + sizeof(uint8_t));
+  std::string few_ranges = bytes;
+  uint64_t n_ranges = 1;
+  std::memcpy(&few_ranges[sizeof(uint64_t)], &n_ranges, sizeof(n_ranges));
+  few_ranges.erase(ranges_at + 2 * sizeof(uint32_t), (n_nodes - 1) * 2 * sizeof(uint32_t));
+  expect(!reads_as_tree(few_ranges), "a tree with nodes missing their ranges is rejected");
+
+  // The root gets the same node as its front and back child
+  std::string shared = bytes;
+  uint32_t children[2];
+  std::memcpy(children, &shared[nodes_at + sizeof(uint32_t)], sizeof(children));
+  uint32_t child = children[0] == bsp_node::NONE ? children[1] : children[0];
+  std::memcpy(&shared[nodes_at + sizeof(uint32_t)], &child, sizeof(child));
+  std::memcpy(&shared[nodes_at + 2 * sizeof(uint32_t)], &child, sizeof(child));
+  expect(!reads_as_tree(shared), "a tree with a node under two parents is rejected");
+}
+
+int main() {
+  check_edge_on_slivers();
+  check_coverage_sliver();
+  check_coverage_on_off();
+  check_silhouettes();
+  check_corrupt_tree();
+  return n_failed == 0 ? 0 : 1;
+}
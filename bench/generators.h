@@ -0,0 +1,142 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <random>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+#include "geometry.h"
+#include "adjacency.h"
+#include "weld.h"
+
+// Synthetic meshes for the benchmarks. Every generator takes a size controlling
+// the number of triangles and appends to out, numbering the triangles from the
+// current size of out so the ids stay unique across generators
+
+// A UV sphere with n rings and 2n segments, giving about 4n^2 triangles
+template <typename T>
+void generate_sphere(std::vector<triangle_t<T> >& out, size_t n, point_t<T> center = point_t<T>(),
+                     T radius = 1) {
+  typedef point_t<T> point;
+  size_t n_rings = std::max<size_t>(n, 2);
+  size_t n_segments = n_rings * 2;
+  auto corner = [&](size_t ring, size_t segment) {
+    double theta = M_PI * ring / n_rings;
+    double phi = 2 * M_PI * segment / n_segments;
+    return point(center.x + radius * std::sin(theta) * std::cos(phi),
+                 center.y + radius * std::sin(theta) * std::sin(phi),
+                 center.z + radius * std::cos(theta));
+  };
+  for (size_t i = 0; i < n_rings; ++i) {
+    for (size_t j = 0; j < n_segments; ++j) {
+      point a = corner(i, j);
+      point b = corner(i + 1, j);
+      point c = corner(i + 1, j + 1);
+      point d = corner(i, j + 1);
+      triangle_t<T> first(a, b, c, out.size() + 1);
+      if (first.is_valid()) out.push_back(first);
+      triangle_t<T> second(a, c, d, out.size() + 1);
+      if (second.is_valid()) out.push_back(second);
+    }
+  }
+}
+
+// A height field over an n by n grid of the unit square, giving 2n^2 triangles.
+// The rolling hills occlude each other from a low viewpoint
+template <typename T>
+void generate_terrain(std::vector<triangle_t<T> >& out, size_t n, unsigned seed = 1) {
+  typedef point_t<T> point;
+  n = std::max<size_t>(n, 1);
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<double> phase(0, 2 * M_PI);
+  double phases[4] = {phase(rng), phase(rng), phase(rng), phase(rng)};
+  auto corner = [&](size_t i, size_t j) {
+    double x = double(i) / n;
+    double y = double(j) / n;
+    double z = 0.15 * std::sin(6 * x + phases[0]) * std::cos(5 * y + phases[1]) +
+      0.05 * std::sin(23 * x + phases[2]) * std::sin(19 * y + phases[3]);
+    return point(x, y, z);
+  };
+  for (size_t i = 0; i < n; ++i) {
+    for (size_t j = 0; j < n; ++j) {
+      point a = corner(i, j);
+      point b = corner(i + 1, j);
+      point c = corner(i + 1, j + 1);
+      point d = corner(i, j + 1);
+      out.push_back(triangle_t<T>(a, b, c, out.size() + 1));
+      out.push_back(triangle_t<T>(a, c, d, out.size() + 1));
+    }
+  }
+}
+
+// n unrelated triangles scattered in a cube of side 2 around the origin, with
+// sides shrinking as n grows so the density of overlaps stays about the same
+template <typename T>
+void generate_soup(std::vector<triangle_t<T> >& out, size_t n, unsigned seed = 1) {
+  typedef vec3_t<T> vec3;
+  typedef point_t<T> point;
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<double> position(-1, 1);
+  double size = 2.0 / std::cbrt(double(std::max<size_t>(n, 1)));
+  std::uniform_real_distribution<double> offset(-size, size);
+  while (n > 0) {
+    point a(position(rng), position(rng), position(rng));
+    triangle_t<T> tri(a, a + vec3(offset(rng), offset(rng), offset(rng)),
+                      a + vec3(offset(rng), offset(rng), offset(rng)), out.size() + 1);
+    if (!tri.is_valid()) continue;
+    out.push_back(tri);
+    --n;
+  }
+}
+
+// n large quads stacked along z and tilted in alternating directions so every
+// quad crosses all the others. Any choice of partition splits the remaining
+// quads, giving a quadratic number of fragments
+template <typename T>
+void generate_stacked_planes(std::vector<triangle_t<T> >& out, size_t n) {
+  typedef point_t<T> point;
+  n = std::max<size_t>(n, 1);
+  for (size_t i = 0; i < n; ++i) {
+    double z = n == 1 ? 0 : -0.5 + double(i) / (n - 1);
+    double tilt = (i % 2 == 0 ? 1 : -1) * 0.6;
+    auto corner = [&](double x, double y) {
+      return point(x, y, z + tilt * x);
+    };
+    point a = corner(-1, -1);
+    point b = corner(1, -1);
+    point c = corner(1, 1);
+    point d = corner(-1, 1);
+    out.push_back(triangle_t<T>(a, b, c, out.size() + 1));
+    out.push_back(triangle_t<T>(a, c, d, out.size() + 1));
+  }
+}
+
+// The neighbours of the triangles in list for bsp_t::set_neighbours(), taking
+// corners with identical coordinates as the same vertex the way a mesh shares
+// them
+template <typename T>
+std::shared_ptr<const std::vector<int> > generated_neighbours(const std::vector<triangle_t<T> >& list) {
+  size_t n_ids = 0;
+  for (auto iter = list.begin(); iter != list.end(); ++iter) {
+    n_ids = std::max(n_ids, size_t(iter->id()) + 1);
+  }
+  std::vector<double> x(3 * n_ids, 0), y(3 * n_ids, 0), z(3 * n_ids, 0);
+  for (auto iter = list.begin(); iter != list.end(); ++iter) {
+    const point_t<T> corners[3] = {iter->a(), iter->b(), iter->c()};
+    for (int k = 0; k < 3; ++k) {
+      size_t i = 3 * iter->id() + k;
+      x[i] = corners[k].x;
+      y[i] = corners[k].y;
+      z[i] = corners[k].z;
+    }
+  }
+  // Ids without a triangle have three identical corners and so no edges
+  std::vector<uint32_t> index, first;
+  weld_vertices(x.data(), y.data(), z.data(), x.size(), 0.0, 1, index, first);
+  std::vector<int> corners(index.begin(), index.end());
+  std::shared_ptr<std::vector<int> > neighbours = std::make_shared<std::vector<int> >();
+  find_neighbours(corners.data(), n_ids, 0, *neighbours);
+  return neighbours;
+}
@@ -0,0 +1,42 @@
+#include "adjacency.h"
+
+#include <algorithm>
+#include <cstdint>
+
+// One side of an edge as seen from a triangle. key holds the two vertices in
+// increasing order so both sides of an edge sort next to each other
+struct half_edge {
+  uint64_t key;
+  uint32_t from;
+  uint32_t slot;
+
+  bool operator<(const half_edge& other) const {
+    return key < other.key || (key == other.key && slot < other.slot);
+  }
+};
+
+void find_neighbours(const int* corners, size_t n, int first_id, std::vector<int>& neighbours) {
+  neighbours.assign(3 * (first_id + n), -1);
+  std::vector<half_edge> edges;
+  edges.reserve(3 * n);
+  for (size_t i = 0; i < n; ++i) {
+    for (int k = 0; k < 3; ++k) {
+      uint32_t a = uint32_t(corners[3 * i + k]);
+      uint32_t b = uint32_t(corners[3 * i + (k + 1) % 3]);
+      if (a == b) continue;
+      uint64_t key = uint64_t(std::min(a, b)) << 32 | std::max(a, b);
+      edges.push_back({key, a, uint32_t(3 * (first_id + i) + k)});
+    }
+  }
+  std::sort(edges.begin(), edges.end());
+
+  for (size_t i = 0; i < edges.size();) {
+    size_t j = i + 1;
+    while (j < edges.size() && edges[j].key == edges[i].key) ++j;
+    if (j - i == 2 && edges[i].from != edges[i + 1].from) {
+      neighbours[edges[i].slot] = edges[i + 1].slot / 3;
+      neighbours[edges[i + 1].slot] = edges[i].slot / 3;
+    }
+    i = j;
+  }
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+
+// Finds the triangle across each edge of every triangle of a mesh. corners
+// holds the three vertex indices of n triangles, the one at position i having
+// the id first_id + i. neighbours receives three entries per id, starting from
+// id 0, with the one at 3 * id + k giving the id of the triangle across the
+// edge from corner k to corner k + 1 (wrapping around).
+//
+// An edge only has a neighbour when exactly two triangles share it and they
+// run along it in opposite directions. Borders of the mesh, edges shared by
+// more triangles and edges between triangles of opposite orientation get -1,
+// as do the entries of ids without a triangle
+void find_neighbours(const int* corners, size_t n, int first_id, std::vector<int>& neighbours);
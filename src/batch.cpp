@@ -0,0 +1,242 @@
+#include "batch.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && defined(__SSE2__)
+#define UNMESHY_X86_SIMD
+#include <immintrin.h>
+#endif
+
+template <typename T>
+void triangle_batch_t<T>::assign(const std::vector<triangle_t<T> >& list, size_t first, size_t step) {
+  size_t n = first < list.size() ? (list.size() - first + step - 1) / step : 0;
+  ax.resize(n); ay.resize(n); az.resize(n);
+  bx.resize(n); by.resize(n); bz.resize(n);
+  cx.resize(n); cy.resize(n); cz.resize(n);
+  for (size_t i = 0; i < n; ++i) {
+    const triangle_t<T>& tri = list[first + i * step];
+    ax[i] = tri.a().x; ay[i] = tri.a().y; az[i] = tri.a().z;
+    bx[i] = tri.b().x; by[i] = tri.b().y; bz[i] = tri.b().z;
+    cx[i] = tri.c().x; cy[i] = tri.c().y; cz[i] = tri.c().z;
+  }
+}
+
+template <typename T>
+void triangle_batch_t<T>::assign(const std::vector<indexed_triangle_t<T> >& list,
+                                 const vertex_pool_t<T>& pool, size_t first, size_t step) {
+  size_t n = first < list.size() ? (list.size() - first + step - 1) / step : 0;
+  ax.resize(n); ay.resize(n); az.resize(n);
+  bx.resize(n); by.resize(n); bz.resize(n);
+  cx.resize(n); cy.resize(n); cz.resize(n);
+  for (size_t i = 0; i < n; ++i) {
+    const indexed_triangle_t<T>& tri = list[first + i * step];
+    const point_t<T>& a = pool[tri[0]];
+    const point_t<T>& b = pool[tri[1]];
+    const point_t<T>& c = pool[tri[2]];
+    ax[i] = a.x; ay[i] = a.y; az[i] = a.z;
+    bx[i] = b.x; by[i] = b.y; bz[i] = b.z;
+    cx[i] = c.x; cy[i] = c.y; cz[i] = c.z;
+  }
+}
+
+template struct triangle_batch_t<double>;
+template struct triangle_batch_t<float>;
+
+// The class of a triangle is encoded as 2 * (any vertex in front) + (any vertex
+// behind), which lines up with the values of bsp::PositionType. Vertices within
+// the tolerance of the plane count as neither, matching plane_t::classify_point()
+template <typename T>
+static void classify_scalar(const plane_t<T>& partition, const triangle_batch_t<T>& batch,
+                            size_t first, uint8_t* classes) {
+  const T eps = partition.tolerance();
+  const vec3_t<T>& n = partition.normal();
+  T d = partition.offset();
+  const T* xs[3] = {batch.ax.data(), batch.bx.data(), batch.cx.data()};
+  const T* ys[3] = {batch.ay.data(), batch.by.data(), batch.cy.data()};
+  const T* zs[3] = {batch.az.data(), batch.bz.data(), batch.cz.data()};
+  for (size_t i = first; i < batch.size(); ++i) {
+    uint8_t cls = 0;
+    for (int v = 0; v < 3; ++v) {
+      T loc = n.x * xs[v][i] + n.y * ys[v][i] + n.z * zs[v][i] + d;
+      if (loc >= eps) cls |= 2;
+      if (loc <= -eps) cls |= 1;
+    }
+    classes[i] = cls;
+  }
+}
+
+#ifdef UNMESHY_X86_SIMD
+
+// Multiplies and adds are done in the same order as plane_t::classify_point() and
+// without FMA so the SIMD paths agree with the scalar one
+static size_t classify_sse2(const plane_t<double>& partition, const triangle_batch_t<double>& batch,
+                            uint8_t* classes) {
+  const vec3_t<double>& n = partition.normal();
+  __m128d nx = _mm_set1_pd(n.x);
+  __m128d ny = _mm_set1_pd(n.y);
+  __m128d nz = _mm_set1_pd(n.z);
+  __m128d d = _mm_set1_pd(partition.offset());
+  __m128d pos_eps = _mm_set1_pd(partition.tolerance());
+  __m128d neg_eps = _mm_set1_pd(-partition.tolerance());
+  const double* xs[3] = {batch.ax.data(), batch.bx.data(), batch.cx.data()};
+  const double* ys[3] = {batch.ay.data(), batch.by.data(), batch.cy.data()};
+  const double* zs[3] = {batch.az.data(), batch.bz.data(), batch.cz.data()};
+  size_t i = 0;
+  for (; i + 2 <= batch.size(); i += 2) {
+    __m128d front = _mm_setzero_pd();
+    __m128d back = _mm_setzero_pd();
+    for (int v = 0; v < 3; ++v) {
+      __m128d loc = _mm_add_pd(
+        _mm_add_pd(_mm_add_pd(_mm_mul_pd(nx, _mm_loadu_pd(xs[v] + i)),
+                              _mm_mul_pd(ny, _mm_loadu_pd(ys[v] + i))),
+                   _mm_mul_pd(nz, _mm_loadu_pd(zs[v] + i))),
+        d
+      );
+      front = _mm_or_pd(front, _mm_cmpge_pd(loc, pos_eps));
+      back = _mm_or_pd(back, _mm_cmple_pd(loc, neg_eps));
+    }
+    int front_mask = _mm_movemask_pd(front);
+    int back_mask = _mm_movemask_pd(back);
+    for (int k = 0; k < 2; ++k) {
+      classes[i + k] = (((front_mask >> k) & 1) << 1) | ((back_mask >> k) & 1);
+    }
+  }
+  return i;
+}
+
+__attribute__((target("avx2")))
+static size_t classify_avx2(const plane_t<double>& partition, const triangle_batch_t<double>& batch,
+                            uint8_t* classes) {
+  const vec3_t<double>& n = partition.normal();
+  __m256d nx = _mm256_set1_pd(n.x);
+  __m256d ny = _mm256_set1_pd(n.y);
+  __m256d nz = _mm256_set1_pd(n.z);
+  __m256d d = _mm256_set1_pd(partition.offset());
+  __m256d pos_eps = _mm256_set1_pd(partition.tolerance());
+  __m256d neg_eps = _mm256_set1_pd(-partition.tolerance());
+  const double* xs[3] = {batch.ax.data(), batch.bx.data(), batch.cx.data()};
+  const double* ys[3] = {batch.ay.data(), batch.by.data(), batch.cy.data()};
+  const double* zs[3] = {batch.az.data(), batch.bz.data(), batch.cz.data()};
+  size_t i = 0;
+  for (; i + 4 <= batch.size(); i += 4) {
+    __m256d front = _mm256_setzero_pd();
+    __m256d back = _mm256_setzero_pd();
+    for (int v = 0; v < 3; ++v) {
+      __m256d loc = _mm256_add_pd(
+        _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(nx, _mm256_loadu_pd(xs[v] + i)),
+                                    _mm256_mul_pd(ny, _mm256_loadu_pd(ys[v] + i))),
+                      _mm256_mul_pd(nz, _mm256_loadu_pd(zs[v] + i))),
+        d
+      );
+      front = _mm256_or_pd(front, _mm256_cmp_pd(loc, pos_eps, _CMP_GE_OQ));
+      back = _mm256_or_pd(back, _mm256_cmp_pd(loc, neg_eps, _CMP_LE_OQ));
+    }
+    int front_mask = _mm256_movemask_pd(front);
+    int back_mask = _mm256_movemask_pd(back);
+    for (int k = 0; k < 4; ++k) {
+      classes[i + k] = (((front_mask >> k) & 1) << 1) | ((back_mask >> k) & 1);
+    }
+  }
+  return i;
+}
+
+static size_t classify_sse2(const plane_t<float>& partition, const triangle_batch_t<float>& batch,
+                            uint8_t* classes) {
+  const vec3_t<float>& n = partition.normal();
+  __m128 nx = _mm_set1_ps(n.x);
+  __m128 ny = _mm_set1_ps(n.y);
+  __m128 nz = _mm_set1_ps(n.z);
+  __m128 d = _mm_set1_ps(partition.offset());
+  __m128 pos_eps = _mm_set1_ps(partition.tolerance());
+  __m128 neg_eps = _mm_set1_ps(-partition.tolerance());
+  const float* xs[3] = {batch.ax.data(), batch.bx.data(), batch.cx.data()};
+  const float* ys[3] = {batch.ay.data(), batch.by.data(), batch.cy.data()};
+  const float* zs[3] = {batch.az.data(), batch.bz.data(), batch.cz.data()};
+  size_t i = 0;
+  for (; i + 4 <= batch.size(); i += 4) {
+    __m128 front = _mm_setzero_ps();
+    __m128 back = _mm_setzero_ps();
+    for (int v = 0; v < 3; ++v) {
+      __m128 loc = _mm_add_ps(
+        _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, _mm_loadu_ps(xs[v] + i)),
+                              _mm_mul_ps(ny, _mm_loadu_ps(ys[v] + i))),
+                   _mm_mul_ps(nz, _mm_loadu_ps(zs[v] + i))),
+        d
+      );
+      front = _mm_or_ps(front, _mm_cmpge_ps(loc, pos_eps));
+      back = _mm_or_ps(back, _mm_cmple_ps(loc, neg_eps));
+    }
+    int front_mask = _mm_movemask_ps(front);
+    int back_mask = _mm_movemask_ps(back);
+    for (int k = 0; k < 4; ++k) {
+      classes[i + k] = (((front_mask >> k) & 1) << 1) | ((back_mask >> k) & 1);
+    }
+  }
+  return i;
+}
+
+__attribute__((target("avx2")))
+static size_t classify_avx2(const plane_t<float>& partition, const triangle_batch_t<float>& batch,
+                            uint8_t* classes) {
+  const vec3_t<float>& n = partition.normal();
+  __m256 nx = _mm256_set1_ps(n.x);
+  __m256 ny = _mm256_set1_ps(n.y);
+  __m256 nz = _mm256_set1_ps(n.z);
+  __m256 d = _mm256_set1_ps(partition.offset());
+  __m256 pos_eps = _mm256_set1_ps(partition.tolerance());
+  __m256 neg_eps = _mm256_set1_ps(-partition.tolerance());
+  const float* xs[3] = {batch.ax.data(), batch.bx.data(), batch.cx.data()};
+  const float* ys[3] = {batch.ay.data(), batch.by.data(), batch.cy.data()};
+  const float* zs[3] = {batch.az.data(), batch.bz.data(), batch.cz.data()};
+  size_t i = 0;
+  for (; i + 8 <= batch.size(); i += 8) {
+    __m256 front = _mm256_setzero_ps();
+    __m256 back = _mm256_setzero_ps();
+    for (int v = 0; v < 3; ++v) {
+      __m256 loc = _mm256_add_ps(
+        _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, _mm256_loadu_ps(xs[v] + i)),
+                                    _mm256_mul_ps(ny, _mm256_loadu_ps(ys[v] + i))),
+                      _mm256_mul_ps(nz, _mm256_loadu_ps(zs[v] + i))),
+        d
+      );
+      front = _mm256_or_ps(front, _mm256_cmp_ps(loc, pos_eps, _CMP_GE_OQ));
+      back = _mm256_or_ps(back, _mm256_cmp_ps(loc, neg_eps, _CMP_LE_OQ));
+    }
+    int front_mask = _mm256_movemask_ps(front);
+    int back_mask = _mm256_movemask_ps(back);
+    for (int k = 0; k < 8; ++k) {
+      classes[i + k] = (((front_mask >> k) & 1) << 1) | ((back_mask >> k) & 1);
+    }
+  }
+  return i;
+}
+
+static bool has_avx2() {
+  static const bool supported = __builtin_cpu_supports("avx2");
+  return supported;
+}
+
+#endif
+
+template <typename T>
+static void classify_dispatch(const plane_t<T>& partition, const triangle_batch_t<T>& batch,
+                              std::vector<uint8_t>& classes) {
+  classes.resize(batch.size());
+  size_t done = 0;
+#ifdef UNMESHY_X86_SIMD
+  if (has_avx2()) {
+    done = classify_avx2(partition, batch, classes.data());
+  } else {
+    done = classify_sse2(partition, batch, classes.data());
+  }
+#endif
+  classify_scalar(partition, batch, done, classes.data());
+}
+
+void classify_batch(const plane_t<double>& partition, const triangle_batch_t<double>& batch,
+                    std::vector<uint8_t>& classes) {
+  classify_dispatch(partition, batch, classes);
+}
+
+void classify_batch(const plane_t<float>& partition, const triangle_batch_t<float>& batch,
+                    std::vector<uint8_t>& classes) {
+  classify_dispatch(partition, batch, classes);
+}
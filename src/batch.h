@@ -0,0 +1,33 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#include "geometry.h"
+#include "vertex_pool.h"
+
+// The vertices of a list of triangles stored as structure of arrays so they
+// can be classified against a plane several at a time
+template <typename T>
+struct triangle_batch_t {
+  std::vector<T> ax, ay, az;
+  std::vector<T> bx, by, bz;
+  std::vector<T> cx, cy, cz;
+
+  size_t size() const { return ax.size(); }
+  // Fills the batch with every step'th triangle of list starting at first
+  void assign(const std::vector<triangle_t<T> >& list, size_t first = 0, size_t step = 1);
+  void assign(const std::vector<indexed_triangle_t<T> >& list, const vertex_pool_t<T>& pool,
+              size_t first = 0, size_t step = 1);
+};
+
+typedef triangle_batch_t<double> triangle_batch;
+
+// Classifies every triangle in the batch against the plane. classes[i] is set
+// to the bsp_types::PositionType of triangle i, giving the same result as
+// plane_t::classify_triangle(). Uses AVX2 or SSE2 when the CPU supports it
+void classify_batch(const plane_t<double>& partition, const triangle_batch_t<double>& batch,
+                    std::vector<uint8_t>& classes);
+void classify_batch(const plane_t<float>& partition, const triangle_batch_t<float>& batch,
+                    std::vector<uint8_t>& classes);
@@ -1,81 +1,835 @@
 #include "bsp.h"
 #include <vector>
 #include <iostream>
+#include <algorithm>
+#include <limits>
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <functional>
+#include <unordered_map>
 #include "geometry.h"
+#include "task_pool.h"
+#include "batch.h"
+#include "coverage.h"
 
-void bsp::build_tree(std::vector<triangle>& list) {
-  if (list.size() == 0) return;
-  auto iter = list.begin();
-  partition = plane(*iter);
-  triangles.push_back(*iter);
-  ++iter;
-  std::vector<triangle> front_list, back_list;
-  for (; iter != list.end(); ++iter) {
-    triangle tri = triangle(*iter);
-
-    switch (partition.classify_triangle(tri)) {
-    case COINCIDENT:
+const uint32_t bsp_node::NONE;
+
+template <typename T>
+uint32_t bsp_t<T>::add_node(bool is_out) {
+  structure->nodes.push_back(bsp_node(is_out));
+  return structure->nodes.size() - 1;
+}
+
+template <typename T>
+void bsp_t<T>::detach() {
+  if (structure.use_count() > 1) {
+    structure = std::make_shared<bsp_structure<T> >(*structure);
+  }
+}
+
+// Picks the partition among a spread of candidates by scoring each against a
+// sample of the list. Splits are penalised most, followed by imbalance between
+// the two sides. Axis-aligned and large triangles are favoured as they tend to
+// coincide with more of the mesh and split fewer of the remaining triangles.
+template <typename T>
+static size_t choose_partition(const std::vector<indexed_triangle_t<T> >& list,
+                               const vertex_pool_t<T>& pool,
+                               bsp_types::BuildStrategy strategy) {
+  typedef vec3_t<T> vec3;
+  const double SPLIT_COST = 16.0;
+  const double AXIS_DISCOUNT = 0.8;
+  const double AREA_DISCOUNT = 0.1;
+
+  if (strategy == bsp_types::FIRST || list.size() < 3) return 0;
+  size_t n_candidates = strategy == bsp_types::THOROUGH ? 24 : 6;
+  size_t n_evaluate = strategy == bsp_types::THOROUGH ? 1024 : 128;
+  n_candidates = std::min(n_candidates, list.size());
+  size_t eval_step = std::max<size_t>(1, list.size() / n_evaluate);
+
+  double max_area = 0;
+  std::vector<double> area(n_candidates);
+  for (size_t i = 0; i < n_candidates; ++i) {
+    area[i] = pool.area(list[i * list.size() / n_candidates]);
+    max_area = std::max(max_area, area[i]);
+  }
+
+  triangle_batch_t<T> sample;
+  sample.assign(list, pool, 0, eval_step);
+  std::vector<uint8_t> classes;
+
+  size_t best = 0;
+  double best_cost = std::numeric_limits<double>::infinity();
+  for (size_t i = 0; i < n_candidates; ++i) {
+    size_t index = i * list.size() / n_candidates;
+    classify_batch(pool.plane_of(list[index]), sample, classes);
+    double n_front = 0, n_back = 0, n_span = 0;
+    for (auto iter = classes.begin(); iter != classes.end(); ++iter) {
+      switch (*iter) {
+      case bsp_types::IN_BACK_OF: n_back++; break;
+      case bsp_types::IN_FRONT_OF: n_front++; break;
+      case bsp_types::SPAN: n_span++; break;
+      default: break;
+      }
+    }
+    const vec3& n = list[index].normal();
+    bool axis_aligned = std::max(std::abs(n.x), std::max(std::abs(n.y), std::abs(n.z))) > 0.999;
+    double cost = SPLIT_COST * n_span + std::abs(n_front - n_back);
+    if (axis_aligned) cost *= AXIS_DISCOUNT;
+    if (max_area > 0) cost *= 1 - AREA_DISCOUNT * area[i] / max_area;
+    if (cost < best_cost) {
+      best_cost = cost;
+      best = index;
+    }
+  }
+  return best;
+}
+
+template <typename T>
+struct build_task {
+  uint32_t parent;
+  bool is_front;
+  std::vector<indexed_triangle_t<T> > list;
+};
+
+// Builds the subtree for list into the given arrays. Nodes are created as they
+// are popped so the arrays end up in pre-order with the front subtree preceding
+// the back subtree. spawn(list, pool) may take over a child list and return a
+// reference to build it elsewhere, or return NONE to keep it local. Split
+// triangles add their new corners to pool, using the index of the partition as
+// plane id, and vertex_ends receives the size of the pool after each node.
+// Every split is counted in splits.
+template <typename T, typename Spawn>
+static void grow_tree(std::vector<indexed_triangle_t<T> >& list, vertex_pool_t<T>& pool,
+                      bsp_structure<T>& structure, std::vector<bsp_range>& ranges,
+                      std::vector<indexed_triangle_t<T> >& triangles,
+                      std::vector<uint32_t>& vertex_ends, size_t& splits,
+                      bsp_types::BuildStrategy strategy, Spawn spawn) {
+  typedef indexed_triangle_t<T> indexed_triangle;
+  typedef plane_t<T> plane;
+  typedef indexed_cut_t<T> indexed_cut;
+  std::vector<bsp_node>& nodes = structure.nodes;
+  std::vector<plane>& planes = structure.planes;
+  std::vector<build_task<T> > stack(1);
+  stack.back().parent = bsp_node::NONE;
+  stack.back().list.swap(list);
+  while (!stack.empty()) {
+    build_task<T> task;
+    task.parent = stack.back().parent;
+    task.is_front = stack.back().is_front;
+    task.list.swap(stack.back().list);
+    stack.pop_back();
+
+    uint32_t node = nodes.size();
+    nodes.push_back(bsp_node());
+    ranges.push_back(bsp_range());
+    if (task.parent != bsp_node::NONE) {
+      if (task.is_front) {
+        nodes[task.parent].front = node;
+      } else {
+        nodes[task.parent].back = node;
+      }
+    }
+    size_t chosen = choose_partition(task.list, pool, strategy);
+    if (chosen != 0) {
+      std::swap(task.list[0], task.list[chosen]);
+    }
+    auto iter = task.list.begin();
+    nodes[node].partition = planes.size();
+    planes.push_back(pool.plane_of(*iter));
+    const plane& partition = planes.back();
+    ranges[node].first = triangles.size();
+    triangles.push_back(*iter);
+    ++iter;
+    std::vector<indexed_triangle> front_list, back_list;
+    for (; iter != task.list.end(); ++iter) {
+      const indexed_triangle& tri = *iter;
+
+      switch (pool.classify(partition, tri)) {
+      case bsp_types::COINCIDENT:
+        triangles.push_back(tri);
+        break;
+      case bsp_types::IN_BACK_OF:
+        back_list.push_back(tri);
+        break;
+      case bsp_types::IN_FRONT_OF:
+        front_list.push_back(tri);
+        break;
+      case bsp_types::SPAN: {
+        indexed_cut split = pool.split_triangle(partition, nodes[node].partition, tri);
+        ++splits;
+        front_list.push_back(split.front);
+        back_list.push_back(split.back);
+        if (split.last_is_valid) {
+          if (split.last_is_front) {
+            front_list.push_back(split.extra);
+          } else {
+            back_list.push_back(split.extra);
+          }
+        }
+        break;
+      }
+      default:
+        break;
+      }
+    }
+    ranges[node].count = triangles.size() - ranges[node].first;
+    vertex_ends.push_back(pool.size());
+    task.list.clear();
+    task.list.shrink_to_fit();
+
+    if (!back_list.empty()) {
+      uint32_t external = spawn(back_list, pool);
+      if (external != bsp_node::NONE) {
+        nodes[node].back = external;
+      } else {
+        stack.push_back(build_task<T>());
+        stack.back().parent = node;
+        stack.back().is_front = false;
+        stack.back().list.swap(back_list);
+      }
+    }
+    if (!front_list.empty()) {
+      uint32_t external = spawn(front_list, pool);
+      if (external != bsp_node::NONE) {
+        nodes[node].front = external;
+      } else {
+        stack.push_back(build_task<T>());
+        stack.back().parent = node;
+        stack.back().is_front = true;
+        stack.back().list.swap(front_list);
+      }
+    }
+  }
+}
+
+// A subtree built by a separate task. Children pointing into another part are
+// flagged with PART_FLAG and carry the index of that part instead of a node.
+// Vertices created by the part go in its own pool layered on the tree's pool.
+// Those it got from the part that spawned it come first and are listed in
+// imported by their index in that part so they can be shared again.
+template <typename T>
+struct bsp_part {
+  bsp_structure<T> structure;
+  std::vector<bsp_range> ranges;
+  std::vector<indexed_triangle_t<T> > triangles;
+  std::vector<uint32_t> vertex_ends;
+  vertex_pool_t<T> vertices;
+  uint32_t source = 0;
+  std::vector<uint32_t> imported;
+  size_t splits = 0;
+};
+static const uint32_t PART_FLAG = 0x80000000;
+static const size_t PARALLEL_CUTOFF = 2048;
+// A subtree is rebuilt after a removal once more than 1 / TOMBSTONE_SHARE of
+// its nodes are tombstones
+static const uint32_t TOMBSTONE_SHARE = 2;
+// With COVERAGE_AUTO, trees with at least this many triangles check every
+// triangle against the coverage of those in front of it before cutting it by a
+// shadow volume
+static const size_t COVERAGE_CUTOFF = 4096;
+// Coverage is dropped if fewer than 1 / COVERAGE_SHARE of the triangles
+// checked were covered once as many as a quarter of the tree have been
+// checked, as the scene is then too open for it to pay for itself. Coverage
+// forced on is kept regardless
+static const size_t COVERAGE_SHARE = 64;
+
+template <typename T>
+static void coverage_corners(const vertex_pool_t<T>& pool, const indexed_triangle_t<T>& tri,
+                             double (&corners)[3][3]) {
+  for (int i = 0; i < 3; ++i) {
+    const point_t<T>& p = pool[tri[i]];
+    corners[i][0] = p.x;
+    corners[i][1] = p.y;
+    corners[i][2] = p.z;
+  }
+}
+
+// The bounding box of the vertices of the pool. Returns false for an empty pool
+template <typename T>
+static bool pool_bounds(const vertex_pool_t<T>& pool, double (&low)[3], double (&high)[3]) {
+  if (pool.size() == 0) return false;
+  const point_t<T>& first = pool[0];
+  low[0] = high[0] = first.x;
+  low[1] = high[1] = first.y;
+  low[2] = high[2] = first.z;
+  for (uint32_t i = 1; i < pool.size(); ++i) {
+    const point_t<T>& p = pool[i];
+    double coords[3] = {double(p.x), double(p.y), double(p.z)};
+    for (int k = 0; k < 3; ++k) {
+      low[k] = std::min(low[k], coords[k]);
+      high[k] = std::max(high[k], coords[k]);
+    }
+  }
+  return true;
+}
+
+// The tolerance of planes through geometry within the box from low to high.
+// Shadow planes also pass through the light, which adds to the magnitude of
+// the coordinates they are computed from
+template <typename T>
+static T bounds_tolerance(const double (&low)[3], const double (&high)[3],
+                          const point_t<T>* light = nullptr) {
+  double extent = 0;
+  double magnitude = 0;
+  for (int k = 0; k < 3; ++k) {
+    extent = std::max(extent, high[k] - low[k]);
+    magnitude = std::max(magnitude, std::max(std::abs(low[k]), std::abs(high[k])));
+  }
+  if (light) {
+    magnitude = std::max(magnitude, double(std::abs(light->x)));
+    magnitude = std::max(magnitude, double(std::abs(light->y)));
+    magnitude = std::max(magnitude, double(std::abs(light->z)));
+  }
+  return plane_t<T>::tolerance_for(T(extent), T(magnitude));
+}
+
+template <typename T>
+static coverage_cube* make_coverage(const point_t<T>& from, const double (&low)[3],
+                                    const double (&high)[3], size_t n_triangles,
+                                    bsp_types::CoverageMode mode) {
+  if (mode == bsp_types::COVERAGE_OFF) return nullptr;
+  if (mode == bsp_types::COVERAGE_AUTO && n_triangles < COVERAGE_CUTOFF) return nullptr;
+  double eye[3] = {double(from.x), double(from.y), double(from.z)};
+  return new coverage_cube(eye, low, high, n_triangles);
+}
+
+static void check_coverage(std::unique_ptr<coverage_cube>& coverage, size_t checked,
+                           size_t covered, size_t n_triangles, bsp_types::CoverageMode mode) {
+  if (mode == bsp_types::COVERAGE_AUTO && checked == n_triangles / 4 &&
+      covered * COVERAGE_SHARE < checked) {
+    coverage.reset();
+  }
+}
+
+template <typename T>
+void bsp_t<T>::fit_tolerance() {
+  double low[3], high[3];
+  if (pool_bounds(vertices, low, high)) {
+    vertices.set_tolerance(bounds_tolerance<T>(low, high));
+  }
+}
+
+template <typename T>
+void bsp_t<T>::build_tree(std::vector<triangle>& list, BuildStrategy strategy, size_t n_threads) {
+  vertex_pool pool;
+  std::vector<indexed_triangle> indexed;
+  indexed.reserve(list.size());
+  std::unordered_map<point, uint32_t> welded;
+  for (auto iter = list.begin(); iter != list.end(); ++iter) {
+    uint32_t corners[3];
+    for (int i = 0; i < 3; ++i) {
+      auto found = welded.emplace((*iter)[i], pool.size());
+      if (found.second) pool.add((*iter)[i]);
+      corners[i] = found.first->second;
+    }
+    indexed.emplace_back(corners[0], corners[1], corners[2], iter->normal(), iter->id(),
+                         iter->light(), iter->is_visible(), iter->is_back_facing());
+  }
+  std::vector<triangle>().swap(list);
+  build_tree(pool, indexed, strategy, n_threads);
+}
+
+template <typename T>
+void bsp_t<T>::build_tree(vertex_pool& pool, std::vector<indexed_triangle>& list,
+                          BuildStrategy strategy, size_t n_threads) {
+  structure = std::make_shared<bsp_structure<T> >();
+  ranges.clear();
+  triangles.clear();
+  counters = bsp_stats();
+  vertices = std::move(pool);
+  pool.clear();
+  if (list.size() == 0) {
+    add_node(false);
+    return;
+  }
+  fit_tolerance();
+  triangles.reserve(list.size());
+
+  if (n_threads <= 1 || list.size() < PARALLEL_CUTOFF) {
+    std::vector<uint32_t> vertex_ends;
+    grow_tree(list, vertices, *structure, ranges, triangles, vertex_ends, counters.build_splits,
+              strategy, [](std::vector<indexed_triangle>&, const vertex_pool&) {
+      return bsp_node::NONE;
+    });
+    vertices.clear_splits();
+    return;
+  }
+
+  // Large child lists are handed to the pool as separate parts. Once all parts
+  // are done they are spliced together in the same pre-order the serial build
+  // produces, so the resulting tree does not depend on the scheduling. The
+  // vertices of each part are appended to the pool in that order as well
+  const vertex_pool* base = &vertices;
+  const uint32_t n_base = vertices.size();
+  std::deque<bsp_part<T> > parts(1);
+  parts.front().vertices = vertex_pool(base);
+  std::mutex parts_mutex;
+  task_pool workers(n_threads);
+  std::function<uint32_t(std::vector<indexed_triangle>&, const vertex_pool&, uint32_t)> spawn =
+    [&](std::vector<indexed_triangle>& child, const vertex_pool& source_pool, uint32_t source) {
+    if (child.size() < PARALLEL_CUTOFF) return bsp_node::NONE;
+    uint32_t id;
+    bsp_part<T>* part;
+    {
+      std::lock_guard<std::mutex> lock(parts_mutex);
+      id = parts.size();
+      parts.push_back(bsp_part<T>());
+      part = &parts.back();
+    }
+    part->vertices = vertex_pool(base);
+    part->source = source;
+    // Imported vertices keep their relative order so every edge is split from
+    // the same end as in the serial build
+    std::vector<uint32_t>& imported = part->imported;
+    for (auto iter = child.begin(); iter != child.end(); ++iter) {
+      for (int k = 0; k < 3; ++k) {
+        if ((*iter)[k] >= n_base) imported.push_back((*iter)[k]);
+      }
+    }
+    std::sort(imported.begin(), imported.end());
+    imported.erase(std::unique(imported.begin(), imported.end()), imported.end());
+    for (auto iter = imported.begin(); iter != imported.end(); ++iter) {
+      part->vertices.add(source_pool[*iter]);
+    }
+    for (auto iter = child.begin(); iter != child.end(); ++iter) {
+      for (int k = 0; k < 3; ++k) {
+        if ((*iter)[k] < n_base) continue;
+        auto found = std::lower_bound(imported.begin(), imported.end(), (*iter)[k]);
+        (*iter)[k] = n_base + (found - imported.begin());
+      }
+    }
+    std::shared_ptr<std::vector<indexed_triangle> > part_list(new std::vector<indexed_triangle>());
+    part_list->swap(child);
+    workers.submit([part, part_list, id, strategy, &spawn]() {
+      grow_tree(*part_list, part->vertices, part->structure, part->ranges, part->triangles,
+                part->vertex_ends, part->splits, strategy,
+                [&spawn, id](std::vector<indexed_triangle>& list, const vertex_pool& pool) {
+        return spawn(list, pool, id);
+      });
+    });
+    return PART_FLAG | id;
+  };
+  bsp_part<T>& root = parts.front();
+  std::shared_ptr<std::vector<indexed_triangle> > root_list(new std::vector<indexed_triangle>());
+  root_list->swap(list);
+  workers.submit([&root, root_list, strategy, &spawn]() {
+    grow_tree(*root_list, root.vertices, root.structure, root.ranges, root.triangles,
+              root.vertex_ends, root.splits, strategy,
+              [&spawn](std::vector<indexed_triangle>& list, const vertex_pool& pool) {
+      return spawn(list, pool, 0);
+    });
+  });
+  workers.wait();
+  for (auto iter = parts.begin(); iter != parts.end(); ++iter) {
+    counters.build_splits += iter->splits;
+  }
+
+  struct splice_task {
+    uint32_t part;
+    uint32_t node;
+    uint32_t parent;
+    bool is_front;
+  };
+  std::vector<bsp_node>& nodes = structure->nodes;
+  std::vector<plane>& planes = structure->planes;
+  std::vector<splice_task> stack;
+  // The index in the final pool of every vertex local to a part. New vertices
+  // are added node by node so they are numbered as in the serial build
+  std::vector<std::vector<uint32_t> > final_index(parts.size());
+  auto to_final = [&](uint32_t part, uint32_t index) {
+    return index < n_base ? index : final_index[part][index - n_base];
+  };
+  stack.push_back({0, 0, bsp_node::NONE, false});
+  while (!stack.empty()) {
+    splice_task task = stack.back();
+    stack.pop_back();
+    const bsp_part<T>& part = parts[task.part];
+    const bsp_node& old_node = part.structure.nodes[task.node];
+    const bsp_range& old_range = part.ranges[task.node];
+    const std::vector<point>& local = part.vertices.local();
+    std::vector<uint32_t>& index = final_index[task.part];
+    uint32_t first_vertex = part.imported.size();
+    if (task.node == 0) {
+      // Parts are entered at their root, after the part they were spawned from
+      index.resize(local.size());
+      for (uint32_t i = 0; i < first_vertex; ++i) {
+        index[i] = to_final(part.source, part.imported[i]);
+      }
+    } else {
+      first_vertex = part.vertex_ends[task.node - 1] - n_base;
+    }
+    for (uint32_t i = first_vertex; i < part.vertex_ends[task.node] - n_base; ++i) {
+      index[i] = vertices.add(local[i]);
+    }
+
+    uint32_t node = add_node(false);
+    ranges.push_back(bsp_range());
+    if (task.parent != bsp_node::NONE) {
+      if (task.is_front) {
+        nodes[task.parent].front = node;
+      } else {
+        nodes[task.parent].back = node;
+      }
+    }
+    nodes[node].partition = planes.size();
+    planes.push_back(part.structure.planes[old_node.partition]);
+    ranges[node].first = triangles.size();
+    ranges[node].count = old_range.count;
+    for (uint32_t i = old_range.first; i < old_range.first + old_range.count; ++i) {
+      indexed_triangle tri = part.triangles[i];
+      for (int k = 0; k < 3; ++k) {
+        tri[k] = to_final(task.part, tri[k]);
+      }
       triangles.push_back(tri);
-      break;
-    case IN_BACK_OF:
-      back_list.push_back(tri);
-      break;
-    case IN_FRONT_OF:
-      front_list.push_back(tri);
-      break;
-    case SPAN: {
-      cut_tri split = partition.split_triangle(tri);
-      front_list.push_back(triangle(split.front));
-      back_list.push_back(triangle(split.back));
-      if (split.last_is_valid) {
-        if (split.last_is_front) {
-          front_list.push_back(triangle(split.extra));
-        } else {
-          back_list.push_back(triangle(split.extra));
+    }
+
+    uint32_t children[2] = {old_node.back, old_node.front};
+    for (int i = 0; i < 2; ++i) {
+      if (children[i] == bsp_node::NONE) continue;
+      if (children[i] & PART_FLAG) {
+        stack.push_back({children[i] & ~PART_FLAG, 0, node, i == 1});
+      } else {
+        stack.push_back({task.part, children[i], node, i == 1});
+      }
+    }
+  }
+}
+
+// Grows a new subtree for list within the tree and returns its root. The caller
+// links it to its parent
+template <typename T>
+uint32_t bsp_t<T>::grow_subtree(std::vector<indexed_triangle>& list, BuildStrategy strategy) {
+  uint32_t root = structure->nodes.size();
+  ranges.resize(root);
+  std::vector<uint32_t> vertex_ends;
+  grow_tree(list, vertices, *structure, ranges, triangles, vertex_ends, counters.build_splits,
+            strategy, [](std::vector<indexed_triangle>&, const vertex_pool&) {
+    return bsp_node::NONE;
+  });
+  vertices.clear_splits();
+  return root;
+}
+
+// Rewrites the tree in pre-order from the root, leaving out nodes that can no
+// longer be reached and triangles rejected by keep(). added holds triangles
+// for existing nodes, which are placed after those already there
+template <typename T>
+template <typename Keep>
+void bsp_t<T>::compact(std::vector<std::pair<uint32_t, indexed_triangle> >& added, Keep keep) {
+  std::stable_sort(added.begin(), added.end(),
+                   [](const std::pair<uint32_t, indexed_triangle>& a,
+                      const std::pair<uint32_t, indexed_triangle>& b) {
+    return a.first < b.first;
+  });
+  std::shared_ptr<bsp_structure<T> > old = structure;
+  structure = std::make_shared<bsp_structure<T> >();
+  std::vector<bsp_node>& nodes = structure->nodes;
+  std::vector<plane>& planes = structure->planes;
+  std::vector<bsp_range> old_ranges;
+  std::vector<indexed_triangle> old_triangles;
+  old_ranges.swap(ranges);
+  old_triangles.swap(triangles);
+  triangles.reserve(old_triangles.size() + added.size());
+
+  struct compact_task {
+    uint32_t node;
+    uint32_t parent;
+    bool is_front;
+  };
+  std::vector<compact_task> stack;
+  stack.push_back({0, bsp_node::NONE, false});
+  while (!stack.empty()) {
+    compact_task task = stack.back();
+    stack.pop_back();
+    const bsp_node& old_node = old->nodes[task.node];
+    uint32_t node = add_node(old_node.is_out);
+    ranges.push_back(bsp_range());
+    if (task.parent != bsp_node::NONE) {
+      if (task.is_front) {
+        nodes[task.parent].front = node;
+      } else {
+        nodes[task.parent].back = node;
+      }
+    }
+    if (old_node.partition != bsp_node::NONE) {
+      nodes[node].partition = planes.size();
+      planes.push_back(old->planes[old_node.partition]);
+    }
+
+    ranges[node].first = triangles.size();
+    if (task.node < old_ranges.size()) {
+      const bsp_range& range = old_ranges[task.node];
+      for (uint32_t i = range.first; i < range.first + range.count; ++i) {
+        if (keep(old_triangles[i])) triangles.push_back(old_triangles[i]);
+      }
+    }
+    auto extra = std::lower_bound(added.begin(), added.end(), task.node,
+                                  [](const std::pair<uint32_t, indexed_triangle>& a, uint32_t n) {
+      return a.first < n;
+    });
+    for (; extra != added.end() && extra->first == task.node; ++extra) {
+      triangles.push_back(extra->second);
+    }
+    ranges[node].count = triangles.size() - ranges[node].first;
+
+    if (old_node.back != bsp_node::NONE) {
+      stack.push_back({old_node.back, node, false});
+    }
+    if (old_node.front != bsp_node::NONE) {
+      stack.push_back({old_node.front, node, true});
+    }
+  }
+}
+
+// Drops the vertices no triangle refers to once they make up most of the pool,
+// as happens when geometry is removed again and again. The vertices keep their
+// relative order so edges are still split from the same end
+template <typename T>
+void bsp_t<T>::compact_pool() {
+  std::vector<uint32_t> index(vertices.size(), bsp_node::NONE);
+  size_t n_used = 0;
+  for (auto iter = triangles.begin(); iter != triangles.end(); ++iter) {
+    for (int k = 0; k < 3; ++k) {
+      if (index[(*iter)[k]] == bsp_node::NONE) {
+        index[(*iter)[k]] = 0;
+        ++n_used;
+      }
+    }
+  }
+  if (n_used * 2 >= vertices.size()) return;
+  vertex_pool pool;
+  pool.set_tolerance(vertices.tolerance());
+  pool.reserve(n_used);
+  for (uint32_t i = 0; i < index.size(); ++i) {
+    if (index[i] != bsp_node::NONE) index[i] = pool.add(vertices[i]);
+  }
+  for (auto iter = triangles.begin(); iter != triangles.end(); ++iter) {
+    for (int k = 0; k < 3; ++k) {
+      (*iter)[k] = index[(*iter)[k]];
+    }
+  }
+  vertices = std::move(pool);
+}
+
+template <typename T>
+void bsp_t<T>::insert(const vertex_pool& pool, std::vector<indexed_triangle>& list,
+                      BuildStrategy strategy) {
+  if (list.empty()) return;
+  uint32_t shift = vertices.size();
+  vertices.reserve(shift + pool.size());
+  for (uint32_t i = 0; i < pool.size(); ++i) {
+    vertices.add(pool[i]);
+  }
+  for (auto iter = list.begin(); iter != list.end(); ++iter) {
+    for (int k = 0; k < 3; ++k) {
+      (*iter)[k] += shift;
+    }
+  }
+  if (structure->nodes.empty() || structure->nodes[0].partition == bsp_node::NONE) {
+    // Nothing to push the triangles through, so they make up the whole tree
+    structure = std::make_shared<bsp_structure<T> >();
+    ranges.clear();
+    triangles.clear();
+    fit_tolerance();
+    grow_subtree(list, strategy);
+    return;
+  }
+  detach();
+
+  // Triangles end up either in a node they are coplanar with, or in an empty
+  // child of a node where they are grouped by node and side to grow new
+  // subtrees. Splits use the index of the partition as plane id as in the build
+  const std::vector<bsp_node>& nodes = structure->nodes;
+  const std::vector<plane>& planes = structure->planes;
+  std::vector<std::pair<uint32_t, indexed_triangle> > placed;
+  std::vector<std::pair<uint32_t, indexed_triangle> > homeless;
+  std::vector<std::pair<uint32_t, indexed_triangle> > stack;
+  auto descend = [&](uint32_t node, bool is_front, const indexed_triangle& tri) {
+    uint32_t child = is_front ? nodes[node].front : nodes[node].back;
+    if (child == bsp_node::NONE) {
+      homeless.emplace_back(node * 2 + is_front, tri);
+    } else {
+      stack.emplace_back(child, tri);
+    }
+  };
+  for (auto iter = list.begin(); iter != list.end(); ++iter) {
+    stack.emplace_back(0, *iter);
+    while (!stack.empty()) {
+      uint32_t node = stack.back().first;
+      indexed_triangle current = stack.back().second;
+      stack.pop_back();
+      const plane& partition = planes[nodes[node].partition];
+      switch (vertices.classify(partition, current)) {
+      case COINCIDENT:
+        placed.emplace_back(node, current);
+        break;
+      case IN_BACK_OF:
+        descend(node, false, current);
+        break;
+      case IN_FRONT_OF:
+        descend(node, true, current);
+        break;
+      case SPAN: {
+        indexed_cut split = vertices.split_triangle(partition, nodes[node].partition, current);
+        ++counters.build_splits;
+        if (split.last_is_valid) {
+          descend(node, split.last_is_front, split.extra);
         }
+        descend(node, false, split.back);
+        descend(node, true, split.front);
+        break;
+      }
+      default:
+        break;
       }
-      break;
     }
-    default:
-      break;
+  }
+  vertices.clear_splits();
+  std::vector<indexed_triangle>().swap(list);
+
+  std::stable_sort(homeless.begin(), homeless.end(),
+                   [](const std::pair<uint32_t, indexed_triangle>& a,
+                      const std::pair<uint32_t, indexed_triangle>& b) {
+    return a.first < b.first;
+  });
+  std::vector<indexed_triangle> sub_list;
+  for (auto iter = homeless.begin(); iter != homeless.end();) {
+    uint32_t slot = iter->first;
+    sub_list.clear();
+    for (; iter != homeless.end() && iter->first == slot; ++iter) {
+      sub_list.push_back(iter->second);
+    }
+    uint32_t root = grow_subtree(sub_list, strategy);
+    bsp_node& parent = structure->nodes[slot / 2];
+    if (slot % 2 == 1) {
+      parent.front = root;
+    } else {
+      parent.back = root;
     }
   }
-  if (!front_list.empty()) {
-    front = std::unique_ptr<bsp>(new bsp(front_list));
+  if (!placed.empty()) {
+    compact(placed, [](const indexed_triangle&) { return true; });
   }
-  if (!back_list.empty()) {
-    back = std::unique_ptr<bsp>(new bsp(back_list));
+}
+
+template <typename T>
+void bsp_t<T>::remove(const std::vector<int>& ids, BuildStrategy strategy) {
+  if (ids.empty() || triangles.empty()) return;
+  std::vector<std::pair<uint32_t, indexed_triangle> > added;
+  compact(added, [&](const indexed_triangle& tri) {
+    return !std::binary_search(ids.begin(), ids.end(), tri.id());
+  });
+
+  // The tree is in pre-order now so children always follow their parent.
+  // Count the nodes and tombstones of every subtree bottom up
+  const std::vector<bsp_node>& nodes = structure->nodes;
+  uint32_t n = nodes.size();
+  std::vector<uint32_t> total(n, 1);
+  std::vector<uint32_t> dead(n, 0);
+  std::vector<uint32_t> parent(n, bsp_node::NONE);
+  for (uint32_t i = n; i-- > 0;) {
+    if (ranges[i].count == 0) ++dead[i];
+    uint32_t children[2] = {nodes[i].front, nodes[i].back};
+    for (int k = 0; k < 2; ++k) {
+      if (children[k] == bsp_node::NONE) continue;
+      total[i] += total[children[k]];
+      dead[i] += dead[children[k]];
+      parent[children[k]] = i;
+    }
+  }
+  // The topmost subtrees made up of more tombstones than live nodes are
+  // rebuilt. Subtrees without any triangles left are cut off altogether
+  std::vector<uint32_t> rebuild;
+  std::vector<bool> inside(n, false);
+  for (uint32_t i = 0; i < n; ++i) {
+    bool covered = parent[i] != bsp_node::NONE && inside[parent[i]];
+    if (!covered && dead[i] * TOMBSTONE_SHARE > total[i]) {
+      rebuild.push_back(i);
+      covered = true;
+    }
+    inside[i] = covered;
   }
+
+  if (!rebuild.empty() && rebuild[0] == 0) {
+    std::vector<indexed_triangle> list;
+    list.swap(triangles);
+    structure = std::make_shared<bsp_structure<T> >();
+    ranges.clear();
+    if (list.empty()) {
+      add_node(false);
+    } else {
+      grow_subtree(list, strategy);
+    }
+  } else if (!rebuild.empty()) {
+    std::vector<indexed_triangle> list;
+    std::vector<uint32_t> stack;
+    for (auto root = rebuild.begin(); root != rebuild.end(); ++root) {
+      list.clear();
+      stack.assign(1, *root);
+      while (!stack.empty()) {
+        uint32_t node = stack.back();
+        stack.pop_back();
+        list.insert(list.end(), triangles.begin() + ranges[node].first,
+                    triangles.begin() + ranges[node].first + ranges[node].count);
+        if (structure->nodes[node].front != bsp_node::NONE) stack.push_back(structure->nodes[node].front);
+        if (structure->nodes[node].back != bsp_node::NONE) stack.push_back(structure->nodes[node].back);
+      }
+      uint32_t grown = list.empty() ? bsp_node::NONE : grow_subtree(list, strategy);
+      bsp_node& above = structure->nodes[parent[*root]];
+      if (above.front == *root) {
+        above.front = grown;
+      } else {
+        above.back = grown;
+      }
+    }
+    compact(added, [](const indexed_triangle&) { return true; });
+  }
+  compact_pool();
 }
 
-void bsp::add_triangle(const triangle& tri) {
-  if (is_leaf()) {
-    partition = tri;
-    triangles.push_back(tri);
-    front = std::unique_ptr<bsp>(new bsp(true));
-    back = std::unique_ptr<bsp>(new bsp(false));
-  } else {
-    switch (partition.classify_triangle(tri)) {
+template <typename T>
+void bsp_t<T>::add_triangle(uint32_t node, const triangle& tri) {
+  detach();
+  std::vector<bsp_node>& nodes = structure->nodes;
+  std::vector<plane>& planes = structure->planes;
+  insert_stack.clear();
+  insert_stack.emplace_back(node, tri);
+  while (!insert_stack.empty()) {
+    node = insert_stack.back().first;
+    triangle current = insert_stack.back().second;
+    insert_stack.pop_back();
+    if (!current.is_valid()) {
+      // Collapsed sides define no plane and add nothing to the volume
+      continue;
+    }
+
+    if (is_leaf(node)) {
+      nodes[node].partition = planes.size();
+      planes.push_back(plane(current, vertices.tolerance()));
+      uint32_t front = add_node(true);
+      uint32_t back = add_node(false);
+      nodes[node].front = front;
+      nodes[node].back = back;
+      continue;
+    }
+    const plane& partition = planes[nodes[node].partition];
+    switch (partition.classify_triangle(current)) {
     case COINCIDENT:
-      triangles.push_back(tri);
       break;
     case IN_BACK_OF:
-      back->add_triangle(tri);
+      insert_stack.emplace_back(nodes[node].back, current);
       break;
     case IN_FRONT_OF:
-      front->add_triangle(tri);
+      insert_stack.emplace_back(nodes[node].front, current);
       break;
     case SPAN: {
-      cut_tri split = partition.split_triangle(tri);
-      front->add_triangle(split.front);
-      back->add_triangle(split.back);
+      cut_tri split = partition.split_triangle(current);
       if (split.last_is_valid) {
-        if (split.last_is_front) {
-          front->add_triangle(split.extra);
-        } else {
-          back->add_triangle(split.extra);
-        }
+        insert_stack.emplace_back(split.last_is_front ? nodes[node].front : nodes[node].back, split.extra);
       }
+      insert_stack.emplace_back(nodes[node].back, split.back);
+      insert_stack.emplace_back(nodes[node].front, split.front);
       break;
     }
     default:
@@ -84,130 +838,1122 @@ void bsp::add_triangle(const triangle& tri) {
   }
 }
 
-void bsp::add_shadow(const point& light, triangle& tri,
-                     std::vector<triangle>& new_triangles, bool view,
-                     double intensity = 1) {
-  if (is_leaf()) {
-    if (is_out) {
-      add_triangle({light, tri.a(), tri.b()});
-      add_triangle({light, tri.b(), tri.c()});
-      add_triangle({light, tri.c(), tri.a()});
-      if (view) {
-        tri.set_visibility(true);
+// Tells whether the leaf at the end of shadow_path already lies behind the
+// plane of the shadow side through light, a, and b, so adding it would only
+// give the leaf an empty front. That is the case when an ancestor partition
+// holds the edge from a to b, which it does for every edge cut by the volume
+// and for an edge shared with a lit neighbour whose shadow was added around the
+// leaf. Fragments inside a patch facing the light only add the sides that fail
+// this, so mostly the silhouette of the patch gets planes, while edges that no
+// neighbour has bounded yet still get theirs and the volume stays exact
+template <typename T>
+bool bsp_t<T>::is_bounded_by(const point& light, const point& a, const point& b) const {
+  const std::vector<bsp_node>& nodes = structure->nodes;
+  const std::vector<plane>& planes = structure->planes;
+  for (size_t i = shadow_path.size() - 1; i > 0; --i) {
+    const bsp_node& parent = nodes[shadow_path[i - 1]];
+    const plane& partition = planes[parent.partition];
+    if (partition.classify_point(a) != 0 || partition.classify_point(b) != 0) {
+      continue;
+    }
+    // Corners within the tolerance of the partition can still give a side
+    // plane at an angle to it when the edge is short, in which case it is added
+    vec3 side = (a - light).cross(b - light);
+    T length = side.length();
+    if (!(length > 0) ||
+        side.cross(partition.normal()).length() > plane::RELATIVE_EPSILON * length) {
+      return false;
+    }
+    // The side plane is the partition, possibly turned around
+    bool same = side.dot(partition.normal()) > 0;
+    return (parent.back == shadow_path[i]) == same;
+  }
+  return false;
+}
+
+// Tells whether a fragment is too thin as seen from the light for its sides to
+// be told apart within the tolerance. The later sides would then be dropped as
+// coincident with the first when added, leaving everything behind the first in
+// shadow, so such a fragment adds no planes and hides at most a sliver
+template <typename T>
+bool bsp_t<T>::is_edge_on(const point& light, const point& a, const point& b,
+                          const point& c) const {
+  const point corners[3] = {a, b, c};
+  for (int i = 0; i < 3; ++i) {
+    triangle side(light, corners[i], corners[(i + 1) % 3]);
+    if (!side.is_valid() ||
+        plane(side, vertices.tolerance()).classify_point(corners[(i + 2) % 3]) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Marks in flags the triangle ids whose triangle faces the light along with the
+// triangles across all three of its edges, so none of its edges is part of a
+// silhouette, a border or a non-manifold edge. Ids without a triangle in the
+// tree count as facing away. flags is left empty without neighbours
+template <typename T>
+void bsp_t<T>::find_inner(const point& light, std::vector<uint8_t>& flags) const {
+  flags.clear();
+  if (!neighbours) return;
+  const std::vector<int>& across = *neighbours;
+  size_t n_ids = across.size() / 3;
+  // 1 for facing the light and 2 for facing away, from the first fragment of
+  // each id as they all lie in the plane of the triangle
+  std::vector<uint8_t> facing(n_ids, 0);
+  for (auto iter = triangles.begin(); iter != triangles.end(); ++iter) {
+    int id = iter->id();
+    if (id < 0 || size_t(id) >= n_ids || facing[id] != 0) continue;
+    facing[id] = iter->normal().dot(light - vertices[(*iter)[0]]) > 0 ? 1 : 2;
+  }
+  flags.assign(n_ids, 0);
+  for (size_t id = 0; id < n_ids; ++id) {
+    bool patch = facing[id] == 1;
+    for (int k = 0; k < 3 && patch; ++k) {
+      int other = across[3 * id + k];
+      patch = other >= 0 && size_t(other) < n_ids && facing[other] == 1;
+    }
+    flags[id] = patch;
+  }
+}
+
+// Cuts tri by the shadow volume. The new corners are added to pool, using the
+// index of the shadow plane as plane id. The fragments that end up outside the
+// volume extend it, and are added to coverage if one is given. Fragments of
+// triangles marked in inner leave out the sides the volume already bounds
+template <typename T>
+void bsp_t<T>::add_shadow(const point& light, const indexed_triangle& tri, vertex_pool& pool,
+                          std::vector<indexed_triangle>& new_triangles, bool view,
+                          T intensity, coverage_cube* coverage) {
+  const std::vector<bsp_node>& nodes = structure->nodes;
+  const std::vector<plane>& planes = structure->planes;
+  bool shadowed = false;
+  shadow_out.clear();
+  shadow_stack.clear();
+  shadow_stack.push_back({0, 0, tri});
+  while (!shadow_stack.empty()) {
+    uint32_t node = shadow_stack.back().node;
+    uint32_t depth = shadow_stack.back().depth;
+    indexed_triangle current = shadow_stack.back().triangle;
+    shadow_stack.pop_back();
+    // Fragments are visited depth first, so the path above this node is still
+    // the one it was reached by
+    shadow_path.resize(depth);
+    shadow_path.push_back(node);
+
+    if (is_leaf(node)) {
+      if (nodes[node].is_out) {
+        const point& a = pool[current[0]];
+        const point& b = pool[current[1]];
+        const point& c = pool[current[2]];
+        if (!is_edge_on(light, a, b, c)) {
+          // Checked before adding any, as the path only leads to the leaf
+          int id = current.id();
+          bool patch = id >= 0 && size_t(id) < inner.size() && inner[id];
+          bool ab = patch && is_bounded_by(light, a, b);
+          bool bc = patch && is_bounded_by(light, b, c);
+          bool ca = patch && is_bounded_by(light, c, a);
+          if (ab && bc && ca) {
+            // The fragment fills the leaf
+            structure->nodes[node].is_out = false;
+          }
+          if (!ab) add_triangle(node, {light, a, b});
+          if (!bc) add_triangle(node, {light, b, c});
+          if (!ca) add_triangle(node, {light, c, a});
+        }
+        if (coverage) shadow_out.push_back(new_triangles.size());
+        if (view) {
+          current.set_visibility(true);
+        } else {
+          T mod = (light.distance_to(a) + light.distance_to(b) + light.distance_to(c)) / 3;
+          current.illuminate(intensity / (mod * mod));
+        }
       } else {
-        double mod = (light.distance_to(tri.a()) + light.distance_to(tri.b()) + light.distance_to(tri.c())) / 3;
-        tri.illuminate(intensity / (mod * mod));
+        shadowed = true;
+        if (view) {
+          current.set_visibility(false);
+        }
       }
-    } else if (view) {
-      tri.set_visibility(false);
+      new_triangles.push_back(current);
+      continue;
     }
-    new_triangles.push_back(tri);
-  } else {
-    switch (partition.classify_triangle(tri)) {
+    const plane& partition = planes[nodes[node].partition];
+    ++depth;
+    switch (pool.classify(partition, current)) {
     case COINCIDENT:
-      triangles.push_back(tri);
+      // Edge-on to the light so it is dropped from the result
       break;
     case IN_BACK_OF:
-      back->add_shadow(light, tri, new_triangles, view, intensity);
+      shadow_stack.push_back({nodes[node].back, depth, current});
       break;
     case IN_FRONT_OF:
-      front->add_shadow(light, tri, new_triangles, view, intensity);
+      shadow_stack.push_back({nodes[node].front, depth, current});
       break;
     case SPAN: {
-      cut_tri split = partition.split_triangle(tri);
-      front->add_shadow(light, split.front, new_triangles, view, intensity);
-      back->add_shadow(light, split.back, new_triangles, view, intensity);
+      indexed_cut split = pool.split_triangle(partition, nodes[node].partition, current);
+      ++counters.shadow_splits;
       if (split.last_is_valid) {
-        if (split.last_is_front) {
-          front->add_shadow(light, split.extra, new_triangles, view, intensity);
-        } else {
-          back->add_shadow(light, split.extra, new_triangles, view, intensity);
-        }
+        shadow_stack.push_back({split.last_is_front ? nodes[node].front : nodes[node].back, depth, split.extra});
       }
+      shadow_stack.push_back({nodes[node].back, depth, split.back});
+      shadow_stack.push_back({nodes[node].front, depth, split.front});
       break;
     }
     default:
       break;
     }
   }
+
+  if (coverage && !shadow_out.empty()) {
+    // A triangle fully outside the volume is added as a whole rather than as
+    // the many pieces the volume may have cut it into
+    double corners[3][3];
+    if (!shadowed) {
+      coverage_corners(pool, tri, corners);
+      coverage->add(corners);
+      return;
+    }
+    for (auto iter = shadow_out.begin(); iter != shadow_out.end(); ++iter) {
+      coverage_corners(pool, new_triangles[*iter], corners);
+      coverage->add(corners);
+    }
+  }
+}
+
+// Visits every node with triangles ordered from nearest to farthest as seen
+// from pos, passing along the classification of pos against its partition
+template <typename T>
+template <typename Visit>
+void bsp_t<T>::traverse(const point& pos, Visit visit) const {
+  const std::vector<bsp_node>& nodes = structure->nodes;
+  const std::vector<plane>& planes = structure->planes;
+  struct entry {
+    uint32_t node;
+    bool expanded;
+    T side;
+  };
+  std::vector<entry> stack;
+  stack.push_back({0, false, 0.0});
+  while (!stack.empty()) {
+    entry current = stack.back();
+    stack.pop_back();
+    if (current.expanded) {
+      visit(current.node, current.side);
+      continue;
+    }
+    const bsp_node& node = nodes[current.node];
+    if (node.partition == bsp_node::NONE) continue;
+
+    T side = planes[node.partition].classify_point(pos);
+    uint32_t near = side < 0 ? node.back : node.front;
+    uint32_t far = side < 0 ? node.front : node.back;
+    if (far != bsp_node::NONE) {
+      stack.push_back({far, false, 0.0});
+    }
+    stack.push_back({current.node, true, side});
+    if (near != bsp_node::NONE) {
+      stack.push_back({near, false, 0.0});
+    }
+  }
+}
+
+// As traverse() but for several positions in one walk of the tree. Positions
+// on the same side of a partition see its subtrees in the same order and are
+// carried down together, and a group is only split where a partition passes
+// between its positions. Every position still sees the nodes nearest to
+// farthest, but the walks of the groups are interleaved. visit(node, first,
+// last) gets the positions for which the node is next as a range of indices
+// into positions, leaving out those lying in its partition
+template <typename T>
+template <typename Visit>
+void bsp_t<T>::traverse_group(const std::vector<point>& positions, Visit visit) const {
+  const std::vector<bsp_node>& nodes = structure->nodes;
+  const std::vector<plane>& planes = structure->planes;
+  // Groups are ranges of members which are only ever reordered within the
+  // range of the entry they were pushed with
+  struct entry {
+    uint32_t node;
+    bool expanded;
+    uint32_t first;
+    uint32_t last;
+  };
+  std::vector<uint32_t> members(positions.size());
+  for (uint32_t i = 0; i < members.size(); ++i) {
+    members[i] = i;
+  }
+  std::vector<T> sides(positions.size());
+  std::vector<entry> stack;
+  if (!members.empty()) stack.push_back({0, false, 0, uint32_t(members.size())});
+  while (!stack.empty()) {
+    entry current = stack.back();
+    stack.pop_back();
+    if (current.expanded) {
+      visit(current.node, members.data() + current.first, members.data() + current.last);
+      continue;
+    }
+    const bsp_node& node = nodes[current.node];
+    if (node.partition == bsp_node::NONE) continue;
+
+    const plane& partition = planes[node.partition];
+    for (uint32_t i = current.first; i < current.last; ++i) {
+      sides[members[i]] = partition.classify_point(positions[members[i]]);
+    }
+    // Behind the partition, in it and in front of it
+    auto begin = members.begin();
+    uint32_t in = std::stable_partition(begin + current.first, begin + current.last,
+                                        [&](uint32_t i) { return sides[i] < 0; }) - begin;
+    uint32_t front = std::stable_partition(begin + in, begin + current.last,
+                                           [&](uint32_t i) { return sides[i] == 0; }) - begin;
+    const uint32_t bounds[4] = {current.first, in, front, current.last};
+    for (int group = 0; group < 3; ++group) {
+      uint32_t first = bounds[group];
+      uint32_t last = bounds[group + 1];
+      if (first == last) continue;
+      uint32_t near = group == 0 ? node.back : node.front;
+      uint32_t far = group == 0 ? node.front : node.back;
+      if (far != bsp_node::NONE) stack.push_back({far, false, first, last});
+      if (group != 1) stack.push_back({current.node, true, first, last});
+      if (near != bsp_node::NONE) stack.push_back({near, false, first, last});
+    }
+  }
 }
 
-void bsp::cut_by_shadows(bsp& shadow_bsp, const point& light, bool view,
-                         double intensity) {
-  if (triangles.size() == 0) return;
+template <typename T>
+void bsp_t<T>::cut_by_shadows(bsp& shadow_bsp, const point& light, bool view,
+                         T intensity, const frustum& cone) {
+  std::vector<indexed_triangle> new_triangles;
+  new_triangles.reserve(triangles.size());
+  find_inner(light, shadow_bsp.inner);
+  // Triangles are visited near to far, so one lying in directions already
+  // covered by those before it is fully in the shadow volume and is passed on
+  // as it would come out of it
+  double low[3], high[3];
+  std::unique_ptr<coverage_cube> coverage;
+  if (pool_bounds(vertices, low, high)) {
+    shadow_bsp.vertices.set_tolerance(bounds_tolerance(low, high, &light));
+    coverage.reset(make_coverage(light, low, high, triangles.size(), coverage_mode));
+  }
+  double corners[3][3];
+  size_t checked = 0, covered = 0;
 
-  double result = partition.classify_point(light);
-  if (result < 0) {
-    if (back != nullptr) {
-      back->cut_by_shadows(shadow_bsp, light, view, intensity);
+  traverse(light, [&](uint32_t node, T side) {
+    uint32_t first = new_triangles.size();
+    auto iter = triangles.begin() + ranges[node].first;
+    auto end = iter + ranges[node].count;
+    if (side == 0) {
+      new_triangles.insert(new_triangles.end(), iter, end);
+    } else {
+      for (; iter != end; ++iter) {
+        bool front_facing = (*iter).normal().dot(light - vertices[(*iter)[0]]) >= 0;
+        if (view && !cone.is_empty() &&
+            cone.is_outside(vertices[(*iter)[0]], vertices[(*iter)[1]], vertices[(*iter)[2]])) {
+          // Outside the view so it can neither be seen nor hide anything seen
+          indexed_triangle tri = *iter;
+          tri.set_visibility(false);
+          tri.set_back_facing(!front_facing);
+          new_triangles.push_back(tri);
+        } else if (front_facing) {
+          if (coverage) {
+            coverage_corners(vertices, *iter, corners);
+            check_coverage(coverage, ++checked, covered, triangles.size(), coverage_mode);
+          }
+          if (coverage && coverage->is_covered(corners)) {
+            indexed_triangle tri = *iter;
+            if (view) {
+              tri.set_visibility(false);
+            }
+            new_triangles.push_back(tri);
+            ++covered;
+          } else {
+            shadow_bsp.add_shadow(light, *iter, vertices, new_triangles, view, intensity,
+                                  coverage.get());
+          }
+        } else {
+          indexed_triangle tri = *iter;
+          if (view) {
+            tri.set_back_facing(true);
+          }
+          new_triangles.push_back(tri);
+        }
+      }
     }
-  } else {
-    if (front != nullptr) {
-      front->cut_by_shadows(shadow_bsp, light, view, intensity);
+    ranges[node].first = first;
+    ranges[node].count = new_triangles.size() - first;
+  });
+
+  triangles.swap(new_triangles);
+  vertices.clear_splits();
+  counters.covered += covered;
+  counters.shadow_splits += shadow_bsp.counters.shadow_splits;
+  counters.shadow_nodes.push_back(shadow_bsp.node_count());
+}
+
+template <typename T>
+void bsp_t<T>::shine_light(const point& light, T intensity) {
+  bsp shadow_volume(true);
+  cut_by_shadows(shadow_volume, light, false, intensity, frustum());
+}
+
+// The view is split into this many slices per thread, so threads done with
+// their slices early can take over those of others
+static const size_t SLICES_PER_THREAD = 2;
+
+// Splits the view into n_slices slices, n_slices being a power of two, by
+// planes through pos around the axis across the view. The planes form a
+// complete binary tree in which plane i has the directions turned further from
+// direction() towards across() than it in front of it, in the part of plane
+// 2i + 2, and the rest behind it, in the part of plane 2i + 1. The slices are
+// the leaves that follow the planes. Any such planes keep every ray from pos
+// in one slice, so they are only placed to give the slices equal shares of the
+// given angles of the triangles
+template <typename T>
+static std::vector<plane_t<T> > slice_planes(const point_t<T>& pos, const frustum_t<T>& cone,
+                                             std::vector<T>& angles, size_t n_slices,
+                                             T tolerance) {
+  typedef vec3_t<T> vec3;
+  std::vector<plane_t<T> > planes;
+  if (angles.empty()) return planes;
+  // Angles are measured from the middle of the widest gap between them, so
+  // triangles all around pos are still sorted into neighbouring runs
+  std::sort(angles.begin(), angles.end());
+  T start = angles.back() - 2 * M_PI;
+  T widest = angles.front() - start;
+  for (size_t i = 1; i < angles.size(); ++i) {
+    if (angles[i] - angles[i - 1] > widest) {
+      widest = angles[i] - angles[i - 1];
+      start = angles[i - 1];
     }
   }
+  start += widest / 2;
+  for (auto iter = angles.begin(); iter != angles.end(); ++iter) {
+    if (*iter < start) *iter += 2 * M_PI;
+  }
+  std::sort(angles.begin(), angles.end());
+
+  const vec3& ahead = cone.direction();
+  const vec3& across = cone.across();
+  vec3 axis = ahead.cross(across);
+  std::vector<std::pair<size_t, size_t> > runs(1, std::make_pair(size_t(0), angles.size()));
+  for (size_t i = 0; i + 1 < n_slices; ++i) {
+    size_t first = runs[i].first;
+    size_t last = runs[i].second;
+    size_t middle = (first + last) / 2;
+    T angle = middle == 0 ? angles.front() :
+      middle == angles.size() ? angles.back() : (angles[middle - 1] + angles[middle]) / 2;
+    T c = std::cos(angle);
+    T s = std::sin(angle);
+    vec3 towards(ahead.x * c + across.x * s, ahead.y * c + across.y * s,
+                 ahead.z * c + across.z * s);
+    vec3 normal = axis.cross(towards);
+    planes.push_back(plane_t<T>(normal, -normal.dot(pos), tolerance));
+    runs.push_back(std::make_pair(first, middle));
+    runs.push_back(std::make_pair(middle, last));
+  }
+  return planes;
+}
+
+// Every ray from the eye stays within one slice, so a slice is only hidden by
+// the pieces inside it and needs nothing from the others. Triangles are handed
+// out to the slices in near to far order, cut along the borders in the shared
+// pool so pieces on either side of a border share their corners. Each slice
+// then goes through its own shadow volume, adding new corners to a pool of its
+// own, and the pieces are gathered back in the nodes they came from
+template <typename T>
+void bsp_t<T>::cut_by_slices(const point& pos, const frustum& cone, size_t n_threads) {
+  typedef std::pair<uint32_t, indexed_triangle> placed_triangle;
+  double low[3], high[3];
+  T tolerance = vertices.tolerance();
+  if (pool_bounds(vertices, low, high)) {
+    tolerance = bounds_tolerance(low, high, &pos);
+  }
+  std::vector<uint8_t> inner_ids;
+  find_inner(pos, inner_ids);
 
-  if (result != 0) {
-    auto iter = triangles.begin();
-    std::vector<triangle> new_triangles;
-    while (iter != triangles.end()) {
-      if ((*iter).normal().dot(light - (*iter)[0]) >= 0) {
-        shadow_bsp.add_shadow(light, *iter, new_triangles, view, intensity);
+  // Triangles that can't hide anything are left as they are, while the rest
+  // are split up between the slices, in near to far order
+  std::vector<placed_triangle> kept;
+  std::vector<placed_triangle> casting;
+  traverse(pos, [&](uint32_t node, T side) {
+    auto iter = triangles.begin() + ranges[node].first;
+    auto end = iter + ranges[node].count;
+    for (; iter != end; ++iter) {
+      if (side == 0) {
+        kept.emplace_back(node, *iter);
+        continue;
+      }
+      bool front_facing = (*iter).normal().dot(pos - vertices[(*iter)[0]]) >= 0;
+      if (!cone.is_empty() &&
+          cone.is_outside(vertices[(*iter)[0]], vertices[(*iter)[1]], vertices[(*iter)[2]])) {
+        indexed_triangle tri = *iter;
+        tri.set_visibility(false);
+        tri.set_back_facing(!front_facing);
+        kept.emplace_back(node, tri);
+      } else if (front_facing) {
+        casting.emplace_back(node, *iter);
       } else {
-        if (view) {
-          iter->set_back_facing(true);
+        indexed_triangle tri = *iter;
+        tri.set_back_facing(true);
+        kept.emplace_back(node, tri);
+      }
+    }
+  });
+
+  size_t n_slices = 1;
+  while (n_slices < n_threads * SLICES_PER_THREAD) n_slices *= 2;
+  std::vector<T> angles;
+  angles.reserve(casting.size());
+  const vec3& ahead = cone.direction();
+  const vec3& across = cone.across();
+  for (auto iter = casting.begin(); iter != casting.end(); ++iter) {
+    const indexed_triangle& tri = iter->second;
+    const point& a = vertices[tri[0]];
+    const point& b = vertices[tri[1]];
+    const point& c = vertices[tri[2]];
+    vec3 towards((a.x + b.x + c.x) / 3 - pos.x, (a.y + b.y + c.y) / 3 - pos.y,
+                 (a.z + b.z + c.z) / 3 - pos.z);
+    angles.push_back(std::atan2(towards.dot(across), towards.dot(ahead)));
+  }
+  std::vector<plane> borders = slice_planes(pos, cone, angles, n_slices, vertices.tolerance());
+  std::vector<T>().swap(angles);
+
+  std::vector<std::vector<placed_triangle> > sliced(n_slices);
+  std::vector<std::pair<uint32_t, indexed_triangle> > stack;
+  for (auto iter = casting.begin(); iter != casting.end(); ++iter) {
+    stack.emplace_back(0, iter->second);
+    while (!stack.empty()) {
+      uint32_t index = stack.back().first;
+      indexed_triangle piece = stack.back().second;
+      stack.pop_back();
+      if (index >= borders.size()) {
+        sliced[index - borders.size()].emplace_back(iter->first, piece);
+        continue;
+      }
+      const plane& border = borders[index];
+      switch (vertices.classify(border, piece)) {
+      case IN_FRONT_OF:
+        stack.emplace_back(2 * index + 2, piece);
+        break;
+      case SPAN: {
+        indexed_cut split = vertices.split_triangle(border, index, piece);
+        if (split.last_is_valid) {
+          stack.emplace_back(2 * index + (split.last_is_front ? 2 : 1), split.extra);
         }
-        new_triangles.push_back(*iter);
+        stack.emplace_back(2 * index + 1, split.back);
+        stack.emplace_back(2 * index + 2, split.front);
+        break;
+      }
+      default:
+        // Pieces in a border are seen edge-on and may go to either side
+        stack.emplace_back(2 * index + 1, piece);
+        break;
+      }
+    }
+  }
+  std::vector<placed_triangle>().swap(casting);
+
+  struct slice_result {
+    vertex_pool pool;
+    std::vector<placed_triangle> fragments;
+    size_t shadow_splits = 0;
+    size_t shadow_nodes = 0;
+    size_t covered = 0;
+  };
+  std::vector<slice_result> results(n_slices);
+  parallel_for(n_slices, n_threads, [&](size_t i) {
+    std::vector<placed_triangle> pieces;
+    pieces.swap(sliced[i]);
+    slice_result& result = results[i];
+    result.pool = vertex_pool(&vertices);
+    if (pieces.empty()) return;
+
+    bsp shadow_volume(true);
+    shadow_volume.inner = inner_ids;
+    shadow_volume.vertices.set_tolerance(tolerance);
+    double corners[3][3];
+    double slice_low[3], slice_high[3];
+    for (auto iter = pieces.begin(); iter != pieces.end(); ++iter) {
+      coverage_corners(vertices, iter->second, corners);
+      for (int j = 0; j < 3; ++j) {
+        for (int k = 0; k < 3; ++k) {
+          bool first = iter == pieces.begin() && j == 0;
+          slice_low[k] = first ? corners[j][k] : std::min(slice_low[k], corners[j][k]);
+          slice_high[k] = first ? corners[j][k] : std::max(slice_high[k], corners[j][k]);
+        }
+      }
+    }
+    std::unique_ptr<coverage_cube> coverage(make_coverage(pos, slice_low, slice_high,
+                                                          pieces.size(), coverage_mode));
+    size_t checked = 0;
+    std::vector<indexed_triangle> fragments;
+    for (auto iter = pieces.begin(); iter != pieces.end(); ++iter) {
+      if (coverage) {
+        coverage_corners(vertices, iter->second, corners);
+        check_coverage(coverage, ++checked, result.covered, pieces.size(), coverage_mode);
+      }
+      if (coverage && coverage->is_covered(corners)) {
+        indexed_triangle tri = iter->second;
+        tri.set_visibility(false);
+        result.fragments.emplace_back(iter->first, tri);
+        ++result.covered;
+        continue;
+      }
+      fragments.clear();
+      shadow_volume.add_shadow(pos, iter->second, result.pool, fragments, true, 0,
+                               coverage.get());
+      for (auto frag = fragments.begin(); frag != fragments.end(); ++frag) {
+        result.fragments.emplace_back(iter->first, *frag);
       }
-      iter++;
     }
-    triangles.swap(new_triangles);
+    result.shadow_splits = shadow_volume.counters.shadow_splits;
+    result.shadow_nodes = shadow_volume.node_count();
+  });
+
+  // The corners added by each slice follow those of the slices before it
+  uint32_t base = vertices.size();
+  std::vector<uint32_t> shift(n_slices);
+  size_t shadow_nodes = 0;
+  for (size_t i = 0; i < n_slices; ++i) {
+    shift[i] = vertices.size() - base;
+    vertices.append(results[i].pool.local());
+    results[i].pool = vertex_pool();
+    counters.shadow_splits += results[i].shadow_splits;
+    counters.covered += results[i].covered;
+    shadow_nodes += results[i].shadow_nodes;
   }
+  counters.shadow_nodes.push_back(shadow_nodes);
 
-  if (result < 0) {
-    if (front != nullptr) {
-      front->cut_by_shadows(shadow_bsp, light, view, intensity);
+  // Gathers the triangles node by node, those kept before the pieces of each
+  // slice in turn, so their order doesn't depend on which thread cut which
+  // slice. The slices themselves follow the number of threads, and so do the
+  // fragments cut along their borders
+  std::vector<uint32_t> starts(ranges.size() + 1, 0);
+  for (auto iter = kept.begin(); iter != kept.end(); ++iter) {
+    ++starts[iter->first + 1];
+  }
+  for (size_t i = 0; i < n_slices; ++i) {
+    for (auto iter = results[i].fragments.begin(); iter != results[i].fragments.end(); ++iter) {
+      ++starts[iter->first + 1];
     }
-  } else {
-    if (back != nullptr) {
-      back->cut_by_shadows(shadow_bsp, light, view, intensity);
+  }
+  for (size_t node = 0; node < ranges.size(); ++node) {
+    starts[node + 1] += starts[node];
+    ranges[node].first = starts[node];
+    ranges[node].count = starts[node + 1] - starts[node];
+  }
+  std::vector<indexed_triangle> new_triangles(starts.back());
+  for (auto iter = kept.begin(); iter != kept.end(); ++iter) {
+    new_triangles[starts[iter->first]++] = iter->second;
+  }
+  std::vector<placed_triangle>().swap(kept);
+  for (size_t i = 0; i < n_slices; ++i) {
+    for (auto iter = results[i].fragments.begin(); iter != results[i].fragments.end(); ++iter) {
+      indexed_triangle tri = iter->second;
+      for (int k = 0; k < 3; ++k) {
+        if (tri[k] >= base) tri[k] += shift[i];
+      }
+      new_triangles[starts[iter->first]++] = tri;
     }
+    std::vector<placed_triangle>().swap(results[i].fragments);
   }
+
+  triangles.swap(new_triangles);
+  vertices.clear_splits();
 }
 
-void bsp::shine_light(const point& light, double intensity) {
+// The lit parts of every triangle as seen from a single light. Fully lit and
+// fully dark triangles are only flagged, everything else gets its lit
+// fragments stored in a range of lit
+template <typename T>
+struct bsp_light_mask {
+  enum State : char {
+    DARK,
+    LIT,
+    PARTIAL
+  };
+  std::vector<State> state;
+  std::vector<bsp_range> ranges;
+  std::vector<triangle_t<T> > lit;
+  // The work done by the shadow volume of the light
+  size_t shadow_splits = 0;
+  size_t shadow_nodes = 0;
+  size_t covered = 0;
+};
+
+template <typename T>
+void bsp_t<T>::collect_lit(const point& light, bsp_light_mask<T>& mask) const {
+  const double FULL_TOLERANCE = 1e-6;
+
   bsp shadow_volume(true);
-  cut_by_shadows(shadow_volume, light, false, intensity);
+  find_inner(light, shadow_volume.inner);
+  std::vector<indexed_triangle> fragments;
+  double low[3], high[3];
+  std::unique_ptr<coverage_cube> coverage;
+  if (pool_bounds(vertices, low, high)) {
+    shadow_volume.vertices.set_tolerance(bounds_tolerance(low, high, &light));
+    coverage.reset(make_coverage(light, low, high, triangles.size(), coverage_mode));
+  }
+  double corners[3][3];
+  size_t checked = 0;
+  mask.state.assign(triangles.size(), bsp_light_mask<T>::DARK);
+  mask.ranges.assign(triangles.size(), bsp_range());
+  mask.lit.clear();
+
+  traverse(light, [&](uint32_t node, T side) {
+    if (side == 0) return;
+    uint32_t end = ranges[node].first + ranges[node].count;
+    for (uint32_t i = ranges[node].first; i < end; ++i) {
+      const indexed_triangle& tri = triangles[i];
+      if (tri.normal().dot(light - vertices[tri[0]]) < 0) continue;
+      if (coverage) {
+        coverage_corners(vertices, tri, corners);
+        check_coverage(coverage, ++checked, mask.covered, triangles.size(), coverage_mode);
+        if (coverage && coverage->is_covered(corners)) {
+          ++mask.covered;
+          continue;
+        }
+      }
+      // The fragments are only kept as points so their vertices are dropped
+      // along with the pool once the triangle is done
+      vertex_pool pool(&vertices);
+      fragments.clear();
+      shadow_volume.add_shadow(light, tri, pool, fragments, true, 0, coverage.get());
+      uint32_t first = mask.lit.size();
+      double lit_area = 0;
+      for (auto iter = fragments.begin(); iter != fragments.end(); ++iter) {
+        if (iter->is_visible()) {
+          mask.lit.push_back(pool.to_triangle(*iter));
+          lit_area += mask.lit.back().area();
+        }
+      }
+      if (mask.lit.size() == first) continue;
+      if (lit_area >= vertices.area(tri) * (1 - FULL_TOLERANCE)) {
+        mask.lit.resize(first);
+        mask.state[i] = bsp_light_mask<T>::LIT;
+      } else {
+        mask.state[i] = bsp_light_mask<T>::PARTIAL;
+        mask.ranges[i].first = first;
+        mask.ranges[i].count = mask.lit.size() - first;
+      }
+    }
+  });
+  mask.shadow_splits = shadow_volume.counters.shadow_splits;
+  mask.shadow_nodes = shadow_volume.node_count();
 }
 
-void bsp::look_from(const point& pos) {
-  bsp shadow_volume(true);
-  cut_by_shadows(shadow_volume, pos, true, 0);
+// A convex part of a triangle along with the lights reaching it
+template <typename T>
+struct lit_piece {
+  std::vector<point_t<T> > points;
+  std::vector<uint32_t> lights;
+};
+
+// The pieces of a triangle after merging its lights. Corners 0 to 2 are those
+// of the triangle and higher ones refer to points, starting at 3. Points on an
+// edge of the triangle have the index of its first corner in edges, and -1
+// otherwise, so they can be welded with those of the neighbour sharing it
+template <typename T>
+struct lit_merge {
+  std::vector<point_t<T> > points;
+  std::vector<int> edges;
+  std::vector<indexed_triangle_t<T> > triangles;
+};
+
+// Splits the triangle into the pieces lit by the same set of lights and
+// assigns each piece the summed luminance of those lights
+template <typename T>
+static void merge_lit(const triangle_t<T>& tri, const vec3_t<T>& normal, uint32_t index,
+                      const std::vector<bsp_light_mask<T> >& masks,
+                      const std::vector<point_t<T> >& lights,
+                      const std::vector<T>& intensity, T tolerance,
+                      lit_merge<T>& merged) {
+  typedef vec3_t<T> vec3;
+  typedef point_t<T> point;
+  typedef triangle_t<T> triangle;
+  typedef indexed_triangle_t<T> indexed_triangle;
+  typedef plane_t<T> plane;
+  typedef lit_piece<T> lit_piece;
+  std::vector<lit_piece> pieces(1);
+  pieces[0].points = {tri.a(), tri.b(), tri.c()};
+  std::vector<lit_piece> next;
+  std::vector<lit_piece> remaining;
+  std::vector<lit_piece> outside;
+  std::vector<point> front;
+  std::vector<point> back;
+
+  for (uint32_t l = 0; l < masks.size(); ++l) {
+    const bsp_light_mask<T>& mask = masks[l];
+    if (mask.state[index] == bsp_light_mask<T>::DARK) continue;
+    if (mask.state[index] == bsp_light_mask<T>::LIT) {
+      for (auto iter = pieces.begin(); iter != pieces.end(); ++iter) {
+        iter->lights.push_back(l);
+      }
+      continue;
+    }
+    // The lit fragments of a light never overlap so each piece can be cut by
+    // them in turn, with the parts outside carried on to the next fragment
+    next.clear();
+    auto lit_first = mask.lit.begin() + mask.ranges[index].first;
+    auto lit_end = lit_first + mask.ranges[index].count;
+    for (auto piece = pieces.begin(); piece != pieces.end(); ++piece) {
+      remaining.assign(1, *piece);
+      for (auto frag = lit_first; frag != lit_end && !remaining.empty(); ++frag) {
+        outside.clear();
+        for (auto rest = remaining.begin(); rest != remaining.end(); ++rest) {
+          size_t n_outside = outside.size();
+          std::vector<point> inside = rest->points;
+          for (int i = 0; i < 3 && !inside.empty(); ++i) {
+            vec3 n = frag->normal().cross((*frag)[i + 1] - (*frag)[i]).normalize();
+            plane edge(n, -n.dot((*frag)[i]), tolerance);
+            edge.split_polygon(inside, front, back);
+            if (!back.empty()) {
+              outside.push_back({back, rest->lights});
+            }
+            inside.swap(front);
+          }
+          if (inside.empty()) {
+            // Not touched by the fragment so it is kept whole
+            outside.resize(n_outside);
+            outside.push_back(*rest);
+          } else {
+            next.push_back({inside, rest->lights});
+            next.back().lights.push_back(l);
+          }
+        }
+        remaining.swap(outside);
+      }
+      next.insert(next.end(), remaining.begin(), remaining.end());
+    }
+    pieces.swap(next);
+  }
+
+  // Pieces share most of their corners with each other and with the triangle
+  std::unordered_map<point, uint32_t> corners;
+  for (int i = 0; i < 3; ++i) {
+    corners.emplace(tri[i], i);
+  }
+  auto on_edge = [&](const point& p) {
+    for (int i = 0; i < 3; ++i) {
+      vec3 edge = tri[i + 1] - tri[i];
+      T length = edge.length();
+      if (length > 0 && edge.cross(p - tri[i]).length() <= tolerance * length) return i;
+    }
+    return -1;
+  };
+  auto corner = [&](const point& p) {
+    auto found = corners.emplace(p, merged.points.size() + 3);
+    if (found.second) {
+      merged.points.push_back(p);
+      merged.edges.push_back(on_edge(p));
+    }
+    return found.first->second;
+  };
+  for (auto piece = pieces.begin(); piece != pieces.end(); ++piece) {
+    for (size_t i = 1; i + 1 < piece->points.size(); ++i) {
+      triangle part(piece->points[0], piece->points[i], piece->points[i + 1],
+                    tri.id(), tri.light());
+      if (!part.is_valid()) continue;
+      for (auto l = piece->lights.begin(); l != piece->lights.end(); ++l) {
+        const point& light = lights[*l];
+        T mod = (light.distance_to(part.a()) + light.distance_to(part.b()) + light.distance_to(part.c())) / 3;
+        part.illuminate(intensity[*l] / (mod * mod));
+      }
+      merged.triangles.push_back(indexed_triangle(corner(part.a()), corner(part.b()),
+                                                  corner(part.c()), normal, part.id(),
+                                                  part.light()));
+    }
+  }
+}
+
+template <typename T>
+void bsp_t<T>::shine_lights(const std::vector<point>& lights,
+                       const std::vector<T>& intensity, size_t n_threads) {
+  std::vector<bsp_light_mask<T> > masks(lights.size());
+  parallel_for(lights.size(), n_threads, [&](size_t i) {
+    collect_lit(lights[i], masks[i]);
+  });
+  for (auto iter = masks.begin(); iter != masks.end(); ++iter) {
+    counters.shadow_splits += iter->shadow_splits;
+    counters.shadow_nodes.push_back(iter->shadow_nodes);
+    counters.covered += iter->covered;
+  }
+
+  std::vector<lit_merge<T> > merged(triangles.size());
+  parallel_for(triangles.size(), n_threads, [&](size_t i) {
+    merge_lit(vertices.to_triangle(triangles[i]), triangles[i].normal(), i, masks, lights,
+              intensity, vertices.tolerance(), merged[i]);
+  });
+  std::vector<bsp_light_mask<T> >().swap(masks);
+
+  // Points cut on an edge shared by two triangles are welded into one vertex,
+  // in the spirit of vertex_pool::split_edge(). They are found by the edge and
+  // by their position along it, measured from the lower index and placed
+  // exactly on the edge so the neighbours meet without a gap
+  struct edge_point {
+    T t;
+    uint32_t index;
+  };
+  std::unordered_map<uint64_t, std::vector<edge_point> > welds;
+  std::vector<uint32_t> remap;
+  std::vector<indexed_triangle> new_triangles;
+  new_triangles.reserve(triangles.size());
+  for (size_t node = 0; node < ranges.size(); ++node) {
+    uint32_t first = new_triangles.size();
+    uint32_t end = ranges[node].first + ranges[node].count;
+    for (uint32_t i = ranges[node].first; i < end; ++i) {
+      const indexed_triangle& source = triangles[i];
+      const lit_merge<T>& merge = merged[i];
+      remap.resize(merge.points.size());
+      for (size_t k = 0; k < merge.points.size(); ++k) {
+        if (merge.edges[k] < 0) {
+          remap[k] = vertices.add(merge.points[k]);
+          continue;
+        }
+        uint32_t a = source[merge.edges[k]];
+        uint32_t b = source[merge.edges[k] + 1];
+        if (a > b) std::swap(a, b);
+        vec3 edge = vertices[b] - vertices[a];
+        T length = edge.length();
+        T t = edge.dot(merge.points[k] - vertices[a]) / (length * length);
+        T slack = vertices.tolerance() / length;
+        std::vector<edge_point>& on_edge = welds[uint64_t(a) << 32 | b];
+        auto found = on_edge.begin();
+        while (found != on_edge.end() && std::fabs(found->t - t) > slack) ++found;
+        if (found != on_edge.end()) {
+          remap[k] = found->index;
+        } else {
+          remap[k] = vertices.add(vertices[a] + edge * t);
+          on_edge.push_back({t, remap[k]});
+        }
+      }
+      for (auto iter = merge.triangles.begin(); iter != merge.triangles.end(); ++iter) {
+        indexed_triangle tri = *iter;
+        for (int k = 0; k < 3; ++k) {
+          tri[k] = tri[k] < 3 ? source[tri[k]] : remap[tri[k] - 3];
+        }
+        new_triangles.push_back(tri);
+      }
+    }
+    ranges[node].first = first;
+    ranges[node].count = new_triangles.size() - first;
+  }
+
+  triangles.swap(new_triangles);
 }
 
-void bsp::near_to_far(const point& light, std::vector<triangle>& sort_list) {
-  double result = partition.classify_point(light);
-  if (result < 0) {
-    if (back != nullptr) {
-      back->near_to_far(light, sort_list);
+// The part of every triangle lit from each of the probes, with the parts for
+// probe i going in fractions[i]. Every probe has its own shadow volume and
+// coverage but they share a single walk of the tree, and the fragments are
+// only used to measure the lit part of the triangle
+template <typename T>
+void bsp_t<T>::collect_probes(const std::vector<point>& probes, std::vector<T>* fractions,
+                              bsp_stats& work) const {
+  struct probe_state {
+    bsp shadow_volume;
+    std::unique_ptr<coverage_cube> coverage;
+    size_t checked;
+    size_t covered;
+  };
+  std::vector<probe_state> states(probes.size());
+  double low[3], high[3];
+  bool bounded = pool_bounds(vertices, low, high);
+  for (size_t p = 0; p < probes.size(); ++p) {
+    states[p].shadow_volume = bsp(true);
+    find_inner(probes[p], states[p].shadow_volume.inner);
+    states[p].checked = states[p].covered = 0;
+    if (bounded) {
+      states[p].shadow_volume.vertices.set_tolerance(bounds_tolerance(low, high, &probes[p]));
+      states[p].coverage.reset(make_coverage(probes[p], low, high, triangles.size(),
+                                                 coverage_mode));
     }
-  } else {
-    if (front != nullptr) {
-      front->near_to_far(light, sort_list);
+    fractions[p].assign(triangles.size(), 0);
+  }
+  std::vector<indexed_triangle> fragments;
+  double corners[3][3];
+
+  traverse_group(probes, [&](uint32_t node, const uint32_t* first, const uint32_t* last) {
+    uint32_t end = ranges[node].first + ranges[node].count;
+    for (uint32_t i = ranges[node].first; i < end; ++i) {
+      const indexed_triangle& tri = triangles[i];
+      T area = vertices.area(tri);
+      if (!(area > 0)) continue;
+      coverage_corners(vertices, tri, corners);
+      for (const uint32_t* p = first; p != last; ++p) {
+        const point& light = probes[*p];
+        probe_state& state = states[*p];
+        if (tri.normal().dot(light - vertices[tri[0]]) < 0) continue;
+        if (state.coverage) {
+          check_coverage(state.coverage, ++state.checked, state.covered, triangles.size(),
+                         coverage_mode);
+          if (state.coverage && state.coverage->is_covered(corners)) {
+            ++state.covered;
+            continue;
+          }
+        }
+        vertex_pool pool(&vertices);
+        fragments.clear();
+        state.shadow_volume.add_shadow(light, tri, pool, fragments, true, 0,
+                                       state.coverage.get());
+        T lit_area = 0;
+        for (auto iter = fragments.begin(); iter != fragments.end(); ++iter) {
+          if (iter->is_visible()) lit_area += pool.area(*iter);
+        }
+        fractions[*p][i] = std::min<T>(lit_area / area, 1);
+      }
     }
+  });
+  for (auto iter = states.begin(); iter != states.end(); ++iter) {
+    work.shadow_splits += iter->shadow_volume.counters.shadow_splits;
+    work.shadow_nodes.push_back(iter->shadow_volume.node_count());
+    work.covered += iter->covered;
   }
+}
+
+// The four probes every sample of an area light interpolates between, along
+// with their weights
+template <typename T>
+struct probe_blend {
+  uint32_t probe[4];
+  T weight[4];
+};
+
+// Lays out the probes an area light is measured from and blends each sample
+// from them. The probes sit on a lattice over the light, reaching its corners,
+// and every sample is interpolated bilinearly from the four around it. If the
+// light asks for no lattice or the lattice has no fewer probes than there are
+// samples, the samples are the probes themselves and nothing is interpolated
+template <typename T>
+static void area_probes(const area_light_t<T>& light, std::vector<point_t<T> >& samples,
+                        std::vector<point_t<T> >& probes,
+                        std::vector<probe_blend<T> >& blends) {
+  uint32_t lattice = light.n_probes;
 
-  for (int i = 0; i < triangles.size(); i++) {
-    sort_list.push_back(triangles[i]);
+  std::vector<std::pair<double, double> > coords = light.sample_coords();
+  samples.clear();
+  probes.clear();
+  blends.clear();
+  for (auto iter = coords.begin(); iter != coords.end(); ++iter) {
+    samples.push_back(light.at(iter->first, iter->second));
+  }
+  if (lattice == 0 || samples.size() <= size_t(lattice) * lattice) {
+    probes = samples;
+    for (uint32_t i = 0; i < samples.size(); ++i) {
+      blends.push_back({{i, i, i, i}, {1, 0, 0, 0}});
+    }
+    return;
   }
+  for (uint32_t j = 0; j < lattice; ++j) {
+    for (uint32_t i = 0; i < lattice; ++i) {
+      probes.push_back(light.at(2.0 * i / (lattice - 1) - 1, 2.0 * j / (lattice - 1) - 1));
+    }
+  }
+  for (auto iter = coords.begin(); iter != coords.end(); ++iter) {
+    double x = (iter->first + 1) / 2 * (lattice - 1);
+    double y = (iter->second + 1) / 2 * (lattice - 1);
+    uint32_t i = std::min<uint32_t>(x, lattice - 2);
+    uint32_t j = std::min<uint32_t>(y, lattice - 2);
+    T fx = x - i;
+    T fy = y - j;
+    uint32_t base = j * lattice + i;
+    blends.push_back({{base, base + 1, base + lattice, base + lattice + 1},
+                      {(1 - fx) * (1 - fy), fx * (1 - fy), (1 - fx) * fy, fx * fy}});
+  }
+}
+
+template <typename T>
+void bsp_t<T>::shine_area_light(const area_light& light, T intensity, size_t n_threads) {
+  std::vector<point> samples;
+  std::vector<point> probes;
+  std::vector<probe_blend<T> > blends;
+  area_probes(light, samples, probes, blends);
 
-  if (result < 0) {
-    if (front != nullptr) {
-      front->near_to_far(light, sort_list);
+  // Probes are split into a group per thread, each walking the tree once. The
+  // volume of every probe sees the same triangles in the same order in any
+  // group so the result doesn't depend on the number of threads
+  size_t n_groups = std::max<size_t>(1, std::min(n_threads, probes.size()));
+  std::vector<std::vector<T> > fractions(probes.size());
+  std::vector<bsp_stats> work(n_groups);
+  parallel_for(n_groups, n_threads, [&](size_t g) {
+    size_t first = g * probes.size() / n_groups;
+    size_t last = (g + 1) * probes.size() / n_groups;
+    collect_probes(std::vector<point>(probes.begin() + first, probes.begin() + last),
+                   fractions.data() + first, work[g]);
+  });
+  for (auto iter = work.begin(); iter != work.end(); ++iter) {
+    counters.shadow_splits += iter->shadow_splits;
+    counters.shadow_nodes.insert(counters.shadow_nodes.end(), iter->shadow_nodes.begin(),
+                                 iter->shadow_nodes.end());
+    counters.covered += iter->covered;
+  }
+
+  T share = intensity / samples.size();
+  parallel_for(triangles.size(), n_threads, [&](size_t i) {
+    indexed_triangle& tri = triangles[i];
+    const point& a = vertices[tri[0]];
+    const point& b = vertices[tri[1]];
+    const point& c = vertices[tri[2]];
+    T received = 0;
+    for (size_t s = 0; s < samples.size(); ++s) {
+      const point& sample = samples[s];
+      if (tri.normal().dot(sample - a) < 0) continue;
+      T lit = 0;
+      for (int k = 0; k < 4; ++k) {
+        lit += blends[s].weight[k] * fractions[blends[s].probe[k]][i];
+      }
+      if (lit <= 0) continue;
+      T mod = (sample.distance_to(a) + sample.distance_to(b) + sample.distance_to(c)) / 3;
+      received += share * lit / (mod * mod);
     }
-  } else {
-    if (back != nullptr) {
-      back->near_to_far(light, sort_list);
+    if (received != 0) tri.illuminate(received);
+  });
+}
+
+template <typename T>
+void bsp_t<T>::look_from(const point& pos, const frustum& cone, size_t n_threads) {
+  if (n_threads > 1) {
+    cut_by_slices(pos, cone, n_threads);
+    return;
+  }
+  bsp shadow_volume(true);
+  cut_by_shadows(shadow_volume, pos, true, 0, cone);
+}
+
+template <typename T>
+void bsp_t<T>::near_to_far(const point& light, std::vector<triangle>& sort_list) {
+  sort_list.reserve(sort_list.size() + triangles.size());
+  traverse(light, [&](uint32_t node, T) {
+    uint32_t end = ranges[node].first + ranges[node].count;
+    for (uint32_t i = ranges[node].first; i < end; ++i) {
+      sort_list.push_back(vertices.to_triangle(triangles[i]));
     }
+  });
+}
+
+template <typename T>
+void bsp_t<T>::near_to_far(const point& light, std::vector<indexed_triangle>& sort_list) {
+  sort_list.reserve(sort_list.size() + triangles.size());
+  traverse(light, [&](uint32_t node, T) {
+    sort_list.insert(sort_list.end(), triangles.begin() + ranges[node].first,
+                     triangles.begin() + ranges[node].first + ranges[node].count);
+  });
+}
+
+template <typename T>
+size_t bsp_t<T>::depth() const {
+  const std::vector<bsp_node>& nodes = structure->nodes;
+  size_t deepest = 0;
+  std::vector<std::pair<uint32_t, size_t> > stack;
+  stack.emplace_back(0, 1);
+  while (!stack.empty()) {
+    uint32_t node = stack.back().first;
+    size_t level = stack.back().second;
+    stack.pop_back();
+    deepest = std::max(deepest, level);
+    if (nodes[node].front != bsp_node::NONE) stack.emplace_back(nodes[node].front, level + 1);
+    if (nodes[node].back != bsp_node::NONE) stack.emplace_back(nodes[node].back, level + 1);
   }
+  return deepest;
 }
+
+template class bsp_t<double>;
+template class bsp_t<float>;
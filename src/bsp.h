@@ -2,36 +2,232 @@
 
 #include <vector>
 #include <memory>
+#include <iosfwd>
+#include <utility>
+#include <cstdint>
+#include <cstddef>
 
 #include "geometry.h"
+#include "vertex_pool.h"
 
-class bsp {
-private:
-  plane partition;
-  std::vector<triangle> triangles;
-  std::unique_ptr<bsp> front;
-  std::unique_ptr<bsp> back;
-  bool is_out;
-
-  void add_triangle(const triangle& tri);
-  void add_shadow(const point& light, triangle& tri, std::vector<triangle>& new_triangles, bool view, double intensity);
-  void cut_by_shadows(bsp& shadow_bsp, const point& light, bool view, double intensity);
-public:
+// Nodes live in one contiguous pool and refer to their children and partition
+// plane by 32-bit index. Leaves have no partition and are only used by shadow
+// volumes where they mark space as inside or outside.
+struct bsp_node {
+  static const uint32_t NONE = 0xFFFFFFFF;
+
+  uint32_t partition = NONE;
+  uint32_t front = NONE;
+  uint32_t back = NONE;
+  bool is_out = false;
+
+  bsp_node(bool is_out = false) : is_out(is_out) {}
+};
+
+// The triangles of a node as a range into the triangle array of the tree
+struct bsp_range {
+  uint32_t first = 0;
+  uint32_t count = 0;
+};
+
+// The topology of a tree. It is never modified when triangles are cut by
+// shadows, so copies of a tree share it and only clone it before changing it
+template <typename T>
+struct bsp_structure {
+  std::vector<bsp_node> nodes;
+  std::vector<plane_t<T> > planes;
+};
+
+template <typename T>
+struct bsp_light_mask;
+
+class coverage_cube;
+
+// Work done by a tree since it was built, for reporting. Copies of a tree carry
+// on from the counts of the original
+struct bsp_stats {
+  // Triangles split by a partition while building or inserting
+  size_t build_splits = 0;
+  // Triangles split by the planes of shadow volumes
+  size_t shadow_splits = 0;
+  // The number of nodes in the shadow volume of every light or viewpoint
+  // applied to the tree, in order
+  std::vector<size_t> shadow_nodes;
+  // Triangles found hidden from their coverage and never cut by a shadow
+  // volume
+  size_t covered = 0;
+};
+
+// The parts of bsp_t that don't depend on the scalar type
+struct bsp_types {
   enum PositionType {
     COINCIDENT,
     IN_BACK_OF,
     IN_FRONT_OF,
     SPAN
   };
-  bsp(bool is_out = false) : is_out(is_out) {}
-  bsp(std::vector<triangle>& list, bool is_out = false) :
-    is_out(is_out) {
-    build_tree(list);
+  enum BuildStrategy {
+    FIRST,
+    SAMPLE,
+    THOROUGH
+  };
+  // Whether hidden triangles are skipped with a coverage_cube. With AUTO only
+  // trees large enough for it to pay off use one
+  enum CoverageMode {
+    COVERAGE_AUTO,
+    COVERAGE_ON,
+    COVERAGE_OFF
+  };
+};
+
+// A BSP tree over triangles with coordinates of type T. It is instantiated for
+// double and float in bsp.cpp. The triangles of the tree index into a shared
+// vertex pool, and triangles cut by the same plane along a shared edge share
+// the new vertex too
+template <typename T>
+class bsp_t : public bsp_types {
+public:
+  typedef vec3_t<T> vec3;
+  typedef point_t<T> point;
+  typedef triangle_t<T> triangle;
+  typedef plane_t<T> plane;
+  typedef cut_tri_t<T> cut_tri;
+  typedef frustum_t<T> frustum;
+  typedef area_light_t<T> area_light;
+  typedef indexed_triangle_t<T> indexed_triangle;
+  typedef indexed_cut_t<T> indexed_cut;
+  typedef vertex_pool_t<T> vertex_pool;
+  typedef bsp_t<T> bsp;
+
+private:
+  std::shared_ptr<bsp_structure<T> > structure;
+  std::vector<bsp_range> ranges;
+  vertex_pool vertices;
+  std::vector<indexed_triangle> triangles;
+  std::vector<std::pair<uint32_t, triangle> > insert_stack;
+  // A fragment on its way down a shadow volume, with the depth of the node it
+  // is headed for
+  struct shadow_step {
+    uint32_t node;
+    uint32_t depth;
+    indexed_triangle triangle;
+  };
+  std::vector<shadow_step> shadow_stack;
+  // The nodes from the root to the one being visited by add_shadow()
+  std::vector<uint32_t> shadow_path;
+  std::vector<uint32_t> shadow_out;
+  bsp_stats counters;
+  CoverageMode coverage_mode = COVERAGE_OFF;
+  // The triangles across the edges of every triangle id, see set_neighbours()
+  std::shared_ptr<const std::vector<int> > neighbours;
+  // For a shadow volume, whether the triangle of every id lies inside a patch
+  // facing the light, see find_inner()
+  std::vector<uint8_t> inner;
+
+  uint32_t add_node(bool is_out);
+  void detach();
+  // Gives the planes of the tree a tolerance following the extent of its
+  // vertices
+  void fit_tolerance();
+  bool is_leaf(uint32_t node) const {
+    const bsp_node& current = structure->nodes[node];
+    return current.front == bsp_node::NONE && current.back == bsp_node::NONE;
+  }
+  void add_triangle(uint32_t node, const triangle& tri);
+  bool is_bounded_by(const point& light, const point& a, const point& b) const;
+  bool is_edge_on(const point& light, const point& a, const point& b, const point& c) const;
+  void find_inner(const point& light, std::vector<uint8_t>& flags) const;
+  void add_shadow(const point& light, const indexed_triangle& tri, vertex_pool& pool,
+                  std::vector<indexed_triangle>& new_triangles, bool view, T intensity,
+                  coverage_cube* coverage = nullptr);
+  void cut_by_shadows(bsp& shadow_bsp, const point& light, bool view, T intensity,
+                      const frustum& cone);
+  void cut_by_slices(const point& pos, const frustum& cone, size_t n_threads);
+  void collect_lit(const point& light, bsp_light_mask<T>& mask) const;
+  void collect_probes(const std::vector<point>& probes, std::vector<T>* fractions,
+                      bsp_stats& work) const;
+  template <typename Visit>
+  void traverse(const point& pos, Visit visit) const;
+  template <typename Visit>
+  void traverse_group(const std::vector<point>& positions, Visit visit) const;
+  uint32_t grow_subtree(std::vector<indexed_triangle>& list, BuildStrategy strategy);
+  template <typename Keep>
+  void compact(std::vector<std::pair<uint32_t, indexed_triangle> >& added, Keep keep);
+  void compact_pool();
+public:
+  bsp_t(bool is_out = false) : structure(new bsp_structure<T>()) {
+    add_node(is_out);
+  }
+  bsp_t(std::vector<triangle>& list, BuildStrategy strategy = FIRST, size_t n_threads = 1) {
+    build_tree(list, strategy, n_threads);
   }
-  ~bsp() {}
-  void build_tree(std::vector<triangle>& list);
-  bool is_leaf() { return (front == nullptr && back == nullptr); }
-  void shine_light(const point& light, double intensity = 1);
-  void look_from(const point& pos);
+  bsp_t(vertex_pool& pool, std::vector<indexed_triangle>& list, BuildStrategy strategy = FIRST,
+        size_t n_threads = 1) {
+    build_tree(pool, list, strategy, n_threads);
+  }
+  // Identical corners of the triangles are merged into one vertex
+  void build_tree(std::vector<triangle>& list, BuildStrategy strategy = FIRST, size_t n_threads = 1);
+  // Takes over both the pool and the triangles indexing into it
+  void build_tree(vertex_pool& pool, std::vector<indexed_triangle>& list,
+                  BuildStrategy strategy = FIRST, size_t n_threads = 1);
+  bool is_leaf() const { return is_leaf(0); }
+  // Adds triangles to a built tree, appending the vertices of pool to those of
+  // the tree. The triangles are pushed down the existing partitions and new
+  // subtrees are only grown where they end up in empty space, so the cost
+  // follows the number of triangles added rather than the size of the tree
+  void insert(const vertex_pool& pool, std::vector<indexed_triangle>& list,
+              BuildStrategy strategy = FIRST);
+  // Removes every fragment of the triangles with the given ids, which must be
+  // sorted. Nodes left without triangles keep their partition as a tombstone
+  // and subtrees made up of mostly tombstones are rebuilt from the triangles
+  // left in them
+  void remove(const std::vector<int>& ids, BuildStrategy strategy = FIRST);
+  void shine_light(const point& light, T intensity = 1);
+  void shine_lights(const std::vector<point>& lights,
+                    const std::vector<T>& intensity, size_t n_threads = 1);
+  // Adds the light of an area light to the triangles without splitting them.
+  // Every triangle gets the share of the light reaching it from each sample,
+  // following the part of it lit from there, so shadows soften at the
+  // resolution of the mesh. The lit parts are found from the probes of the
+  // light which the samples interpolate between, see area_light_t::n_probes
+  void shine_area_light(const area_light& light, T intensity = 1, size_t n_threads = 1);
+  // With more than one thread the view is split into slices around pos, each
+  // with its own shadow volume and the pieces of the triangles inside it, so
+  // the slices can be cut on separate threads. Triangles crossing the border
+  // of a slice are cut along it, with the pieces on either side sharing their
+  // corners
+  void look_from(const point& pos, const frustum& cone = frustum(), size_t n_threads = 1);
   void near_to_far(const point& light, std::vector<triangle>& sort_list);
+  // As above but keeping the triangles as indices into pool()
+  void near_to_far(const point& light, std::vector<indexed_triangle>& sort_list);
+  const vertex_pool& pool() const { return vertices; }
+  // The shape of the tree: its number of nodes and triangles, and the number of
+  // nodes on the longest path from the root
+  size_t node_count() const { return structure->nodes.size(); }
+  size_t size() const { return triangles.size(); }
+  size_t depth() const;
+  const bsp_stats& stats() const { return counters; }
+  // Coverage makes hidden triangles faster to find. A triangle it skips is left
+  // whole rather than cut by the shadow volume, which can drop slivers the
+  // volume would have left visible within its tolerance, so it is off by
+  // default. Copies of the tree keep the mode
+  void set_coverage(CoverageMode mode) { coverage_mode = mode; }
+  // Builds shadow volumes from the silhouette edges of the mesh, with the
+  // neighbours of every triangle id as found by find_neighbours() in
+  // adjacency.h. Triangles whose neighbours all face the light like themselves
+  // leave out the side planes the volume already holds, while those along a
+  // silhouette, a border or a non-manifold edge add all of theirs. Without
+  // neighbours, the default, every triangle adds all of its planes. Copies of
+  // the tree keep the neighbours
+  void set_neighbours(std::shared_ptr<const std::vector<int> > across) {
+    neighbours = std::move(across);
+  }
+  // Writes the tree as packed binary records, or reads it back from the bytes
+  // between begin and end, returning where its records stopped. Reading copies
+  // the records into new arrays of the tree, so the bytes, e.g. those of a
+  // mapped file, are not needed afterwards. See bsp_file.h
+  void write(std::ostream& out) const;
+  const char* read(const char* begin, const char* end);
 };
+
+typedef bsp_t<double> bsp;
@@ -0,0 +1,323 @@
+#include "bsp_file.h"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+static const char MAGIC[8] = {'U', 'N', 'M', 'E', 'S', 'H', 'B', 'T'};
+static const uint32_t VERSION = 1;
+// Reads back differently on a machine with the opposite byte order
+static const uint32_t ORDER_MARK = 0x01020304;
+// The size of the header before the origin
+static const size_t HEADER_SIZE = sizeof(MAGIC) + 3 * sizeof(uint32_t);
+
+// Records are gathered in a buffer and written in blocks of this size
+static const size_t FLUSH_SIZE = 1 << 20;
+
+class record_writer {
+private:
+  std::ostream& out;
+  std::vector<char> buffer;
+public:
+  explicit record_writer(std::ostream& out) : out(out) {
+    buffer.reserve(FLUSH_SIZE);
+  }
+  ~record_writer() { flush(); }
+
+  void put_bytes(const void* bytes, size_t n) {
+    const char* first = static_cast<const char*>(bytes);
+    buffer.insert(buffer.end(), first, first + n);
+    if (buffer.size() >= FLUSH_SIZE) flush();
+  }
+  template <typename V>
+  void put(V value) {
+    put_bytes(&value, sizeof(V));
+  }
+  void flush() {
+    out.write(buffer.data(), buffer.size());
+    buffer.clear();
+  }
+};
+
+class record_reader {
+private:
+  const char* pos;
+  const char* end;
+public:
+  record_reader(const char* begin, const char* end) : pos(begin), end(end) {}
+
+  const char* position() const { return pos; }
+  // Makes sure n records of the given size are left before reading them
+  void need(uint64_t n, size_t size) const {
+    if (n > uint64_t(end - pos) / size) {
+      throw std::runtime_error("The tree file is truncated");
+    }
+  }
+  template <typename V>
+  V get() {
+    V value;
+    std::memcpy(&value, pos, sizeof(V));
+    pos += sizeof(V);
+    return value;
+  }
+  const char* skip(size_t n) {
+    const char* first = pos;
+    pos += n;
+    return first;
+  }
+};
+
+// Children are always added to the tree after their parent and have no other
+// parent, which also keeps a malformed file from sending traversals in circles
+// or through the same subtree twice
+static void check_child(uint32_t child, uint32_t node, std::vector<bool>& has_parent) {
+  if (child == bsp_node::NONE) return;
+  if (child <= node || child >= has_parent.size() || has_parent[child]) {
+    throw std::runtime_error("The tree file has a node with an invalid child");
+  }
+  has_parent[child] = true;
+}
+
+template <typename T>
+void bsp_t<T>::write(std::ostream& out) const {
+  const std::vector<bsp_node>& nodes = structure->nodes;
+  const std::vector<plane>& planes = structure->planes;
+  const std::vector<point>& points = vertices.local();
+  record_writer records(out);
+  records.put<uint64_t>(nodes.size());
+  records.put<uint64_t>(ranges.size());
+  records.put<uint64_t>(planes.size());
+  records.put<uint64_t>(points.size());
+  records.put<uint64_t>(triangles.size());
+  records.put<T>(vertices.tolerance());
+
+  for (auto iter = nodes.begin(); iter != nodes.end(); ++iter) {
+    records.put<uint32_t>(iter->partition);
+    records.put<uint32_t>(iter->front);
+    records.put<uint32_t>(iter->back);
+    records.put<uint8_t>(iter->is_out);
+  }
+  for (auto iter = ranges.begin(); iter != ranges.end(); ++iter) {
+    records.put<uint32_t>(iter->first);
+    records.put<uint32_t>(iter->count);
+  }
+  for (auto iter = planes.begin(); iter != planes.end(); ++iter) {
+    records.put<T>(iter->normal().x);
+    records.put<T>(iter->normal().y);
+    records.put<T>(iter->normal().z);
+    records.put<T>(iter->offset());
+    records.put<T>(iter->tolerance());
+  }
+  for (auto iter = points.begin(); iter != points.end(); ++iter) {
+    records.put<T>(iter->x);
+    records.put<T>(iter->y);
+    records.put<T>(iter->z);
+  }
+  for (auto iter = triangles.begin(); iter != triangles.end(); ++iter) {
+    records.put<uint32_t>((*iter)[0]);
+    records.put<uint32_t>((*iter)[1]);
+    records.put<uint32_t>((*iter)[2]);
+    records.put<int32_t>(iter->id());
+    records.put<T>(iter->normal().x);
+    records.put<T>(iter->normal().y);
+    records.put<T>(iter->normal().z);
+    records.put<T>(iter->light());
+    records.put<uint8_t>(iter->is_visible() | iter->is_back_facing() << 1);
+  }
+}
+
+template <typename T>
+const char* bsp_t<T>::read(const char* begin, const char* end) {
+  record_reader records(begin, end);
+  records.need(5, sizeof(uint64_t));
+  uint64_t n_nodes = records.get<uint64_t>();
+  uint64_t n_ranges = records.get<uint64_t>();
+  uint64_t n_planes = records.get<uint64_t>();
+  uint64_t n_points = records.get<uint64_t>();
+  uint64_t n_triangles = records.get<uint64_t>();
+  if (n_nodes == 0 || n_nodes >= bsp_node::NONE || (n_ranges != n_nodes && n_ranges != 0) ||
+      n_planes >= bsp_node::NONE || n_points >= bsp_node::NONE ||
+      n_triangles >= bsp_node::NONE) {
+    throw std::runtime_error("The tree file has an invalid number of records");
+  }
+  records.need(1, sizeof(T));
+  T tolerance = records.get<T>();
+
+  std::shared_ptr<bsp_structure<T> > read_structure = std::make_shared<bsp_structure<T> >();
+  std::vector<bsp_node>& nodes = read_structure->nodes;
+  records.need(n_nodes, 3 * sizeof(uint32_t) + sizeof(uint8_t));
+  nodes.resize(n_nodes);
+  std::vector<bool> has_parent(n_nodes, false);
+  for (uint32_t i = 0; i < n_nodes; ++i) {
+    bsp_node& node = nodes[i];
+    node.partition = records.get<uint32_t>();
+    node.front = records.get<uint32_t>();
+    node.back = records.get<uint32_t>();
+    node.is_out = records.get<uint8_t>() != 0;
+    if (node.partition != bsp_node::NONE && node.partition >= n_planes) {
+      throw std::runtime_error("The tree file has a node with an invalid partition");
+    }
+    check_child(node.front, i, has_parent);
+    check_child(node.back, i, has_parent);
+  }
+  // Every node has a range, except in a tree made of a single empty leaf
+  if (n_ranges == 0 && (n_nodes != 1 || nodes[0].partition != bsp_node::NONE ||
+                        n_triangles != 0)) {
+    throw std::runtime_error("The tree file has nodes without triangle ranges");
+  }
+
+  std::vector<bsp_range> read_ranges(n_ranges);
+  records.need(n_ranges, 2 * sizeof(uint32_t));
+  for (auto iter = read_ranges.begin(); iter != read_ranges.end(); ++iter) {
+    iter->first = records.get<uint32_t>();
+    iter->count = records.get<uint32_t>();
+    if (iter->first > n_triangles || iter->count > n_triangles - iter->first) {
+      throw std::runtime_error("The tree file has a node with invalid triangles");
+    }
+  }
+
+  std::vector<plane>& planes = read_structure->planes;
+  records.need(n_planes, 5 * sizeof(T));
+  planes.reserve(n_planes);
+  for (uint64_t i = 0; i < n_planes; ++i) {
+    T x = records.get<T>();
+    T y = records.get<T>();
+    T z = records.get<T>();
+    T d = records.get<T>();
+    T tol = records.get<T>();
+    planes.push_back(plane(vec3(x, y, z), d, tol));
+  }
+
+  std::vector<point> points;
+  records.need(n_points, 3 * sizeof(T));
+  points.reserve(n_points);
+  for (uint64_t i = 0; i < n_points; ++i) {
+    T x = records.get<T>();
+    T y = records.get<T>();
+    T z = records.get<T>();
+    points.push_back(point(x, y, z));
+  }
+
+  std::vector<indexed_triangle> read_triangles;
+  records.need(n_triangles, 4 * sizeof(uint32_t) + 4 * sizeof(T) + sizeof(uint8_t));
+  read_triangles.reserve(n_triangles);
+  for (uint64_t i = 0; i < n_triangles; ++i) {
+    uint32_t a = records.get<uint32_t>();
+    uint32_t b = records.get<uint32_t>();
+    uint32_t c = records.get<uint32_t>();
+    int id = records.get<int32_t>();
+    T x = records.get<T>();
+    T y = records.get<T>();
+    T z = records.get<T>();
+    T light = records.get<T>();
+    uint8_t flags = records.get<uint8_t>();
+    if (a >= n_points || b >= n_points || c >= n_points) {
+      throw std::runtime_error("The tree file has a triangle with an invalid corner");
+    }
+    read_triangles.push_back(indexed_triangle(a, b, c, vec3(x, y, z), id, light,
+                                              (flags & 1) != 0, (flags & 2) != 0));
+  }
+
+  // The tree is only changed once the whole file has been read
+  structure = read_structure;
+  ranges.swap(read_ranges);
+  triangles.swap(read_triangles);
+  vertices.clear();
+  vertices.set_tolerance(tolerance);
+  vertices.append(points);
+  counters = bsp_stats();
+  return records.position();
+}
+
+// Reads the header and gives the records after it
+static record_reader read_header(const mapped_file& file) {
+  const char* begin = file.data();
+  if (file.size() < HEADER_SIZE || std::memcmp(begin, MAGIC, sizeof(MAGIC)) != 0) {
+    throw std::runtime_error("The file is not a tree file");
+  }
+  record_reader records(begin + sizeof(MAGIC), begin + file.size());
+  if (records.get<uint32_t>() != VERSION) {
+    throw std::runtime_error("The tree file was written by an unsupported version");
+  }
+  if (records.get<uint32_t>() != ORDER_MARK) {
+    throw std::runtime_error("The tree file was written on a machine with a different byte order");
+  }
+  return records;
+}
+
+size_t tree_file_scalar_size(const mapped_file& file) {
+  record_reader records = read_header(file);
+  uint32_t size = records.get<uint32_t>();
+  if (size != sizeof(float) && size != sizeof(double)) {
+    throw std::runtime_error("The tree file has coordinates of an unknown size");
+  }
+  return size;
+}
+
+template <typename T>
+void write_tree_file(const std::string& path, const bsp_t<T>& tree, const point_t<T>& origin,
+                     const unsigned char* payload, size_t payload_size) {
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  if (!out) {
+    throw std::runtime_error("Unable to open " + path + " for writing");
+  }
+  {
+    record_writer records(out);
+    records.put_bytes(MAGIC, sizeof(MAGIC));
+    records.put<uint32_t>(VERSION);
+    records.put<uint32_t>(ORDER_MARK);
+    records.put<uint32_t>(sizeof(T));
+    records.put<T>(origin.x);
+    records.put<T>(origin.y);
+    records.put<T>(origin.z);
+  }
+  tree.write(out);
+  {
+    record_writer records(out);
+    records.put<uint64_t>(payload_size);
+    records.put_bytes(payload, payload_size);
+  }
+  out.close();
+  if (!out) {
+    throw std::runtime_error("Unable to write " + path);
+  }
+}
+
+template <typename T>
+void read_tree_file(const mapped_file& file, bsp_t<T>& tree, point_t<T>& origin,
+                    const unsigned char*& payload, size_t& payload_size) {
+  if (tree_file_scalar_size(file) != sizeof(T)) {
+    throw std::runtime_error("The tree file has coordinates of a different precision");
+  }
+  record_reader records = read_header(file);
+  records.skip(sizeof(uint32_t));
+  records.need(3, sizeof(T));
+  T x = records.get<T>();
+  T y = records.get<T>();
+  T z = records.get<T>();
+  origin = point_t<T>(x, y, z);
+
+  const char* end = file.data() + file.size();
+  records = record_reader(tree.read(records.position(), end), end);
+  records.need(1, sizeof(uint64_t));
+  uint64_t size = records.get<uint64_t>();
+  records.need(size, 1);
+  payload = reinterpret_cast<const unsigned char*>(records.skip(size));
+  payload_size = size;
+}
+
+template void bsp_t<double>::write(std::ostream& out) const;
+template void bsp_t<float>::write(std::ostream& out) const;
+template const char* bsp_t<double>::read(const char* begin, const char* end);
+template const char* bsp_t<float>::read(const char* begin, const char* end);
+template void write_tree_file<double>(const std::string&, const bsp_t<double>&,
+                                      const point_t<double>&, const unsigned char*, size_t);
+template void write_tree_file<float>(const std::string&, const bsp_t<float>&,
+                                     const point_t<float>&, const unsigned char*, size_t);
+template void read_tree_file<double>(const mapped_file&, bsp_t<double>&, point_t<double>&,
+                                     const unsigned char*&, size_t&);
+template void read_tree_file<float>(const mapped_file&, bsp_t<float>&, point_t<float>&,
+                                    const unsigned char*&, size_t&);
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+
+#include "bsp.h"
+#include "mesh_file.h"
+
+// Prepared trees are saved in a versioned binary file. A header gives the
+// format version, the byte order, and the size of the coordinates, and is
+// followed by the point the tree is ordered around, the records of the tree,
+// and a block of bytes kept for the caller. Records are packed in the byte
+// order of the machine writing them, so a file is read without any parsing but
+// only on machines with the same byte order. Malformed files throw
+// std::runtime_error
+
+// The size in bytes of the coordinates in a tree file, 4 for single and 8 for
+// double precision
+size_t tree_file_scalar_size(const mapped_file& file);
+
+template <typename T>
+void write_tree_file(const std::string& path, const bsp_t<T>& tree, const point_t<T>& origin,
+                     const unsigned char* payload, size_t payload_size);
+
+// The payload points into the mapped file
+template <typename T>
+void read_tree_file(const mapped_file& file, bsp_t<T>& tree, point_t<T>& origin,
+                    const unsigned char*& payload, size_t& payload_size);
@@ -0,0 +1,590 @@
+#include "coalesce.h"
+#include "task_pool.h"
+
+#include <algorithm>
+#include <unordered_map>
+#include <utility>
+#include <limits>
+#include <cmath>
+#include <cstdint>
+
+// Outlines with more vertices than this, or needing more work than
+// MAX_JUNCTION_TESTS to fix up, are left as they are rather than spending
+// quadratic time on them
+static const size_t MAX_OUTLINE = 1024;
+static const size_t MAX_JUNCTION_TESTS = 1 << 22;
+
+template <typename T>
+struct flat_point {
+  T x, y;
+};
+
+// Twice the signed area of the triangle o, a, b. Positive when it turns left
+template <typename T>
+static T turn(const flat_point<T>& o, const flat_point<T>& a, const flat_point<T>& b) {
+  return (a.x - o.x) * (b.y - o.y) - (a.y - o.y) * (b.x - o.x);
+}
+template <typename T>
+static T flat_distance(const flat_point<T>& a, const flat_point<T>& b) {
+  return std::sqrt((b.x - a.x) * (b.x - a.x) + (b.y - a.y) * (b.y - a.y));
+}
+// Signed distance of p from the line through a and b, positive to the left
+template <typename T>
+static T side_of(const flat_point<T>& a, const flat_point<T>& b, const flat_point<T>& p) {
+  T length = flat_distance(a, b);
+  return length == 0 ? 0 : turn(a, b, p) / length;
+}
+
+// The angle turned going from a through b to c, in (-pi, pi]
+template <typename T>
+static T left_turn(const flat_point<T>& a, const flat_point<T>& b, const flat_point<T>& c) {
+  T dx1 = b.x - a.x;
+  T dy1 = b.y - a.y;
+  T dx2 = c.x - b.x;
+  T dy2 = c.y - b.y;
+  return std::atan2(dx1 * dy2 - dy1 * dx2, dx1 * dx2 + dy1 * dy2);
+}
+
+typedef std::vector<std::pair<uint32_t, uint32_t> > edge_list;
+
+// Removes edges that are matched by the same edge in the opposite direction,
+// leaving the outline. Fails if an edge is left more than once
+static bool cancel_edges(edge_list& edges) {
+  std::unordered_map<uint64_t, int> count;
+  for (auto it = edges.begin(); it != edges.end(); ++it) {
+    auto reverse = count.find(uint64_t(it->second) << 32 | it->first);
+    if (reverse != count.end() && reverse->second > 0) {
+      --reverse->second;
+    } else {
+      ++count[uint64_t(it->first) << 32 | it->second];
+    }
+  }
+  edges.clear();
+  for (auto it = count.begin(); it != count.end(); ++it) {
+    if (it->second > 1) return false;
+    if (it->second == 1) edges.emplace_back(it->first >> 32, uint32_t(it->first));
+  }
+  std::sort(edges.begin(), edges.end());
+  return true;
+}
+
+// Separate cuts can create vertices a rounding error apart. Numbers every
+// vertex by the lowest numbered vertex it is within tolerance of, directly or
+// through others, so the edges between them cancel
+template <typename T>
+static std::vector<uint32_t> merge_close(const std::vector<flat_point<T> >& flat, T tolerance) {
+  std::vector<uint32_t> same(flat.size());
+  std::vector<uint32_t> by_x(flat.size());
+  for (size_t i = 0; i < flat.size(); ++i) same[i] = by_x[i] = i;
+  std::sort(by_x.begin(), by_x.end(), [&](uint32_t a, uint32_t b) {
+    return flat[a].x < flat[b].x;
+  });
+  auto root = [&](uint32_t v) {
+    while (same[v] != v) v = same[v] = same[same[v]];
+    return v;
+  };
+  for (size_t i = 0; i < by_x.size(); ++i) {
+    const flat_point<T>& a = flat[by_x[i]];
+    for (size_t j = i + 1; j < by_x.size() && flat[by_x[j]].x - a.x <= tolerance; ++j) {
+      if (std::abs(flat[by_x[j]].y - a.y) > tolerance) continue;
+      uint32_t root_a = root(by_x[i]);
+      uint32_t root_b = root(by_x[j]);
+      if (root_a < root_b) {
+        same[root_b] = root_a;
+      } else {
+        same[root_a] = root_b;
+      }
+    }
+  }
+  for (size_t i = 0; i < same.size(); ++i) same[i] = root(i);
+  return same;
+}
+
+// Pieces cut on both sides of an edge share the vertex created there, but an
+// edge that was only cut on one side has the other side's vertices lying on
+// it. Splits the outline at such vertices so they cancel out as well
+template <typename T>
+static bool split_junctions(edge_list& edges, const std::vector<flat_point<T> >& flat,
+                            T tolerance) {
+  std::vector<uint32_t> outline;
+  for (auto it = edges.begin(); it != edges.end(); ++it) {
+    outline.push_back(it->first);
+    outline.push_back(it->second);
+  }
+  std::sort(outline.begin(), outline.end());
+  outline.erase(std::unique(outline.begin(), outline.end()), outline.end());
+  if (edges.size() * outline.size() > MAX_JUNCTION_TESTS) return false;
+
+  edge_list split;
+  std::vector<std::pair<T, uint32_t> > on_edge;
+  bool any = false;
+  for (auto it = edges.begin(); it != edges.end(); ++it) {
+    const flat_point<T>& a = flat[it->first];
+    const flat_point<T>& b = flat[it->second];
+    T dx = b.x - a.x;
+    T dy = b.y - a.y;
+    T length2 = dx * dx + dy * dy;
+    on_edge.clear();
+    for (auto v = outline.begin(); v != outline.end(); ++v) {
+      if (*v == it->first || *v == it->second) continue;
+      const flat_point<T>& p = flat[*v];
+      if (std::abs(side_of(a, b, p)) > tolerance) continue;
+      T t = ((p.x - a.x) * dx + (p.y - a.y) * dy) / length2;
+      if (!(t > 0 && t < 1)) continue;
+      if (flat_distance(a, p) <= tolerance || flat_distance(p, b) <= tolerance) continue;
+      on_edge.emplace_back(t, *v);
+    }
+    if (on_edge.empty()) {
+      split.push_back(*it);
+      continue;
+    }
+    any = true;
+    std::sort(on_edge.begin(), on_edge.end());
+    uint32_t from = it->first;
+    for (auto v = on_edge.begin(); v != on_edge.end(); ++v) {
+      split.emplace_back(from, v->second);
+      from = v->second;
+    }
+    split.emplace_back(from, it->second);
+  }
+  if (!any) return true;
+  edges.swap(split);
+  return cancel_edges(edges);
+}
+
+// Drops vertices the outline passes straight through, along with slivers of
+// no width
+template <typename T>
+static void drop_straight(std::vector<uint32_t>& loop, const std::vector<flat_point<T> >& flat,
+                          T tolerance) {
+  std::vector<uint32_t> kept;
+  size_t last_size = 0;
+  while (loop.size() >= 3 && loop.size() != last_size) {
+    last_size = loop.size();
+    kept.clear();
+    for (size_t i = 0; i < loop.size(); ++i) {
+      uint32_t prev = kept.empty() ? loop.back() : kept.back();
+      uint32_t next = loop[(i + 1) % loop.size()];
+      if (std::abs(side_of(flat[prev], flat[next], flat[loop[i]])) > tolerance) {
+        kept.push_back(loop[i]);
+      }
+    }
+    loop.swap(kept);
+  }
+}
+
+template <typename T>
+static size_t rightmost(const std::vector<uint32_t>& loop, const std::vector<flat_point<T> >& flat) {
+  size_t best = 0;
+  for (size_t i = 1; i < loop.size(); ++i) {
+    if (flat[loop[i]].x > flat[loop[best]].x) best = i;
+  }
+  return best;
+}
+
+// Whether p lies inside the loop, counting crossings of a ray going right
+template <typename T>
+static bool encloses(const std::vector<uint32_t>& loop, const std::vector<flat_point<T> >& flat,
+                     const flat_point<T>& p) {
+  bool inside = false;
+  for (size_t i = 0, j = loop.size() - 1; i < loop.size(); j = i++) {
+    const flat_point<T>& a = flat[loop[i]];
+    const flat_point<T>& b = flat[loop[j]];
+    if ((a.y > p.y) != (b.y > p.y) && p.x < a.x + (p.y - a.y) * (b.x - a.x) / (b.y - a.y)) {
+      inside = !inside;
+    }
+  }
+  return inside;
+}
+
+// Joins a clockwise hole to the outline enclosing it by a pair of edges from
+// its rightmost vertex to a vertex of the outline it can see. The ray to the
+// right of the hole vertex hits the outline at some edge. The end of that edge
+// furthest right is visible unless other vertices lie in the triangle between
+// the two, in which case the one closest in angle to the ray is
+template <typename T>
+static bool bridge_hole(std::vector<uint32_t>& outline, const std::vector<uint32_t>& hole,
+                        const std::vector<flat_point<T> >& flat) {
+  size_t from = rightmost(hole, flat);
+  const flat_point<T>& m = flat[hole[from]];
+
+  size_t hit = outline.size();
+  flat_point<T> at = m;
+  for (size_t i = 0; i < outline.size(); ++i) {
+    const flat_point<T>& a = flat[outline[i]];
+    const flat_point<T>& b = flat[outline[(i + 1) % outline.size()]];
+    if ((a.y > m.y) == (b.y > m.y)) continue;
+    T x = a.x + (m.y - a.y) * (b.x - a.x) / (b.y - a.y);
+    if (x < m.x || (hit != outline.size() && x >= at.x)) continue;
+    hit = i;
+    at.x = x;
+  }
+  if (hit == outline.size()) return false;
+  size_t to = flat[outline[hit]].x > flat[outline[(hit + 1) % outline.size()]].x ?
+    hit : (hit + 1) % outline.size();
+
+  const flat_point<T> p = flat[outline[to]];
+  T best_angle = std::abs(std::atan2(p.y - m.y, p.x - m.x));
+  T best_distance = flat_distance(m, p);
+  for (size_t i = 0; i < outline.size(); ++i) {
+    const flat_point<T>& v = flat[outline[i]];
+    if (i == to || v.x < m.x) continue;
+    bool in_triangle = p.y > m.y ?
+      turn(m, at, v) >= 0 && turn(at, p, v) >= 0 && turn(p, m, v) >= 0 :
+      turn(m, at, v) <= 0 && turn(at, p, v) <= 0 && turn(p, m, v) <= 0;
+    if (!in_triangle) continue;
+    T angle = std::abs(std::atan2(v.y - m.y, v.x - m.x));
+    T distance = flat_distance(m, v);
+    if (angle < best_angle || (angle == best_angle && distance < best_distance)) {
+      best_angle = angle;
+      best_distance = distance;
+      to = i;
+    }
+  }
+
+  std::vector<uint32_t> joined(outline.begin(), outline.begin() + to + 1);
+  for (size_t i = 0; i <= hole.size(); ++i) {
+    joined.push_back(hole[(from + i) % hole.size()]);
+  }
+  joined.insert(joined.end(), outline.begin() + to, outline.end());
+  outline.swap(joined);
+  return true;
+}
+
+// Whether the diagonal from loop[a] to loop[b] runs inside the outline: it
+// must leave both ends into the outline, cross none of its edges nor pass
+// through its vertices and have its midpoint inside
+template <typename T>
+static bool is_diagonal(const std::vector<uint32_t>& loop, size_t a, size_t b,
+                        const std::vector<flat_point<T> >& flat, T tolerance) {
+  size_t n = loop.size();
+  const flat_point<T>& pa = flat[loop[a]];
+  const flat_point<T>& pb = flat[loop[b]];
+  size_t ends[2] = {a, b};
+  for (int k = 0; k < 2; ++k) {
+    const flat_point<T>& v = flat[loop[ends[k]]];
+    const flat_point<T>& to = flat[loop[ends[1 - k]]];
+    const flat_point<T>& prev = flat[loop[(ends[k] + n - 1) % n]];
+    const flat_point<T>& next = flat[loop[(ends[k] + 1) % n]];
+    bool inside = turn(prev, v, next) > 0 ?
+      turn(v, next, to) > 0 && turn(v, to, prev) > 0 :
+      !(turn(v, prev, to) >= 0 && turn(v, to, next) >= 0);
+    if (!inside) return false;
+  }
+  T length2 = (pb.x - pa.x) * (pb.x - pa.x) + (pb.y - pa.y) * (pb.y - pa.y);
+  for (size_t i = 0; i < n; ++i) {
+    uint32_t c = loop[i];
+    uint32_t d = loop[(i + 1) % n];
+    if (c == loop[a] || c == loop[b]) continue;
+    const flat_point<T>& pc = flat[c];
+    T t = ((pc.x - pa.x) * (pb.x - pa.x) + (pc.y - pa.y) * (pb.y - pa.y)) / length2;
+    if (t > 0 && t < 1 && std::abs(side_of(pa, pb, pc)) <= tolerance) return false;
+    if (d == loop[a] || d == loop[b]) continue;
+    T c1 = turn(pa, pb, flat[c]);
+    T c2 = turn(pa, pb, flat[d]);
+    T c3 = turn(flat[c], flat[d], pa);
+    T c4 = turn(flat[c], flat[d], pb);
+    if (((c1 > 0 && c2 < 0) || (c1 < 0 && c2 > 0)) &&
+        ((c3 > 0 && c4 < 0) || (c3 < 0 && c4 > 0))) {
+      return false;
+    }
+  }
+  flat_point<T> middle = {(pa.x + pb.x) / 2, (pa.y + pb.y) / 2};
+  return encloses(loop, flat, middle);
+}
+
+// Splits the outline in two along the first diagonal found. loop keeps one
+// side and other receives the rest
+template <typename T>
+static bool split_outline(std::vector<uint32_t>& loop, std::vector<uint32_t>& other,
+                          const std::vector<flat_point<T> >& flat, T tolerance) {
+  size_t n = loop.size();
+  for (size_t a = 0; a < n; ++a) {
+    for (size_t b = a + 2; b < n; ++b) {
+      if (a == 0 && b == n - 1) continue;
+      if (loop[a] == loop[b] || !is_diagonal(loop, a, b, flat, tolerance)) continue;
+      other.assign(loop.begin() + b, loop.end());
+      other.insert(other.end(), loop.begin(), loop.begin() + a + 1);
+      loop.erase(loop.begin() + b + 1, loop.end());
+      loop.erase(loop.begin(), loop.begin() + a);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Triangulates a counter-clockwise outline by cutting off one ear at a time
+template <typename T>
+static bool clip_ears(std::vector<uint32_t>& loop, const std::vector<flat_point<T> >& flat,
+                      T tolerance, const std::vector<uint32_t>& ids,
+                      const indexed_triangle_t<T>& source,
+                      std::vector<indexed_triangle_t<T> >& merged) {
+  size_t i = 0;
+  size_t misses = 0;
+  while (loop.size() > 3) {
+    size_t n = loop.size();
+    i %= n;
+    uint32_t prev = loop[(i + n - 1) % n];
+    uint32_t ear = loop[i];
+    uint32_t next = loop[(i + 1) % n];
+    bool is_ear = side_of(flat[prev], flat[next], flat[ear]) < -tolerance;
+    for (size_t j = 0; is_ear && j < n; ++j) {
+      uint32_t v = loop[j];
+      if (v == prev || v == ear || v == next) continue;
+      is_ear = side_of(flat[prev], flat[ear], flat[v]) < -tolerance ||
+        side_of(flat[ear], flat[next], flat[v]) < -tolerance ||
+        side_of(flat[next], flat[prev], flat[v]) < -tolerance;
+    }
+    if (!is_ear) {
+      ++i;
+      if (++misses > n) {
+        // No ear can be cut, which happens around vertices joining several
+        // holes. Split the outline along a diagonal and triangulate both sides
+        std::vector<uint32_t> other;
+        if (!split_outline(loop, other, flat, tolerance)) return false;
+        return clip_ears(loop, flat, tolerance, ids, source, merged) &&
+          clip_ears(other, flat, tolerance, ids, source, merged);
+      }
+      continue;
+    }
+    merged.emplace_back(ids[prev], ids[ear], ids[next], source);
+    loop.erase(loop.begin() + i);
+    i = i == 0 ? 0 : i - 1;
+    misses = 0;
+  }
+  if (side_of(flat[loop[0]], flat[loop[2]], flat[loop[1]]) < -tolerance) {
+    merged.emplace_back(ids[loop[0]], ids[loop[1]], ids[loop[2]], source);
+  }
+  return true;
+}
+
+// Replaces the fragments in group with a triangulation of their outline. The
+// fragments are coplanar so they are flattened along the main axis of their
+// normal, oriented so the outline runs counter-clockwise. Returns false if the
+// outline isn't a set of simple polygons without holes
+template <typename T>
+static bool coalesce_group(const vertex_pool_t<T>& vertices,
+                           const std::vector<indexed_triangle_t<T> >& triangles,
+                           const uint32_t* group, size_t n,
+                           std::vector<indexed_triangle_t<T> >& merged) {
+  const indexed_triangle_t<T>& source = triangles[group[0]];
+
+  std::vector<uint32_t> ids;
+  std::unordered_map<uint32_t, uint32_t> local;
+  std::vector<uint32_t> corners(n * 3);
+  for (size_t i = 0; i < n; ++i) {
+    const indexed_triangle_t<T>& tri = triangles[group[i]];
+    for (int k = 0; k < 3; ++k) {
+      auto found = local.emplace(tri[k], ids.size());
+      if (found.second) ids.push_back(tri[k]);
+      corners[i * 3 + k] = found.first->second;
+    }
+  }
+
+  const vec3_t<T>& normal = source.normal();
+  T nx = std::abs(normal.x);
+  T ny = std::abs(normal.y);
+  T nz = std::abs(normal.z);
+  int axis = nx > ny ? (nx > nz ? 0 : 2) : (ny > nz ? 1 : 2);
+  bool flip = (axis == 0 ? normal.x : axis == 1 ? normal.y : normal.z) < 0;
+  std::vector<flat_point<T> > flat(ids.size());
+  T scale = 0;
+  for (size_t i = 0; i < ids.size(); ++i) {
+    const point_t<T>& p = vertices[ids[i]];
+    flat_point<T> f = axis == 0 ? flat_point<T>{p.y, p.z} :
+      axis == 1 ? flat_point<T>{p.z, p.x} : flat_point<T>{p.x, p.y};
+    if (flip) std::swap(f.x, f.y);
+    flat[i] = f;
+    scale = std::max(scale, std::max(std::abs(p.x), std::max(std::abs(p.y), std::abs(p.z))));
+  }
+  T tolerance = 256 * std::numeric_limits<T>::epsilon() * scale;
+
+  std::vector<uint32_t> same = merge_close(flat, tolerance);
+  edge_list edges;
+  edges.reserve(n * 3);
+  for (size_t i = 0; i < corners.size(); i += 3) {
+    for (int k = 0; k < 3; ++k) {
+      uint32_t a = same[corners[i + k]];
+      uint32_t b = same[corners[i + (k + 1) % 3]];
+      if (a != b) edges.emplace_back(a, b);
+    }
+  }
+
+  if (!cancel_edges(edges)) return false;
+  if (!split_junctions(edges, flat, tolerance)) return false;
+
+  // Edges are sorted so the edges leaving a vertex are next to each other.
+  // Loops touching at a vertex are kept apart by always taking the leaving edge
+  // that turns furthest to the left
+  std::vector<uint32_t> leaving(ids.size() + 1, 0);
+  for (auto it = edges.begin(); it != edges.end(); ++it) ++leaving[it->first + 1];
+  for (size_t i = 1; i < leaving.size(); ++i) leaving[i] += leaving[i - 1];
+  std::vector<bool> traced(edges.size(), false);
+  std::vector<std::vector<uint32_t> > outlines;
+  std::vector<T> outline_areas;
+  std::vector<std::vector<uint32_t> > holes;
+  std::vector<uint32_t> loop;
+  for (size_t start = 0; start < edges.size(); ++start) {
+    if (traced[start]) continue;
+    loop.clear();
+    size_t edge = start;
+    do {
+      if (traced[edge]) return false;
+      traced[edge] = true;
+      uint32_t from = edges[edge].first;
+      uint32_t v = edges[edge].second;
+      loop.push_back(from);
+      size_t first = leaving[v];
+      size_t last = leaving[v + 1];
+      if (first == last) return false;
+      edge = first;
+      if (last - first > 1) {
+        T best = 0;
+        for (size_t e = first; e < last; ++e) {
+          T angle = left_turn(flat[from], flat[v], flat[edges[e].second]);
+          if (e == first || angle > best) {
+            best = angle;
+            edge = e;
+          }
+        }
+      }
+    } while (edge != start);
+
+    drop_straight(loop, flat, tolerance);
+    if (loop.size() < 3) continue;
+    T area = 0;
+    for (size_t i = 1; i + 1 < loop.size(); ++i) {
+      area += turn(flat[loop[0]], flat[loop[i]], flat[loop[i + 1]]);
+    }
+    if (area > 0) {
+      outlines.push_back(loop);
+      outline_areas.push_back(area);
+    } else {
+      holes.push_back(loop);
+    }
+  }
+
+  // Holes are bridged from right to left so a bridge never crosses the holes
+  // that are already part of the outline
+  std::vector<std::pair<T, size_t> > right_to_left;
+  for (size_t i = 0; i < holes.size(); ++i) {
+    right_to_left.emplace_back(-flat[holes[i][rightmost(holes[i], flat)]].x, i);
+  }
+  std::sort(right_to_left.begin(), right_to_left.end());
+  for (auto it = right_to_left.begin(); it != right_to_left.end(); ++it) {
+    const std::vector<uint32_t>& hole = holes[it->second];
+    const flat_point<T>& p = flat[hole[rightmost(hole, flat)]];
+    // Parts can lie within the holes of other parts, so the hole belongs to the
+    // smallest outline around it
+    size_t outline = outlines.size();
+    for (size_t i = 0; i < outlines.size(); ++i) {
+      if ((outline == outlines.size() || outline_areas[i] < outline_areas[outline]) &&
+          encloses(outlines[i], flat, p)) {
+        outline = i;
+      }
+    }
+    if (outline == outlines.size()) return false;
+    if (!bridge_hole(outlines[outline], hole, flat)) return false;
+  }
+
+  for (auto it = outlines.begin(); it != outlines.end(); ++it) {
+    if (it->size() > MAX_OUTLINE) return false;
+    if (!clip_ears(*it, flat, tolerance, ids, source, merged)) return false;
+  }
+  return true;
+}
+
+// A last check that the triangulation covers the same area as the fragments,
+// up to the rounding error of summing them
+template <typename T>
+static bool same_area(const vertex_pool_t<T>& vertices,
+                      const std::vector<indexed_triangle_t<T> >& triangles,
+                      const uint32_t* group, size_t n,
+                      const std::vector<indexed_triangle_t<T> >& merged, size_t from) {
+  double area = 0;
+  for (size_t i = 0; i < n; ++i) area += vertices.area(triangles[group[i]]);
+  double merged_area = 0;
+  for (size_t i = from; i < merged.size(); ++i) merged_area += vertices.area(merged[i]);
+  return std::abs(merged_area - area) <= std::sqrt(std::numeric_limits<T>::epsilon()) * area;
+}
+
+template <typename T>
+static bool same_group(const indexed_triangle_t<T>& a, const indexed_triangle_t<T>& b) {
+  return a.id() == b.id() && a.is_visible() == b.is_visible() &&
+    a.is_back_facing() == b.is_back_facing() && a.light() == b.light();
+}
+
+template <typename T>
+static bool group_before(const indexed_triangle_t<T>& a, const indexed_triangle_t<T>& b) {
+  if (a.id() != b.id()) return a.id() < b.id();
+  if (a.is_visible() != b.is_visible()) return a.is_visible() < b.is_visible();
+  if (a.is_back_facing() != b.is_back_facing()) return a.is_back_facing() < b.is_back_facing();
+  return a.light() < b.light();
+}
+
+template <typename T>
+void coalesce_fragments(const vertex_pool_t<T>& vertices,
+                        std::vector<indexed_triangle_t<T> >& triangles, size_t n_threads) {
+  typedef indexed_triangle_t<T> indexed_triangle;
+  if (triangles.empty()) return;
+
+  std::vector<uint32_t> order(triangles.size());
+  for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+  std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+    return group_before(triangles[a], triangles[b]);
+  });
+  std::vector<size_t> groups;
+  for (size_t i = 0; i < order.size(); ++i) {
+    if (i == 0 || !same_group(triangles[order[i - 1]], triangles[order[i]])) {
+      groups.push_back(i);
+    }
+  }
+  groups.push_back(order.size());
+  size_t n_groups = groups.size() - 1;
+
+  // Every chunk of groups collects its own triangles, recording where each
+  // group starts and which fragment it replaces
+  struct merged_group {
+    uint32_t position;
+    uint32_t chunk;
+    size_t from;
+    size_t to;
+  };
+  size_t n_chunks = std::min(n_groups, std::max(n_threads, size_t(1)) * 4);
+  std::vector<std::vector<indexed_triangle> > merged(n_chunks);
+  std::vector<std::vector<merged_group> > placed(n_chunks);
+  parallel_for(n_chunks, n_threads, [&](size_t chunk) {
+    std::vector<indexed_triangle>& out = merged[chunk];
+    for (size_t g = n_groups * chunk / n_chunks; g < n_groups * (chunk + 1) / n_chunks; ++g) {
+      const uint32_t* group = order.data() + groups[g];
+      size_t n = groups[g + 1] - groups[g];
+      size_t before = out.size();
+      if (n == 1 || !coalesce_group(vertices, triangles, group, n, out) ||
+          out.size() == before || out.size() - before > n ||
+          !same_area(vertices, triangles, group, n, out, before)) {
+        out.resize(before);
+        for (size_t i = 0; i < n; ++i) out.push_back(triangles[group[i]]);
+      }
+      placed[chunk].push_back({group[0], (uint32_t) chunk, before, out.size()});
+    }
+  });
+
+  std::vector<merged_group> all;
+  all.reserve(n_groups);
+  for (size_t chunk = 0; chunk < n_chunks; ++chunk) {
+    all.insert(all.end(), placed[chunk].begin(), placed[chunk].end());
+  }
+  std::sort(all.begin(), all.end(), [](const merged_group& a, const merged_group& b) {
+    return a.position < b.position;
+  });
+  triangles.clear();
+  for (auto it = all.begin(); it != all.end(); ++it) {
+    triangles.insert(triangles.end(), merged[it->chunk].begin() + it->from,
+                     merged[it->chunk].begin() + it->to);
+  }
+}
+
+template void coalesce_fragments<double>(const vertex_pool_t<double>&,
+                                         std::vector<indexed_triangle_t<double> >&, size_t);
+template void coalesce_fragments<float>(const vertex_pool_t<float>&,
+                                        std::vector<indexed_triangle_t<float> >&, size_t);
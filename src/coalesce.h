@@ -0,0 +1,17 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+
+#include "vertex_pool.h"
+
+// Merges fragments cut from the same triangle that ended up with the same
+// attributes. The outline of every such group is traced through the shared
+// vertices and triangulated again, so a triangle that was split without
+// anything changing between the pieces comes back whole. Holes in an outline
+// are bridged to it before triangulating. Groups whose outline can't be traced
+// or triangulated cleanly are kept as they are. The merged triangles take the
+// place of the first fragment of their group in the list
+template <typename T>
+void coalesce_fragments(const vertex_pool_t<T>& vertices,
+                        std::vector<indexed_triangle_t<T> >& triangles, size_t n_threads);
@@ -0,0 +1,353 @@
+#include "coverage.h"
+
+#include <algorithm>
+#include <cmath>
+
+// Faces have from 2^MIN_LEVELS to 2^MAX_LEVELS pixels along each side, with
+// about as many pixels on a face as there are triangles
+static const int MIN_LEVELS = 6;
+static const int MAX_LEVELS = 9;
+// Distance in pixels that points must keep from the border of a pixel or an
+// edge to be trusted, absorbing rounding in the projection
+static const double MARGIN = 1e-4;
+// A pixel is covered once no more than this share of it is left uncovered
+static const double OPEN_SHARE = 1e-6;
+// Share of its size the window of a face is widened by on every side, so
+// rounding doesn't take projected points out of it
+static const double WINDOW_PAD = 1e-6;
+// Points closer to the viewpoint than this share of the size of their
+// triangle can't be projected reliably
+static const double NEAR_SHARE = 1e-9;
+
+// The corners of a face in its own coordinates: w points away from the
+// viewpoint through the centre of the face, and u / w and v / w run from -1 to
+// 1 across it. The four planes where |u| = w or |v| = w bound the face
+static void to_face(int face, const double* eye, const double* p, double* out) {
+  int axis = face / 2;
+  double sign = face % 2 == 0 ? 1 : -1;
+  out[0] = p[(axis + 1) % 3] - eye[(axis + 1) % 3];
+  out[1] = p[(axis + 2) % 3] - eye[(axis + 2) % 3];
+  out[2] = sign * (p[axis] - eye[axis]);
+}
+
+static double clip_distance(int plane, const double* p) {
+  switch (plane) {
+  case 0: return p[2] - p[0];
+  case 1: return p[2] + p[0];
+  case 2: return p[2] - p[1];
+  default: return p[2] + p[1];
+  }
+}
+
+// The face holding the direction from the viewpoint to p, or -1 for the
+// viewpoint itself
+static int face_of(const double* eye, const double* p) {
+  int axis = 0;
+  double size = 0;
+  for (int k = 0; k < 3; ++k) {
+    if (std::abs(p[k] - eye[k]) > size) {
+      size = std::abs(p[k] - eye[k]);
+      axis = k;
+    }
+  }
+  if (size == 0) return -1;
+  return axis * 2 + (p[axis] > eye[axis] ? 0 : 1);
+}
+
+// The faces the triangle may reach. Faces are convex so a triangle with all
+// corners on one face lies fully on it and needs no clipping. Returns the
+// number of faces in list, which is 0 if a corner is at the viewpoint
+int coverage_cube::faces_of(const double (&corners)[3][3], int (&list)[6]) const {
+  int first = face_of(eye, corners[0]);
+  int second = face_of(eye, corners[1]);
+  int third = face_of(eye, corners[2]);
+  if (first < 0 || second < 0 || third < 0) return 0;
+  if (first == second && first == third) {
+    list[0] = first;
+    return 1;
+  }
+  for (int f = 0; f < 6; ++f) list[f] = f;
+  return 6;
+}
+
+// Clips the polygon to the face if asked to and leaves the corners of what is
+// left in projected as u / w and v / w. projected is left empty if the polygon
+// misses the face. Returns false if a point is too close to the viewpoint to
+// be projected
+bool coverage_cube::project(int face, const double (*corners)[3], int n, bool clip) const {
+  std::vector<double>& in = clip_buffer[0];
+  std::vector<double>& out = clip_buffer[1];
+  in.resize(n * 3);
+  double scale = 0;
+  for (int i = 0; i < n; ++i) {
+    to_face(face, eye, corners[i], &in[i * 3]);
+    for (int k = 0; k < 3; ++k) scale = std::max(scale, std::abs(in[i * 3 + k]));
+  }
+  for (int plane = 0; clip && plane < 4 && !in.empty(); ++plane) {
+    out.clear();
+    size_t m = in.size() / 3;
+    for (size_t i = 0; i < m; ++i) {
+      const double* p = &in[i * 3];
+      const double* q = &in[((i + 1) % m) * 3];
+      double dp = clip_distance(plane, p);
+      double dq = clip_distance(plane, q);
+      if (dp >= 0) out.insert(out.end(), p, p + 3);
+      if ((dp >= 0) != (dq >= 0)) {
+        double t = dp / (dp - dq);
+        for (int k = 0; k < 3; ++k) out.push_back(p[k] + (q[k] - p[k]) * t);
+      }
+    }
+    in.swap(out);
+  }
+  projected.clear();
+  for (size_t i = 0; i < in.size(); i += 3) {
+    if (in[i + 2] <= scale * NEAR_SHARE) return false;
+    projected.push_back({in[i] / in[i + 2], in[i + 1] / in[i + 2]});
+  }
+  return true;
+}
+
+void coverage_cube::to_pixels(const cube_face& face) const {
+  for (auto it = projected.begin(); it != projected.end(); ++it) {
+    it->x = (it->x - face.origin[0]) * face.scale[0];
+    it->y = (it->y - face.origin[1]) * face.scale[1];
+  }
+}
+
+uint32_t coverage_cube::clamp_pixel(double coord) const {
+  if (coord < 0) return 0;
+  if (coord >= resolution) return resolution - 1;
+  return uint32_t(coord);
+}
+
+coverage_cube::coverage_cube(const double (&from)[3], const double (&low)[3],
+                             const double (&high)[3], size_t n_triangles) {
+  for (int k = 0; k < 3; ++k) eye[k] = from[k];
+  levels = MIN_LEVELS;
+  while (levels < MAX_LEVELS && (size_t(1) << (2 * levels)) < n_triangles) ++levels;
+  resolution = 1 << levels;
+  // Everything inside the box projects within the projection of its sides
+  double sides[6][4][3];
+  for (int side = 0; side < 6; ++side) {
+    int axis = side / 2;
+    for (int i = 0; i < 4; ++i) {
+      double* corner = sides[side][i];
+      corner[axis] = side % 2 == 0 ? low[axis] : high[axis];
+      corner[(axis + 1) % 3] = i == 1 || i == 2 ? high[(axis + 1) % 3] : low[(axis + 1) % 3];
+      corner[(axis + 2) % 3] = i >= 2 ? high[(axis + 2) % 3] : low[(axis + 2) % 3];
+    }
+  }
+  for (int f = 0; f < 6; ++f) {
+    double window[4] = {1, 1, -1, -1};
+    for (int side = 0; side < 6; ++side) {
+      if (!project(f, sides[side], 4, true)) {
+        // The viewpoint is on the box so it may reach all of the face
+        window[0] = window[1] = -1;
+        window[2] = window[3] = 1;
+        break;
+      }
+      for (auto it = projected.begin(); it != projected.end(); ++it) {
+        window[0] = std::min(window[0], it->x);
+        window[1] = std::min(window[1], it->y);
+        window[2] = std::max(window[2], it->x);
+        window[3] = std::max(window[3], it->y);
+      }
+    }
+    if (window[0] > window[2] || window[1] > window[3]) continue;
+    cube_face& face = faces[f];
+    face.used = true;
+    for (int k = 0; k < 2; ++k) {
+      double pad = (window[k + 2] - window[k]) * WINDOW_PAD + WINDOW_PAD;
+      double first = std::max(-1.0, window[k] - pad);
+      double last = std::min(1.0, window[k + 2] + pad);
+      face.origin[k] = first;
+      face.scale[k] = resolution / (last - first);
+    }
+    face.area.assign(resolution * resolution, 0);
+    face.covered.assign(resolution * resolution, 0);
+    face.uncovered.resize(levels + 1);
+    for (int level = 0; level <= levels; ++level) {
+      uint32_t side = 1 << level;
+      uint32_t pixels_per_block = 1 << (2 * (levels - level));
+      face.uncovered[level].assign(side * side, pixels_per_block);
+    }
+  }
+}
+
+bool coverage_cube::is_covered(const cube_face& face, int level, uint32_t bx, uint32_t by,
+                               const uint32_t (&range)[4]) const {
+  uint32_t size = 1 << (levels - level);
+  uint32_t x0 = bx * size;
+  uint32_t y0 = by * size;
+  if (x0 > range[2] || x0 + size - 1 < range[0] || y0 > range[3] || y0 + size - 1 < range[1]) {
+    return true;
+  }
+  if (face.uncovered[level][by * (1 << level) + bx] == 0) return true;
+  if (level == levels) return false;
+  for (uint32_t i = 0; i < 4; ++i) {
+    if (!is_covered(face, level + 1, bx * 2 + i % 2, by * 2 + i / 2, range)) return false;
+  }
+  return true;
+}
+
+bool coverage_cube::is_covered(const double (&corners)[3][3]) const {
+  int list[6];
+  int n = faces_of(corners, list);
+  bool any = false;
+  for (int i = 0; i < n; ++i) {
+    const cube_face& face = faces[list[i]];
+    if (!project(list[i], corners, 3, n > 1)) return false;
+    if (projected.empty()) continue;
+    if (!face.used) return false;
+    to_pixels(face);
+    double min_x = projected[0].x, max_x = min_x;
+    double min_y = projected[0].y, max_y = min_y;
+    for (auto it = projected.begin(); it != projected.end(); ++it) {
+      min_x = std::min(min_x, it->x);
+      max_x = std::max(max_x, it->x);
+      min_y = std::min(min_y, it->y);
+      max_y = std::max(max_y, it->y);
+    }
+    uint32_t range[4] = {
+      clamp_pixel(min_x - MARGIN), clamp_pixel(min_y - MARGIN),
+      clamp_pixel(max_x + MARGIN), clamp_pixel(max_y + MARGIN)
+    };
+    if (!is_covered(face, 0, 0, 0, range)) return false;
+    any = true;
+  }
+  return any;
+}
+
+// Adds area to the pixel and marks it as covered once it is all but full
+void coverage_cube::cover(int f, uint32_t pixel, double area) {
+  cube_face& face = faces[f];
+  if (face.covered[pixel]) return;
+  face.area[pixel] += area;
+  if (face.area[pixel] < 1 - OPEN_SHARE) return;
+  face.covered[pixel] = 1;
+  uint32_t x = pixel % resolution;
+  uint32_t y = pixel / resolution;
+  for (int level = levels; level >= 0; --level) {
+    uint32_t shift = levels - level;
+    --face.uncovered[level][(y >> shift) * (1 << level) + (x >> shift)];
+  }
+}
+
+// Leaves the share of the row an edge running from x0 to x1 across it adds to
+// the pixels right of it. share is the height of the part of the row the edge
+// spans, signed by its direction. The pixels the edge crosses get the part of
+// share matching the area between the edge and their right side, and the
+// pixel after them the rest
+void coverage_cube::add_share(uint32_t row, double x0, double x1, double share) {
+  double* line = &shares[size_t(row) * (resolution + 2)];
+  if (x0 > x1) std::swap(x0, x1);
+  uint32_t first = uint32_t(x0);
+  uint32_t last = uint32_t(std::ceil(x1));
+  if (last <= first + 1) {
+    double middle = (x0 + x1) / 2 - first;
+    line[first] += share * (1 - middle);
+    line[first + 1] += share * middle;
+    last = first + 1;
+  } else {
+    double slope = 1 / (x1 - x0);
+    double head = 1 - (x0 - first);
+    double tail = x1 - (last - 1);
+    double head_area = slope * head * head / 2;
+    double tail_area = slope * tail * tail / 2;
+    line[first] += share * head_area;
+    double done = head_area;
+    for (uint32_t x = first + 1; x + 1 < last; ++x) {
+      double next = slope * (head + (x - first) - 0.5);
+      line[x] += share * (next - done);
+      done = next;
+    }
+    line[last - 1] += share * (1 - done - tail_area);
+    line[last] += share * tail_area;
+  }
+  span_first[row] = std::min(span_first[row], first);
+  span_last[row] = std::max(span_last[row], last);
+}
+
+// Adds the area of the projected polygon inside every pixel to the face. Every
+// edge leaves its shares in the rows it spans, and summing the shares along a
+// row gives the part of every pixel inside the polygon
+void coverage_cube::rasterize(int f) {
+  double size = resolution;
+  for (auto it = projected.begin(); it != projected.end(); ++it) {
+    it->x = std::min(std::max(it->x, 0.0), size);
+    it->y = std::min(std::max(it->y, 0.0), size);
+  }
+  if (shares.empty()) {
+    shares.assign(size_t(resolution + 2) * resolution, 0);
+    span_first.assign(resolution, resolution + 1);
+    span_last.assign(resolution, 0);
+  }
+  uint32_t top = resolution;
+  uint32_t bottom = 0;
+  size_t n = projected.size();
+  for (size_t j = 0; j < n; ++j) {
+    pixel_point p = projected[j];
+    pixel_point q = projected[(j + 1) % n];
+    if (p.y == q.y) continue;
+    double sign = 1;
+    if (p.y > q.y) {
+      std::swap(p, q);
+      sign = -1;
+    }
+    double slope = (q.x - p.x) / (q.y - p.y);
+    uint32_t first = uint32_t(p.y);
+    uint32_t last = std::min(uint32_t(std::ceil(q.y)), resolution);
+    for (uint32_t row = first; row < last; ++row) {
+      double y0 = std::max(p.y, double(row));
+      double y1 = std::min(q.y, double(row + 1));
+      if (y1 <= y0) continue;
+      double x0 = std::min(std::max(p.x + (y0 - p.y) * slope, 0.0), size);
+      double x1 = std::min(std::max(p.x + (y1 - p.y) * slope, 0.0), size);
+      add_share(row, x0, x1, sign * (y1 - y0));
+    }
+    top = std::min(top, first);
+    bottom = std::max(bottom, last);
+  }
+
+  for (uint32_t row = top; row < bottom; ++row) {
+    if (span_first[row] > span_last[row]) continue;
+    double* line = &shares[size_t(row) * (resolution + 2)];
+    double sum = 0;
+    for (uint32_t x = span_first[row]; x <= span_last[row]; ++x) {
+      sum += line[x];
+      line[x] = 0;
+      if (x < resolution && sum != 0) {
+        cover(f, row * resolution + x, std::min(std::abs(sum), 1.0));
+      }
+    }
+    span_first[row] = resolution + 1;
+    span_last[row] = 0;
+  }
+}
+
+// Triangles seen edge on cover nothing and are left out. Triangles reaching
+// over several faces are clipped to each of them, and the edges made by
+// clipping run along the border of the face
+void coverage_cube::add(const double (&corners)[3][3]) {
+  int list[6];
+  int n = faces_of(corners, list);
+  if (n == 0) return;
+  for (int i = 0; i < n; ++i) {
+    if (!project(list[i], corners, 3, n > 1)) return;
+  }
+  for (int i = 0; i < n; ++i) {
+    int f = list[i];
+    if (!faces[f].used) continue;
+    project(f, corners, 3, n > 1);
+    if (projected.size() < 3) continue;
+    to_pixels(faces[f]);
+    double area = 0;
+    for (size_t j = 0; j < projected.size(); ++j) {
+      const pixel_point& p = projected[j];
+      const pixel_point& q = projected[(j + 1) % projected.size()];
+      area += p.x * q.y - q.x * p.y;
+    }
+    if (std::abs(area) <= MARGIN * MARGIN) continue;
+    rasterize(f);
+  }
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// A conservative record of the directions around a viewpoint that are covered
+// by the triangles added so far, kept on the six faces of a cube around the
+// viewpoint with a pyramid of counts over each face for fast queries.
+//
+// It relies on triangles being handled in near to far order, as given by a BSP
+// tree: a triangle can then never be in front of one handled before it, so a
+// triangle is hidden as soon as every direction it spans is covered and no
+// depth needs to be kept. Triangles must only be added where they don't
+// overlap what was added before, which is what the fragments reaching the
+// outside of a shadow volume give. Every pixel sums the area of the added
+// triangles inside it, found as a scanline rasterizer does from the share of
+// every row the edges leave in the pixels they cross. A pixel is covered once
+// its area is all but the full pixel, which slivers and loops around a hole
+// can't reach, and stays covered from then on. Every test leans towards
+// reporting a triangle as uncertain rather than hidden, so skipping hidden
+// triangles doesn't change what is visible
+class coverage_cube {
+private:
+  struct pixel_point {
+    double x;
+    double y;
+  };
+  struct cube_face {
+    // The part of the face the geometry can reach is spread over its pixels,
+    // with a pixel x of (u / w - origin[0]) * scale[0] and likewise for y.
+    // Faces out of reach are left empty
+    double origin[2];
+    double scale[2];
+    bool used = false;
+    // The area covered in every pixel, whether it is covered, and the number
+    // of pixels not covered in every block of each level of the pyramid, from
+    // a single block at level 0
+    std::vector<double> area;
+    std::vector<uint8_t> covered;
+    std::vector<std::vector<uint32_t> > uncovered;
+  };
+
+  double eye[3];
+  int levels;
+  uint32_t resolution;
+  cube_face faces[6];
+  mutable std::vector<double> clip_buffer[2];
+  mutable std::vector<pixel_point> projected;
+  // The shares of every row left by the edges of the triangle being added,
+  // resolution + 2 to a row, and the first and last pixel holding a share in
+  // every row. Only the spans are cleared after every triangle
+  std::vector<double> shares;
+  std::vector<uint32_t> span_first;
+  std::vector<uint32_t> span_last;
+
+  int faces_of(const double (&corners)[3][3], int (&list)[6]) const;
+  bool project(int face, const double (*corners)[3], int n, bool clip) const;
+  void to_pixels(const cube_face& face) const;
+  uint32_t clamp_pixel(double coord) const;
+  bool is_covered(const cube_face& face, int level, uint32_t bx, uint32_t by,
+                  const uint32_t (&range)[4]) const;
+  void add_share(uint32_t row, double x0, double x1, double share);
+  void rasterize(int face);
+  void cover(int face, uint32_t pixel, double area);
+public:
+  // The geometry must lie within the box from low to high. The resolution
+  // follows the number of triangles it is meant for
+  coverage_cube(const double (&from)[3], const double (&low)[3], const double (&high)[3],
+                size_t n_triangles);
+  // Is every direction spanned by the triangle covered?
+  bool is_covered(const double (&corners)[3][3]) const;
+  // Adds a triangle in front of everything added later
+  void add(const double (&corners)[3][3]);
+};
@@ -5,46 +5,165 @@
 #include "cpp11/declarations.hpp"
 
 // render_bsp.cpp
-cpp11::writable::data_frame illuminate_mesh_c(cpp11::doubles_matrix vert, cpp11::integers_matrix tri, cpp11::doubles luminance, cpp11::doubles xl, cpp11::doubles yl, cpp11::doubles zl, cpp11::doubles intensity);
-extern "C" SEXP _unmeshy_illuminate_mesh_c(SEXP vert, SEXP tri, SEXP luminance, SEXP xl, SEXP yl, SEXP zl, SEXP intensity) {
+SEXP prepare_mesh_c(cpp11::doubles_matrix vert, cpp11::integers_matrix tri, cpp11::doubles luminance, std::string build_strategy, std::string precision, int threads);
+extern "C" SEXP _unmeshy_prepare_mesh_c(SEXP vert, SEXP tri, SEXP luminance, SEXP build_strategy, SEXP precision, SEXP threads) {
   BEGIN_CPP11
-    return cpp11::as_sexp(illuminate_mesh_c(cpp11::as_cpp<cpp11::decay_t<cpp11::doubles_matrix>>(vert), cpp11::as_cpp<cpp11::decay_t<cpp11::integers_matrix>>(tri), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(luminance), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(xl), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(yl), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(zl), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(intensity)));
+    return cpp11::as_sexp(prepare_mesh_c(cpp11::as_cpp<cpp11::decay_t<cpp11::doubles_matrix>>(vert), cpp11::as_cpp<cpp11::decay_t<cpp11::integers_matrix>>(tri), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(luminance), cpp11::as_cpp<cpp11::decay_t<std::string>>(build_strategy), cpp11::as_cpp<cpp11::decay_t<std::string>>(precision), cpp11::as_cpp<cpp11::decay_t<int>>(threads)));
   END_CPP11
 }
 // render_bsp.cpp
-cpp11::writable::data_frame occlude_mesh_c(cpp11::doubles_matrix vert, cpp11::integers_matrix tri, double xv, double yv, double zv);
-extern "C" SEXP _unmeshy_occlude_mesh_c(SEXP vert, SEXP tri, SEXP xv, SEXP yv, SEXP zv) {
+cpp11::list read_mesh_prepared_c(std::string path, std::string build_strategy, std::string precision, int threads);
+extern "C" SEXP _unmeshy_read_mesh_prepared_c(SEXP path, SEXP build_strategy, SEXP precision, SEXP threads) {
   BEGIN_CPP11
-    return cpp11::as_sexp(occlude_mesh_c(cpp11::as_cpp<cpp11::decay_t<cpp11::doubles_matrix>>(vert), cpp11::as_cpp<cpp11::decay_t<cpp11::integers_matrix>>(tri), cpp11::as_cpp<cpp11::decay_t<double>>(xv), cpp11::as_cpp<cpp11::decay_t<double>>(yv), cpp11::as_cpp<cpp11::decay_t<double>>(zv)));
+    return cpp11::as_sexp(read_mesh_prepared_c(cpp11::as_cpp<cpp11::decay_t<std::string>>(path), cpp11::as_cpp<cpp11::decay_t<std::string>>(build_strategy), cpp11::as_cpp<cpp11::decay_t<std::string>>(precision), cpp11::as_cpp<cpp11::decay_t<int>>(threads)));
   END_CPP11
 }
 // render_bsp.cpp
-cpp11::writable::data_frame project_coords_c(cpp11::doubles x, cpp11::doubles y, cpp11::doubles z, double xv, double yv, double zv, double xp, double yp, double zp);
-extern "C" SEXP _unmeshy_project_coords_c(SEXP x, SEXP y, SEXP z, SEXP xv, SEXP yv, SEXP zv, SEXP xp, SEXP yp, SEXP zp) {
+SEXP prepared_insert_c(SEXP prepared, cpp11::doubles_matrix vert, cpp11::integers_matrix tri, cpp11::doubles luminance, int first_id, std::string build_strategy);
+extern "C" SEXP _unmeshy_prepared_insert_c(SEXP prepared, SEXP vert, SEXP tri, SEXP luminance, SEXP first_id, SEXP build_strategy) {
   BEGIN_CPP11
-    return cpp11::as_sexp(project_coords_c(cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(x), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(y), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(z), cpp11::as_cpp<cpp11::decay_t<double>>(xv), cpp11::as_cpp<cpp11::decay_t<double>>(yv), cpp11::as_cpp<cpp11::decay_t<double>>(zv), cpp11::as_cpp<cpp11::decay_t<double>>(xp), cpp11::as_cpp<cpp11::decay_t<double>>(yp), cpp11::as_cpp<cpp11::decay_t<double>>(zp)));
+    return cpp11::as_sexp(prepared_insert_c(cpp11::as_cpp<cpp11::decay_t<SEXP>>(prepared), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles_matrix>>(vert), cpp11::as_cpp<cpp11::decay_t<cpp11::integers_matrix>>(tri), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(luminance), cpp11::as_cpp<cpp11::decay_t<int>>(first_id), cpp11::as_cpp<cpp11::decay_t<std::string>>(build_strategy)));
+  END_CPP11
+}
+// render_bsp.cpp
+SEXP prepared_remove_c(SEXP prepared, cpp11::integers ids, std::string build_strategy);
+extern "C" SEXP _unmeshy_prepared_remove_c(SEXP prepared, SEXP ids, SEXP build_strategy) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(prepared_remove_c(cpp11::as_cpp<cpp11::decay_t<SEXP>>(prepared), cpp11::as_cpp<cpp11::decay_t<cpp11::integers>>(ids), cpp11::as_cpp<cpp11::decay_t<std::string>>(build_strategy)));
+  END_CPP11
+}
+// render_bsp.cpp
+void save_prepared_c(SEXP prepared, std::string path, cpp11::raws payload);
+extern "C" SEXP _unmeshy_save_prepared_c(SEXP prepared, SEXP path, SEXP payload) {
+  BEGIN_CPP11
+    save_prepared_c(cpp11::as_cpp<cpp11::decay_t<SEXP>>(prepared), cpp11::as_cpp<cpp11::decay_t<std::string>>(path), cpp11::as_cpp<cpp11::decay_t<cpp11::raws>>(payload));
+    return R_NilValue;
+  END_CPP11
+}
+// render_bsp.cpp
+cpp11::list read_prepared_c(std::string path);
+extern "C" SEXP _unmeshy_read_prepared_c(SEXP path) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(read_prepared_c(cpp11::as_cpp<cpp11::decay_t<std::string>>(path)));
+  END_CPP11
+}
+// render_bsp.cpp
+cpp11::writable::list illuminate_mesh_c(cpp11::doubles_matrix vert, cpp11::integers_matrix tri, cpp11::doubles luminance, cpp11::doubles xl, cpp11::doubles yl, cpp11::doubles zl, cpp11::doubles intensity, cpp11::doubles_matrix spans, cpp11::logicals disk, cpp11::integers samples, cpp11::integers probes, bool merge_lights, bool coalesce, bool coverage, bool silhouettes, std::string build_strategy, std::string precision, int threads, bool stats);
+extern "C" SEXP _unmeshy_illuminate_mesh_c(SEXP vert, SEXP tri, SEXP luminance, SEXP xl, SEXP yl, SEXP zl, SEXP intensity, SEXP spans, SEXP disk, SEXP samples, SEXP probes, SEXP merge_lights, SEXP coalesce, SEXP coverage, SEXP silhouettes, SEXP build_strategy, SEXP precision, SEXP threads, SEXP stats) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(illuminate_mesh_c(cpp11::as_cpp<cpp11::decay_t<cpp11::doubles_matrix>>(vert), cpp11::as_cpp<cpp11::decay_t<cpp11::integers_matrix>>(tri), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(luminance), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(xl), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(yl), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(zl), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(intensity), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles_matrix>>(spans), cpp11::as_cpp<cpp11::decay_t<cpp11::logicals>>(disk), cpp11::as_cpp<cpp11::decay_t<cpp11::integers>>(samples), cpp11::as_cpp<cpp11::decay_t<cpp11::integers>>(probes), cpp11::as_cpp<cpp11::decay_t<bool>>(merge_lights), cpp11::as_cpp<cpp11::decay_t<bool>>(coalesce), cpp11::as_cpp<cpp11::decay_t<bool>>(coverage), cpp11::as_cpp<cpp11::decay_t<bool>>(silhouettes), cpp11::as_cpp<cpp11::decay_t<std::string>>(build_strategy), cpp11::as_cpp<cpp11::decay_t<std::string>>(precision), cpp11::as_cpp<cpp11::decay_t<int>>(threads), cpp11::as_cpp<cpp11::decay_t<bool>>(stats)));
+  END_CPP11
+}
+// render_bsp.cpp
+cpp11::writable::list illuminate_prepared_c(SEXP prepared, cpp11::doubles xl, cpp11::doubles yl, cpp11::doubles zl, cpp11::doubles intensity, cpp11::doubles_matrix spans, cpp11::logicals disk, cpp11::integers samples, cpp11::integers probes, bool merge_lights, bool coalesce, bool coverage, cpp11::integers_matrix tri, bool silhouettes, int threads, bool stats);
+extern "C" SEXP _unmeshy_illuminate_prepared_c(SEXP prepared, SEXP xl, SEXP yl, SEXP zl, SEXP intensity, SEXP spans, SEXP disk, SEXP samples, SEXP probes, SEXP merge_lights, SEXP coalesce, SEXP coverage, SEXP tri, SEXP silhouettes, SEXP threads, SEXP stats) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(illuminate_prepared_c(cpp11::as_cpp<cpp11::decay_t<SEXP>>(prepared), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(xl), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(yl), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(zl), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(intensity), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles_matrix>>(spans), cpp11::as_cpp<cpp11::decay_t<cpp11::logicals>>(disk), cpp11::as_cpp<cpp11::decay_t<cpp11::integers>>(samples), cpp11::as_cpp<cpp11::decay_t<cpp11::integers>>(probes), cpp11::as_cpp<cpp11::decay_t<bool>>(merge_lights), cpp11::as_cpp<cpp11::decay_t<bool>>(coalesce), cpp11::as_cpp<cpp11::decay_t<bool>>(coverage), cpp11::as_cpp<cpp11::decay_t<cpp11::integers_matrix>>(tri), cpp11::as_cpp<cpp11::decay_t<bool>>(silhouettes), cpp11::as_cpp<cpp11::decay_t<int>>(threads), cpp11::as_cpp<cpp11::decay_t<bool>>(stats)));
+  END_CPP11
+}
+// render_bsp.cpp
+cpp11::writable::list occlude_mesh_c(cpp11::doubles_matrix vert, cpp11::integers_matrix tri, cpp11::doubles xv, cpp11::doubles yv, cpp11::doubles zv, cpp11::doubles xt, cpp11::doubles yt, cpp11::doubles zt, double fov, bool cull_back_faces, bool coalesce, bool coverage, bool slices, bool silhouettes, std::string build_strategy, std::string precision, int threads, bool stats);
+extern "C" SEXP _unmeshy_occlude_mesh_c(SEXP vert, SEXP tri, SEXP xv, SEXP yv, SEXP zv, SEXP xt, SEXP yt, SEXP zt, SEXP fov, SEXP cull_back_faces, SEXP coalesce, SEXP coverage, SEXP slices, SEXP silhouettes, SEXP build_strategy, SEXP precision, SEXP threads, SEXP stats) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(occlude_mesh_c(cpp11::as_cpp<cpp11::decay_t<cpp11::doubles_matrix>>(vert), cpp11::as_cpp<cpp11::decay_t<cpp11::integers_matrix>>(tri), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(xv), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(yv), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(zv), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(xt), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(yt), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(zt), cpp11::as_cpp<cpp11::decay_t<double>>(fov), cpp11::as_cpp<cpp11::decay_t<bool>>(cull_back_faces), cpp11::as_cpp<cpp11::decay_t<bool>>(coalesce), cpp11::as_cpp<cpp11::decay_t<bool>>(coverage), cpp11::as_cpp<cpp11::decay_t<bool>>(slices), cpp11::as_cpp<cpp11::decay_t<bool>>(silhouettes), cpp11::as_cpp<cpp11::decay_t<std::string>>(build_strategy), cpp11::as_cpp<cpp11::decay_t<std::string>>(precision), cpp11::as_cpp<cpp11::decay_t<int>>(threads), cpp11::as_cpp<cpp11::decay_t<bool>>(stats)));
+  END_CPP11
+}
+// render_bsp.cpp
+cpp11::writable::list occlude_prepared_c(SEXP prepared, cpp11::doubles xv, cpp11::doubles yv, cpp11::doubles zv, cpp11::doubles xt, cpp11::doubles yt, cpp11::doubles zt, double fov, bool coalesce, bool coverage, bool slices, cpp11::integers_matrix tri, bool silhouettes, int threads, bool stats);
+extern "C" SEXP _unmeshy_occlude_prepared_c(SEXP prepared, SEXP xv, SEXP yv, SEXP zv, SEXP xt, SEXP yt, SEXP zt, SEXP fov, SEXP coalesce, SEXP coverage, SEXP slices, SEXP tri, SEXP silhouettes, SEXP threads, SEXP stats) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(occlude_prepared_c(cpp11::as_cpp<cpp11::decay_t<SEXP>>(prepared), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(xv), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(yv), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(zv), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(xt), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(yt), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(zt), cpp11::as_cpp<cpp11::decay_t<double>>(fov), cpp11::as_cpp<cpp11::decay_t<bool>>(coalesce), cpp11::as_cpp<cpp11::decay_t<bool>>(coverage), cpp11::as_cpp<cpp11::decay_t<bool>>(slices), cpp11::as_cpp<cpp11::decay_t<cpp11::integers_matrix>>(tri), cpp11::as_cpp<cpp11::decay_t<bool>>(silhouettes), cpp11::as_cpp<cpp11::decay_t<int>>(threads), cpp11::as_cpp<cpp11::decay_t<bool>>(stats)));
+  END_CPP11
+}
+// render_bsp.cpp
+cpp11::writable::list outline_mesh_c(cpp11::doubles_matrix vert, cpp11::integers_matrix tri, cpp11::doubles xv, cpp11::doubles yv, cpp11::doubles zv, cpp11::doubles xt, cpp11::doubles yt, cpp11::doubles zt, double fov, double crease_angle, std::string build_strategy, std::string precision, int threads);
+extern "C" SEXP _unmeshy_outline_mesh_c(SEXP vert, SEXP tri, SEXP xv, SEXP yv, SEXP zv, SEXP xt, SEXP yt, SEXP zt, SEXP fov, SEXP crease_angle, SEXP build_strategy, SEXP precision, SEXP threads) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(outline_mesh_c(cpp11::as_cpp<cpp11::decay_t<cpp11::doubles_matrix>>(vert), cpp11::as_cpp<cpp11::decay_t<cpp11::integers_matrix>>(tri), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(xv), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(yv), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(zv), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(xt), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(yt), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(zt), cpp11::as_cpp<cpp11::decay_t<double>>(fov), cpp11::as_cpp<cpp11::decay_t<double>>(crease_angle), cpp11::as_cpp<cpp11::decay_t<std::string>>(build_strategy), cpp11::as_cpp<cpp11::decay_t<std::string>>(precision), cpp11::as_cpp<cpp11::decay_t<int>>(threads)));
+  END_CPP11
+}
+// render_bsp.cpp
+cpp11::writable::list outline_prepared_c(SEXP prepared, cpp11::doubles xv, cpp11::doubles yv, cpp11::doubles zv, cpp11::doubles xt, cpp11::doubles yt, cpp11::doubles zt, double fov, double crease_angle, int threads);
+extern "C" SEXP _unmeshy_outline_prepared_c(SEXP prepared, SEXP xv, SEXP yv, SEXP zv, SEXP xt, SEXP yt, SEXP zt, SEXP fov, SEXP crease_angle, SEXP threads) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(outline_prepared_c(cpp11::as_cpp<cpp11::decay_t<SEXP>>(prepared), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(xv), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(yv), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(zv), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(xt), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(yt), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(zt), cpp11::as_cpp<cpp11::decay_t<double>>(fov), cpp11::as_cpp<cpp11::decay_t<double>>(crease_angle), cpp11::as_cpp<cpp11::decay_t<int>>(threads)));
+  END_CPP11
+}
+// render_bsp.cpp
+cpp11::writable::list project_coords_c(cpp11::doubles x, cpp11::doubles y, cpp11::doubles z, cpp11::doubles matrices, int threads);
+extern "C" SEXP _unmeshy_project_coords_c(SEXP x, SEXP y, SEXP z, SEXP matrices, SEXP threads) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(project_coords_c(cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(x), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(y), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(z), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(matrices), cpp11::as_cpp<cpp11::decay_t<int>>(threads)));
+  END_CPP11
+}
+// render_bsp.cpp
+cpp11::writable::list project_vertices_c(cpp11::doubles vert, cpp11::doubles matrices, int threads);
+extern "C" SEXP _unmeshy_project_vertices_c(SEXP vert, SEXP matrices, SEXP threads) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(project_vertices_c(cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(vert), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(matrices), cpp11::as_cpp<cpp11::decay_t<int>>(threads)));
+  END_CPP11
+}
+// render_bsp.cpp
+void project_vertices_into_c(cpp11::doubles vert, cpp11::doubles matrix, SEXP target, int threads);
+extern "C" SEXP _unmeshy_project_vertices_into_c(SEXP vert, SEXP matrix, SEXP target, SEXP threads) {
+  BEGIN_CPP11
+    project_vertices_into_c(cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(vert), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(matrix), cpp11::as_cpp<cpp11::decay_t<SEXP>>(target), cpp11::as_cpp<cpp11::decay_t<int>>(threads));
+    return R_NilValue;
+  END_CPP11
+}
+// trimesh.cpp
+cpp11::list join_triangles(cpp11::doubles x, cpp11::doubles y, cpp11::doubles z, double tolerance, int threads);
+extern "C" SEXP _unmeshy_join_triangles(SEXP x, SEXP y, SEXP z, SEXP tolerance, SEXP threads) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(join_triangles(cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(x), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(y), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(z), cpp11::as_cpp<cpp11::decay_t<double>>(tolerance), cpp11::as_cpp<cpp11::decay_t<int>>(threads)));
   END_CPP11
 }
 // trimesh.cpp
-cpp11::list join_triangles(cpp11::doubles x, cpp11::doubles y, cpp11::doubles z);
-extern "C" SEXP _unmeshy_join_triangles(SEXP x, SEXP y, SEXP z) {
+cpp11::list read_mesh_c(std::string path, int threads);
+extern "C" SEXP _unmeshy_read_mesh_c(SEXP path, SEXP threads) {
   BEGIN_CPP11
-    return cpp11::as_sexp(join_triangles(cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(x), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(y), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(z)));
+    return cpp11::as_sexp(read_mesh_c(cpp11::as_cpp<cpp11::decay_t<std::string>>(path), cpp11::as_cpp<cpp11::decay_t<int>>(threads)));
   END_CPP11
 }
 
 extern "C" {
 /* .Call calls */
-extern SEXP _unmeshy_illuminate_mesh_c(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
-extern SEXP _unmeshy_join_triangles(SEXP, SEXP, SEXP);
-extern SEXP _unmeshy_occlude_mesh_c(SEXP, SEXP, SEXP, SEXP, SEXP);
-extern SEXP _unmeshy_project_coords_c(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP _unmeshy_illuminate_mesh_c(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP _unmeshy_illuminate_prepared_c(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP _unmeshy_join_triangles(SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP _unmeshy_occlude_mesh_c(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP _unmeshy_occlude_prepared_c(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP _unmeshy_outline_mesh_c(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP _unmeshy_outline_prepared_c(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP _unmeshy_prepare_mesh_c(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP _unmeshy_prepared_insert_c(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP _unmeshy_prepared_remove_c(SEXP, SEXP, SEXP);
+extern SEXP _unmeshy_project_coords_c(SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP _unmeshy_project_vertices_c(SEXP, SEXP, SEXP);
+extern SEXP _unmeshy_project_vertices_into_c(SEXP, SEXP, SEXP, SEXP);
+extern SEXP _unmeshy_read_mesh_c(SEXP, SEXP);
+extern SEXP _unmeshy_read_mesh_prepared_c(SEXP, SEXP, SEXP, SEXP);
+extern SEXP _unmeshy_read_prepared_c(SEXP);
+extern SEXP _unmeshy_save_prepared_c(SEXP, SEXP, SEXP);
 
 static const R_CallMethodDef CallEntries[] = {
-    {"_unmeshy_illuminate_mesh_c", (DL_FUNC) &_unmeshy_illuminate_mesh_c, 7},
-    {"_unmeshy_join_triangles",    (DL_FUNC) &_unmeshy_join_triangles,    3},
-    {"_unmeshy_occlude_mesh_c",    (DL_FUNC) &_unmeshy_occlude_mesh_c,    5},
-    {"_unmeshy_project_coords_c",  (DL_FUNC) &_unmeshy_project_coords_c,  9},
+    {"_unmeshy_illuminate_mesh_c",       (DL_FUNC) &_unmeshy_illuminate_mesh_c,       19},
+    {"_unmeshy_illuminate_prepared_c",   (DL_FUNC) &_unmeshy_illuminate_prepared_c,   16},
+    {"_unmeshy_join_triangles",          (DL_FUNC) &_unmeshy_join_triangles,          5},
+    {"_unmeshy_occlude_mesh_c",          (DL_FUNC) &_unmeshy_occlude_mesh_c,          18},
+    {"_unmeshy_occlude_prepared_c",      (DL_FUNC) &_unmeshy_occlude_prepared_c,      15},
+    {"_unmeshy_outline_mesh_c",          (DL_FUNC) &_unmeshy_outline_mesh_c,          13},
+    {"_unmeshy_outline_prepared_c",      (DL_FUNC) &_unmeshy_outline_prepared_c,      10},
+    {"_unmeshy_prepare_mesh_c",          (DL_FUNC) &_unmeshy_prepare_mesh_c,          6},
+    {"_unmeshy_prepared_insert_c",       (DL_FUNC) &_unmeshy_prepared_insert_c,       6},
+    {"_unmeshy_prepared_remove_c",       (DL_FUNC) &_unmeshy_prepared_remove_c,       3},
+    {"_unmeshy_project_coords_c",        (DL_FUNC) &_unmeshy_project_coords_c,        5},
+    {"_unmeshy_project_vertices_c",      (DL_FUNC) &_unmeshy_project_vertices_c,      3},
+    {"_unmeshy_project_vertices_into_c", (DL_FUNC) &_unmeshy_project_vertices_into_c, 4},
+    {"_unmeshy_read_mesh_c",             (DL_FUNC) &_unmeshy_read_mesh_c,             2},
+    {"_unmeshy_read_mesh_prepared_c",    (DL_FUNC) &_unmeshy_read_mesh_prepared_c,    4},
+    {"_unmeshy_read_prepared_c",         (DL_FUNC) &_unmeshy_read_prepared_c,         1},
+    {"_unmeshy_save_prepared_c",         (DL_FUNC) &_unmeshy_save_prepared_c,         3},
     {NULL, NULL, 0}
 };
 }
@@ -3,82 +3,109 @@
 #include <math.h>
 #include <cmath>
 #include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <algorithm>
+#include <limits>
+#include <utility>
 
-struct vec3 {
-  double x, y, z;
+template <typename T>
+struct vec3_t {
+  typedef vec3_t<T> vec3;
 
-  vec3() { x = 0; y = 0; z = 0; }
-  vec3(double x, double y, double z) : x(x), y(y), z(z) {}
-  vec3(const vec3& copy) : x(copy.x), y(copy.y), z(copy.z) {}
-  double length() const { return sqrt(x * x + y * y + z * z); }
+  T x, y, z;
+
+  vec3_t() { x = 0; y = 0; z = 0; }
+  vec3_t(T x, T y, T z) : x(x), y(y), z(z) {}
+  vec3_t(const vec3& copy) : x(copy.x), y(copy.y), z(copy.z) {}
+  vec3& operator= (const vec3& copy) = default;
+  T length() const { return std::sqrt(x * x + y * y + z * z); }
   vec3 normalize() const {
-    double l = length();
+    T l = length();
     return vec3(x / l, y / l, z / l);
   }
-  vec3 operator* (const double& s) { return vec3(x * s, y * s, z * s); }
+  vec3 operator* (const T& s) { return vec3(x * s, y * s, z * s); }
   bool operator== (const vec3& vec) const { return x == vec.x && y == vec.y && z == vec.z; }
   bool operator!= (const vec3& vec) const { return x != vec.x || y != vec.y || z != vec.z; }
-  double dot(const vec3& b) const { return x * b.x + y * b.y + z * b.z; }
+  T dot(const vec3& b) const { return x * b.x + y * b.y + z * b.z; }
   vec3 cross(const vec3& b) const { return vec3(y * b.z - z * b.y, z * b.x - x * b.z, x * b.y - y * b.x); }
 };
 
-struct point : vec3 {
-  point() {}
-  ~point() {}
-  point(double x, double y, double z) : vec3(x, y, z) {}
-  point(const point& copy) : vec3(copy) {}
+template <typename T>
+struct point_t : vec3_t<T> {
+  typedef vec3_t<T> vec3;
+  typedef point_t<T> point;
+  using vec3::x;
+  using vec3::y;
+  using vec3::z;
+
+  point_t() {}
+  ~point_t() {}
+  point_t(T x, T y, T z) : vec3(x, y, z) {}
+  point_t(const point& copy) : vec3(copy) {}
+  point& operator= (const point& copy) = default;
   vec3 operator- (const point& b) const { return vec3(x - b.x, y - b.y, z - b.z); }
   point operator+ (const vec3& v) const { return point(x + v.x, y + v.y, z + v.z); }
-  double distance_to(const point& p2) const {
-    double xd = x - p2.x;
-    double yd = y - p2.y;
-    double zd = z - p2.z;
+  T distance_to(const point& p2) const {
+    T xd = x - p2.x;
+    T yd = y - p2.y;
+    T zd = z - p2.z;
     return std::sqrt(xd*xd + yd*yd + zd*zd);
   }
-  void project(const point& from, const vec3& plane_n, const point& plane_p) {
-    vec3 proj_dir = *this - from;
-    double ln = proj_dir.dot(plane_n);
-    if (ln == 0) ln = 1e-6;
-    double d = (plane_p - from).dot(plane_n) / ln;
-    if (d < 0) {
-
-    }
-    point projected = from + proj_dir * d;
-    x = projected.x;
-    y = projected.y;
-    z = projected.z;
-  }
 };
+// The splitmix64 finalizer. Spreads every input bit over the whole result
+inline uint64_t mix_bits(uint64_t h) {
+  h ^= h >> 30;
+  h *= 0xBF58476D1CE4E5B9ULL;
+  h ^= h >> 27;
+  h *= 0x94D049BB133111EBULL;
+  return h ^ (h >> 31);
+}
+// Chains the coordinate hashes through mix_bits() so permuted coordinates, or
+// ones that are equal to each other, don't all end up with the same hash
+template <typename T>
+inline size_t hash_coords(T x, T y, T z) {
+  uint64_t h = mix_bits(std::hash<T>()(x));
+  h = mix_bits(h ^ std::hash<T>()(y));
+  return mix_bits(h ^ std::hash<T>()(z));
+}
 namespace std {
-template <>
-struct hash<vec3> {
-  size_t operator()(const vec3 & x) const {
-    return std::hash<double>()(x.x) ^ std::hash<double>()(x.y) ^ std::hash<double>()(x.z);
+template <typename T>
+struct hash<vec3_t<T> > {
+  size_t operator()(const vec3_t<T> & x) const {
+    return hash_coords(x.x, x.y, x.z);
   }
 };
-template <>
-struct hash<point> {
-  size_t operator()(const point & x) const {
-    return std::hash<double>()(x.x) ^ std::hash<double>()(x.y) ^ std::hash<double>()(x.z);
+template <typename T>
+struct hash<point_t<T> > {
+  size_t operator()(const point_t<T> & x) const {
+    return hash_coords(x.x, x.y, x.z);
   }
 };
 }
 
-class triangle {
+template <typename T>
+class triangle_t {
+public:
+  typedef vec3_t<T> vec3;
+  typedef point_t<T> point;
+  typedef triangle_t<T> triangle;
+
 private:
   point _a;
   point _b;
   point _c;
   vec3 _n;
   int _id = 0;
-  double _light = 0;
+  T _light = 0;
   bool _visible = true;
   bool _back = false;
 
 public:
 
-  triangle() {}
-  triangle(const point& a, const point& b, const point& c, int id = 0, double light = 0, bool visible = true, bool back = false) :
+  triangle_t() {}
+  triangle_t(const point& a, const point& b, const point& c, int id = 0, T light = 0, bool visible = true, bool back = false) :
     _a(a),
     _b(b),
     _c(c),
@@ -88,16 +115,17 @@ public:
     _visible(visible),
     _back(back) {}
 
-  triangle(const triangle& t2) :
+  triangle_t(const triangle& t2) :
     _a(t2._a),
     _b(t2._b),
     _c(t2._c),
     _n(t2._n),
     _id(t2._id),
     _light(t2._light),
-    _visible(t2._visible) {}
+    _visible(t2._visible),
+    _back(t2._back) {}
 
-  ~triangle() {}
+  ~triangle_t() {}
 
   void operator=(const triangle& t2) {
     _a = t2._a;
@@ -107,6 +135,7 @@ public:
     _light = t2._light;
     _n = t2._n;
     _visible = t2._visible;
+    _back = t2._back;
   }
 
   const point& a() const { return _a; }
@@ -122,16 +151,20 @@ public:
   }
   const vec3& normal() const { return _n; }
   int id() const { return _id; }
-  double light() const { return _light; }
-  void illuminate(double light = 1) { _light += light; }
+  T light() const { return _light; }
+  void illuminate(T light = 1) { _light += light; }
   bool is_visible() const { return _visible; }
   bool is_back_facing() const { return _back; }
   void set_visibility(bool visible = true) { _visible = visible; }
   void set_back_facing(bool back = true) { _back = back; }
-  bool is_valid() const { return !std::isnan(_n.x); }
+  bool is_valid() const { return std::isfinite(_n.x) && std::isfinite(_n.y) && std::isfinite(_n.z); }
+  T area() const { return ((_b - _a).cross(_c - _a)).length() / 2; }
 };
 
-struct cut_tri {
+template <typename T>
+struct cut_tri_t {
+  typedef triangle_t<T> triangle;
+
   triangle front;
   triangle back;
   triangle extra;
@@ -140,29 +173,76 @@ struct cut_tri {
   bool last_is_valid;
 };
 
-class plane {
+template <typename T>
+class plane_t {
+public:
+  typedef vec3_t<T> vec3;
+  typedef point_t<T> point;
+  typedef triangle_t<T> triangle;
+  typedef cut_tri_t<T> cut_tri;
+
 private:
   vec3 n;
-  double d;
+  T d;
+  T tol;
 
 public:
-  plane() : n(0, 0, 0), d(0) {}
-  plane(const vec3& n, double d) : n(n), d(d) {}
-  plane(const triangle& tri) : n(tri.normal()), d(-tri.a().dot(n)) {}
+  // The distance within which points count as lying on planes not given a
+  // tolerance of their own
+  static constexpr T EPSILON = T(1e-5);
+  // The same relative to the size of the geometry, for planes that are given a
+  // tolerance through tolerance_for(). It is also the sine of the angle within
+  // which two directions are taken as parallel
+  static constexpr T RELATIVE_EPSILON = T(3e-6);
+  // The number of units in the last place the distance of a point to a plane
+  // may be off by, relative to the magnitude of the coordinates involved
+  static constexpr T ROUNDING = T(16);
+
+  plane_t() : n(0, 0, 0), d(0), tol(EPSILON) {}
+  plane_t(const vec3& n, T d, T tolerance = EPSILON) : n(n), d(d), tol(tolerance) {}
+  plane_t(const triangle& tri, T tolerance = EPSILON) :
+    n(tri.normal()),
+    d(-tri.a().dot(n)),
+    tol(tolerance) {}
 
-  double classify_point(const point& p) const {
-    const double EPSILON = 1e-5;
-    double loc = n.x * p.x + n.y * p.y + n.z * p.z + d;
+  const vec3& normal() const { return n; }
+  T offset() const { return d; }
+  T tolerance() const { return tol; }
 
-    if (loc <  EPSILON && loc > -EPSILON) {
+  // The tolerance for planes through geometry whose bounding box has extent as
+  // its longest side and whose coordinates are at most magnitude in absolute
+  // value. It follows the size of the geometry so small meshes aren't
+  // flattened and large ones aren't cut into slivers by rounding errors, but
+  // never drops below what the distance to a plane can be off by. Points
+  // further away than that are on the side the sign of their distance says
+  static T tolerance_for(T extent, T magnitude) {
+    return std::max(RELATIVE_EPSILON * extent,
+                    ROUNDING * std::numeric_limits<T>::epsilon() * magnitude);
+  }
+  // The point where the segment from p to q crosses the plane, given their
+  // distances to it which must differ in sign. Interpolating between the
+  // distances always gives a point on the segment, where intersecting its line
+  // with the plane divides by zero when the two are close to parallel
+  static point crossing(const point& p, const point& q, T side_p, T side_q) {
+    if (side_p == side_q) return p;
+    return p + (q - p) * (side_p / (side_p - side_q));
+  }
+
+  T classify_point(const point& p) const {
+    T loc = n.x * p.x + n.y * p.y + n.z * p.z + d;
+
+    if (loc < tol && loc > -tol) {
       loc = 0.0;
     }
     return loc;
   }
   int classify_triangle(const triangle& tri) const {
-    double res_a = classify_point(tri.a());
-    double res_b = classify_point(tri.b());
-    double res_c = classify_point(tri.c());
+    return classify_corners(tri.a(), tri.b(), tri.c());
+  }
+  int classify_corners(const point& a, const point& b, const point& c) const {
+    T res_a = classify_point(a);
+    T res_b = classify_point(b);
+    T res_c = classify_point(c);
 
     if (res_a == 0 && res_b == 0 && res_c == 0) {
       return 0;
@@ -178,23 +258,20 @@ public:
     point pt_b = tri.b();
     point pt_c = tri.c();
     int id = tri.id();
-    double light = tri.light();
+    T light = tri.light();
     bool visible = tri.is_visible();
     bool back = tri.is_back_facing();
     cut_tri result = {};
     result.last_is_valid = true;
 
-    double side_a = classify_point(pt_a);
-    double side_b = classify_point(pt_b);
-    double side_c = classify_point(pt_c);
+    T side_a = classify_point(pt_a);
+    T side_b = classify_point(pt_b);
+    T side_c = classify_point(pt_c);
     result.last_is_valid = side_a != 0.0 && side_b != 0.0 && side_c != 0.0;
 
-    vec3 v = pt_b - pt_a;
-    point ab = pt_a + (v * (-side_a/n.dot(v)));
-    v = pt_c - pt_b;
-    point bc = pt_b + (v * (-side_b/n.dot(v)));
-    v = pt_a - pt_c;
-    point ca = pt_c + (v * (-side_c/n.dot(v)));
+    point ab = crossing(pt_a, pt_b, side_a, side_b);
+    point bc = crossing(pt_b, pt_c, side_b, side_c);
+    point ca = crossing(pt_c, pt_a, side_c, side_a);
 
     if (side_a == 0.0) {
       if (side_b > 0.0) {
@@ -258,4 +335,167 @@ public:
 
     return result;
   };
+  // Splits a convex polygon into the parts in front of and behind the plane.
+  // Parts with less than three points are returned empty
+  void split_polygon(const std::vector<point>& poly, std::vector<point>& front,
+                     std::vector<point>& back) const {
+    front.clear();
+    back.clear();
+    for (size_t i = 0; i < poly.size(); ++i) {
+      const point& current = poly[i];
+      const point& next = poly[(i + 1) % poly.size()];
+      T side_current = classify_point(current);
+      T side_next = classify_point(next);
+      if (side_current >= 0.0) front.push_back(current);
+      if (side_current <= 0.0) back.push_back(current);
+      if ((side_current > 0.0 && side_next < 0.0) || (side_current < 0.0 && side_next > 0.0)) {
+        point cross = crossing(current, next, side_current, side_next);
+        front.push_back(cross);
+        back.push_back(cross);
+      }
+    }
+    if (front.size() < 3) front.clear();
+    if (back.size() < 3) back.clear();
+  }
+};
+
+template <typename T>
+constexpr T plane_t<T>::EPSILON;
+template <typename T>
+constexpr T plane_t<T>::RELATIVE_EPSILON;
+template <typename T>
+constexpr T plane_t<T>::ROUNDING;
+
+// The visible region of a camera looking from a point towards a target. The
+// cone given by the field of view is enclosed by a square pyramid so the test
+// is conservative. An empty frustum contains everything
+template <typename T>
+class frustum_t {
+public:
+  typedef vec3_t<T> vec3;
+  typedef point_t<T> point;
+  typedef triangle_t<T> triangle;
+  typedef plane_t<T> plane;
+
+private:
+  std::vector<plane> planes;
+  vec3 dir;
+  vec3 u;
+
+public:
+  frustum_t() : dir(1, 0, 0), u(0, 1, 0) {}
+  frustum_t(const point& from, const point& to, double fov) {
+    dir = (to - from).normalize();
+    vec3 axis = std::abs(dir.x) < 0.9 ? vec3(1, 0, 0) : vec3(0, 1, 0);
+    u = dir.cross(axis).normalize();
+    if (fov > M_PI) return;
+    planes.push_back(plane(dir, -dir.dot(from)));
+    if (fov == M_PI) return;
+    vec3 w = dir.cross(u);
+    T s = std::sin(fov / 2);
+    T c = std::cos(fov / 2);
+    const vec3 sides[4] = {u, u * -1, w, w * -1};
+    for (int i = 0; i < 4; ++i) {
+      vec3 side = sides[i];
+      vec3 n(dir.x * s - side.x * c, dir.y * s - side.y * c, dir.z * s - side.z * c);
+      planes.push_back(plane(n, -n.dot(from)));
+    }
+  }
+
+  bool is_empty() const { return planes.empty(); }
+  // The direction of the view and one perpendicular to it. Views of
+  // everything look along the x axis
+  const vec3& direction() const { return dir; }
+  const vec3& across() const { return u; }
+  bool is_outside(const triangle& tri) const {
+    return is_outside(tri.a(), tri.b(), tri.c());
+  }
+  bool is_outside(const point& a, const point& b, const point& c) const {
+    for (auto iter = planes.begin(); iter != planes.end(); ++iter) {
+      if (iter->classify_point(a) < 0 && iter->classify_point(b) < 0 &&
+          iter->classify_point(c) < 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+// A light spread over a quad or a disk around a centre, with u and v as the
+// half-axes of the shape. Points on the light are addressed by a and b in
+// [-1, 1], which span a quad directly and a disk through the concentric mapping
+// as that keeps areas equal. The light is stood in for by a number of samples
+// laid out on a Fibonacci lattice, so they cover the shape evenly for any
+// count and never depend on random state
+template <typename T>
+class area_light_t {
+public:
+  typedef vec3_t<T> vec3;
+  typedef point_t<T> point;
+  enum Shape {
+    QUAD,
+    DISK
+  };
+
+  point centre;
+  vec3 u;
+  vec3 v;
+  Shape shape = QUAD;
+  size_t n_samples = 1;
+  // The number of probes along each side of the lattice the samples are
+  // interpolated from, which takes at least 2. With 0 probes, or at least as
+  // many probes as samples, every sample is a probe and nothing is interpolated
+  size_t n_probes = 3;
+
+  area_light_t() {}
+  area_light_t(const point& centre, const vec3& u, const vec3& v, Shape shape, size_t n_samples,
+               size_t n_probes = 3) :
+    centre(centre), u(u), v(v), shape(shape), n_samples(std::max<size_t>(n_samples, 1)),
+    n_probes(n_probes == 1 ? 2 : n_probes) {}
+
+  point at(double a, double b) const {
+    if (shape == DISK && (a != 0 || b != 0)) {
+      double r, phi;
+      if (std::abs(a) > std::abs(b)) {
+        r = a;
+        phi = M_PI / 4 * (b / a);
+      } else {
+        r = b;
+        phi = M_PI / 2 - M_PI / 4 * (a / b);
+      }
+      a = r * std::cos(phi);
+      b = r * std::sin(phi);
+    }
+    return point(centre.x + u.x * a + v.x * b, centre.y + u.y * a + v.y * b,
+                 centre.z + u.z * a + v.z * b);
+  }
+  // The a and b of every sample
+  std::vector<std::pair<double, double> > sample_coords() const {
+    const double GOLDEN = 0.6180339887498949;
+    std::vector<std::pair<double, double> > coords;
+    coords.reserve(n_samples);
+    for (size_t i = 0; i < n_samples; ++i) {
+      double s = (i + 0.5) / n_samples;
+      double t = std::fmod((i + 0.5) * GOLDEN, 1.0);
+      coords.emplace_back(2 * s - 1, 2 * t - 1);
+    }
+    return coords;
+  }
+  std::vector<point> samples() const {
+    std::vector<std::pair<double, double> > coords = sample_coords();
+    std::vector<point> points;
+    points.reserve(coords.size());
+    for (auto iter = coords.begin(); iter != coords.end(); ++iter) {
+      points.push_back(at(iter->first, iter->second));
+    }
+    return points;
+  }
 };
+
+typedef vec3_t<double> vec3;
+typedef point_t<double> point;
+typedef triangle_t<double> triangle;
+typedef cut_tri_t<double> cut_tri;
+typedef plane_t<double> plane;
+typedef frustum_t<double> frustum;
+typedef area_light_t<double> area_light;
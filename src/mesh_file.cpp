@@ -0,0 +1,551 @@
+#include "mesh_file.h"
+#include "task_pool.h"
+#include "weld.h"
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Vertices and faces are parsed in blocks of this many items per task
+static const size_t CHUNK_SIZE = 1 << 16;
+
+mapped_file::mapped_file(const std::string& path) {
+#ifdef _WIN32
+  HANDLE handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, NULL);
+  if (handle == INVALID_HANDLE_VALUE) {
+    throw std::runtime_error("Unable to open " + path);
+  }
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(handle, &size)) {
+    CloseHandle(handle);
+    throw std::runtime_error("Unable to get the size of " + path);
+  }
+  file = handle;
+  length = size.QuadPart;
+  if (length == 0) return;
+  HANDLE map = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (map == NULL) {
+    CloseHandle(handle);
+    throw std::runtime_error("Unable to map " + path + " into memory");
+  }
+  begin = static_cast<const char*>(MapViewOfFile(map, FILE_MAP_READ, 0, 0, 0));
+  if (begin == nullptr) {
+    CloseHandle(map);
+    CloseHandle(handle);
+    throw std::runtime_error("Unable to map " + path + " into memory");
+  }
+  mapping = map;
+#else
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("Unable to open " + path);
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0) {
+    close(fd);
+    throw std::runtime_error("Unable to get the size of " + path);
+  }
+  length = info.st_size;
+  if (length > 0) {
+    void* mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED) {
+      close(fd);
+      throw std::runtime_error("Unable to map " + path + " into memory");
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(mapped, length, MADV_SEQUENTIAL);
+#endif
+    begin = static_cast<const char*>(mapped);
+  }
+  // The mapping keeps the file open on its own
+  close(fd);
+#endif
+}
+
+mapped_file::~mapped_file() {
+#ifdef _WIN32
+  if (begin != nullptr) UnmapViewOfFile(begin);
+  if (mapping != nullptr) CloseHandle(mapping);
+  if (file != nullptr) CloseHandle(file);
+#else
+  if (begin != nullptr) munmap(const_cast<char*>(begin), length);
+#endif
+}
+
+static bool host_is_little_endian() {
+  uint16_t one = 1;
+  unsigned char first;
+  std::memcpy(&first, &one, 1);
+  return first == 1;
+}
+
+static void need_bytes(const char* p, const char* end, size_t n) {
+  if (size_t(end - p) < n) {
+    throw std::runtime_error("Unexpected end of mesh file");
+  }
+}
+
+// As above for count items of the given size, guarding against counts in
+// malformed headers that would overflow
+static void need_items(const char* p, const char* end, size_t count, size_t size) {
+  if (size != 0 && count > size_t(end - p) / size) {
+    throw std::runtime_error("Unexpected end of mesh file");
+  }
+}
+
+enum scalar_type {
+  INT8,
+  UINT8,
+  INT16,
+  UINT16,
+  INT32,
+  UINT32,
+  FLOAT32,
+  FLOAT64
+};
+
+static size_t scalar_size(scalar_type type) {
+  switch (type) {
+  case INT8:
+  case UINT8:
+    return 1;
+  case INT16:
+  case UINT16:
+    return 2;
+  case INT32:
+  case UINT32:
+  case FLOAT32:
+    return 4;
+  case FLOAT64:
+    return 8;
+  }
+  return 0;
+}
+
+// Reads a scalar stored at p, reversing its bytes first if the file and the
+// host differ in endianness
+static double read_scalar(const char* p, scalar_type type, bool swap) {
+  char bytes[8];
+  size_t n = scalar_size(type);
+  std::memcpy(bytes, p, n);
+  if (swap) std::reverse(bytes, bytes + n);
+  switch (type) {
+  case INT8: { int8_t v; std::memcpy(&v, bytes, n); return v; }
+  case UINT8: { uint8_t v; std::memcpy(&v, bytes, n); return v; }
+  case INT16: { int16_t v; std::memcpy(&v, bytes, n); return v; }
+  case UINT16: { uint16_t v; std::memcpy(&v, bytes, n); return v; }
+  case INT32: { int32_t v; std::memcpy(&v, bytes, n); return v; }
+  case UINT32: { uint32_t v; std::memcpy(&v, bytes, n); return v; }
+  case FLOAT32: { float v; std::memcpy(&v, bytes, n); return v; }
+  case FLOAT64: { double v; std::memcpy(&v, bytes, n); return v; }
+  }
+  return 0;
+}
+
+struct ply_property {
+  std::string name;
+  scalar_type type;
+  bool is_list = false;
+  scalar_type count_type = UINT8;
+};
+
+struct ply_element {
+  std::string name;
+  size_t count = 0;
+  std::vector<ply_property> properties;
+
+  // The size of every item, or 0 if it has list properties and varies
+  size_t stride() const {
+    size_t size = 0;
+    for (auto it = properties.begin(); it != properties.end(); ++it) {
+      if (it->is_list) return 0;
+      size += scalar_size(it->type);
+    }
+    return size;
+  }
+  int find(const std::string& property) const {
+    for (size_t i = 0; i < properties.size(); ++i) {
+      if (properties[i].name == property) return i;
+    }
+    return -1;
+  }
+};
+
+static scalar_type ply_scalar_type(const std::string& name) {
+  if (name == "char" || name == "int8") return INT8;
+  if (name == "uchar" || name == "uint8") return UINT8;
+  if (name == "short" || name == "int16") return INT16;
+  if (name == "ushort" || name == "uint16") return UINT16;
+  if (name == "int" || name == "int32") return INT32;
+  if (name == "uint" || name == "uint32") return UINT32;
+  if (name == "float" || name == "float32") return FLOAT32;
+  if (name == "double" || name == "float64") return FLOAT64;
+  throw std::runtime_error("Unknown PLY property type: " + name);
+}
+
+static std::vector<std::string> split_words(const std::string& line) {
+  std::vector<std::string> words;
+  size_t i = 0;
+  while (i < line.size()) {
+    while (i < line.size() && (line[i] == ' ' || line[i] == '\t')) ++i;
+    size_t start = i;
+    while (i < line.size() && line[i] != ' ' && line[i] != '\t') ++i;
+    if (i > start) words.push_back(line.substr(start, i - start));
+  }
+  return words;
+}
+
+// Parses the header of a PLY file and returns a pointer to the first byte of
+// the body
+static const char* read_ply_header(const char* p, const char* end, bool& swap,
+                                   std::vector<ply_element>& elements) {
+  bool has_format = false;
+  bool first = true;
+  while (true) {
+    const char* eol = static_cast<const char*>(std::memchr(p, '\n', end - p));
+    if (eol == nullptr) {
+      throw std::runtime_error("The PLY header is not terminated by end_header");
+    }
+    std::string line(p, eol);
+    p = eol + 1;
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    std::vector<std::string> words = split_words(line);
+    if (first) {
+      first = false;
+      continue;
+    }
+    if (words.empty() || words[0] == "comment" || words[0] == "obj_info") continue;
+    if (words[0] == "end_header") break;
+    if (words[0] == "format" && words.size() >= 2) {
+      if (words[1] == "binary_little_endian") {
+        swap = !host_is_little_endian();
+      } else if (words[1] == "binary_big_endian") {
+        swap = host_is_little_endian();
+      } else if (words[1] == "ascii") {
+        throw std::runtime_error("ASCII PLY files are not supported. Only binary PLY files can be read");
+      } else {
+        throw std::runtime_error("Unknown PLY format: " + words[1]);
+      }
+      has_format = true;
+    } else if (words[0] == "element" && words.size() == 3) {
+      elements.push_back(ply_element());
+      elements.back().name = words[1];
+      elements.back().count = std::strtoull(words[2].c_str(), nullptr, 10);
+    } else if (words[0] == "property" && !elements.empty()) {
+      ply_property property;
+      if (words.size() == 5 && words[1] == "list") {
+        property.is_list = true;
+        property.count_type = ply_scalar_type(words[2]);
+        property.type = ply_scalar_type(words[3]);
+        property.name = words[4];
+      } else if (words.size() == 3) {
+        property.type = ply_scalar_type(words[1]);
+        property.name = words[2];
+      } else {
+        throw std::runtime_error("Malformed PLY property: " + line);
+      }
+      elements.back().properties.push_back(property);
+    } else {
+      throw std::runtime_error("Malformed PLY header line: " + line);
+    }
+  }
+  if (!has_format) {
+    throw std::runtime_error("The PLY header doesn't give a format");
+  }
+  return p;
+}
+
+// Reads the length of a list property and moves past it
+static size_t read_ply_count(const char*& p, const char* end, const ply_property& property,
+                             bool swap) {
+  need_bytes(p, end, scalar_size(property.count_type));
+  double n = read_scalar(p, property.count_type, swap);
+  if (n < 0) {
+    throw std::runtime_error("Negative list length in PLY file");
+  }
+  p += scalar_size(property.count_type);
+  return size_t(n);
+}
+
+static const char* skip_ply_property(const char* p, const char* end,
+                                     const ply_property& property, bool swap) {
+  size_t n = property.is_list ? read_ply_count(p, end, property, swap) : 1;
+  need_bytes(p, end, n * scalar_size(property.type));
+  return p + n * scalar_size(property.type);
+}
+
+// Moves past an item of an element with list properties
+static const char* skip_ply_item(const char* p, const char* end, const ply_element& element,
+                                 bool swap) {
+  for (auto it = element.properties.begin(); it != element.properties.end(); ++it) {
+    p = skip_ply_property(p, end, *it, swap);
+  }
+  return p;
+}
+
+static const char* read_ply_vertices(const char* p, const char* end,
+                                     const ply_element& element, bool swap, size_t n_threads,
+                                     std::vector<double>& vertices) {
+  int axes[3] = {element.find("x"), element.find("y"), element.find("z")};
+  if (axes[0] < 0 || axes[1] < 0 || axes[2] < 0) {
+    throw std::runtime_error("The PLY vertices don't have an x, y, and z property");
+  }
+  size_t offset[3];
+  scalar_type type[3];
+  for (int k = 0; k < 3; ++k) {
+    const ply_property& property = element.properties[axes[k]];
+    if (property.is_list) {
+      throw std::runtime_error("The PLY vertex coordinates can't be lists");
+    }
+    type[k] = property.type;
+    offset[k] = 0;
+    for (int i = 0; i < axes[k]; ++i) {
+      offset[k] += scalar_size(element.properties[i].type);
+    }
+  }
+  size_t stride = element.stride();
+  // Every vertex takes up at least a byte
+  need_items(p, end, element.count, std::max<size_t>(stride, 1));
+  vertices.resize(element.count * 4);
+
+  if (stride != 0) {
+    // Every vertex has the same size so blocks of them can be read in parallel
+    size_t n_chunks = (element.count + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    parallel_for(n_chunks, n_threads, [&](size_t chunk) {
+      size_t last = std::min(element.count, (chunk + 1) * CHUNK_SIZE);
+      for (size_t i = chunk * CHUNK_SIZE; i < last; ++i) {
+        const char* item = p + i * stride;
+        double* coord = vertices.data() + i * 4;
+        for (int k = 0; k < 3; ++k) {
+          coord[k] = read_scalar(item + offset[k], type[k], swap);
+        }
+        coord[3] = 1.0;
+      }
+    });
+    return p + element.count * stride;
+  }
+
+  for (size_t i = 0; i < element.count; ++i) {
+    const char* item = p;
+    p = skip_ply_item(p, end, element, swap);
+    double* coord = vertices.data() + i * 4;
+    for (int k = 0; k < 3; ++k) {
+      coord[k] = read_scalar(item + offset[k], type[k], swap);
+    }
+    coord[3] = 1.0;
+  }
+  return p;
+}
+
+static const char* read_ply_faces(const char* p, const char* end, const ply_element& element,
+                                  bool swap, size_t n_vertices, size_t n_threads,
+                                  std::vector<int>& corners) {
+  int list = element.find("vertex_indices");
+  if (list < 0) list = element.find("vertex_index");
+  if (list < 0 || !element.properties[list].is_list) {
+    throw std::runtime_error("The PLY faces don't have a vertex_indices list");
+  }
+  const ply_property& indices = element.properties[list];
+  size_t count_size = scalar_size(indices.count_type);
+  size_t index_size = scalar_size(indices.type);
+  std::atomic<bool> out_of_range(false);
+  auto to_corner = [&](double index) {
+    if (index < 0 || index >= n_vertices) {
+      out_of_range = true;
+      return 0;
+    }
+    return int(index) + 1;
+  };
+
+  // Scanned meshes are usually all triangles with nothing but the indices. In
+  // that case every face has the same size and blocks of them are read in
+  // parallel, falling back to reading face by face if the guess was wrong
+  size_t stride = count_size + 3 * index_size;
+  if (element.properties.size() == 1 && element.count <= size_t(end - p) / stride) {
+    std::atomic<bool> all_triangles(true);
+    corners.resize(element.count * 3);
+    size_t n_chunks = (element.count + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    parallel_for(n_chunks, n_threads, [&](size_t chunk) {
+      size_t last = std::min(element.count, (chunk + 1) * CHUNK_SIZE);
+      for (size_t i = chunk * CHUNK_SIZE; i < last && all_triangles; ++i) {
+        const char* item = p + i * stride;
+        if (read_scalar(item, indices.count_type, swap) != 3) {
+          all_triangles = false;
+          break;
+        }
+        for (int k = 0; k < 3; ++k) {
+          corners[i * 3 + k] = to_corner(
+            read_scalar(item + count_size + k * index_size, indices.type, swap)
+          );
+        }
+      }
+    });
+    if (all_triangles) {
+      if (out_of_range) {
+        throw std::runtime_error("A PLY face refers to a vertex that doesn't exist");
+      }
+      return p + element.count * stride;
+    }
+    out_of_range = false;
+    corners.clear();
+  }
+
+  need_items(p, end, element.count, count_size);
+  corners.reserve(element.count * 3);
+  std::vector<int> polygon;
+  for (size_t i = 0; i < element.count; ++i) {
+    for (int j = 0; j < int(element.properties.size()); ++j) {
+      const ply_property& property = element.properties[j];
+      if (j != list) {
+        p = skip_ply_property(p, end, property, swap);
+        continue;
+      }
+      size_t n = read_ply_count(p, end, property, swap);
+      need_bytes(p, end, n * index_size);
+      polygon.clear();
+      for (size_t k = 0; k < n; ++k) {
+        polygon.push_back(to_corner(read_scalar(p, property.type, swap)));
+        p += index_size;
+      }
+      // Polygons are split into a fan around their first corner
+      for (size_t k = 2; k < n; ++k) {
+        corners.push_back(polygon[0]);
+        corners.push_back(polygon[k - 1]);
+        corners.push_back(polygon[k]);
+      }
+    }
+  }
+  if (out_of_range) {
+    throw std::runtime_error("A PLY face refers to a vertex that doesn't exist");
+  }
+  return p;
+}
+
+static void read_ply(const char* p, const char* end, size_t n_threads,
+                     std::vector<double>& vertices, std::vector<int>& corners) {
+  bool swap = false;
+  std::vector<ply_element> elements;
+  p = read_ply_header(p, end, swap, elements);
+
+  size_t n_vertices = 0;
+  bool has_vertices = false;
+  bool has_faces = false;
+  for (auto it = elements.begin(); it != elements.end(); ++it) {
+    if (it->name == "vertex") {
+      n_vertices = it->count;
+      has_vertices = true;
+    }
+    has_faces = has_faces || it->name == "face";
+  }
+  if (!has_vertices || !has_faces) {
+    throw std::runtime_error("A PLY file must have both vertex and face elements");
+  }
+  if (n_vertices >= size_t(INT_MAX)) {
+    throw std::runtime_error("The PLY file has too many vertices");
+  }
+
+  for (auto it = elements.begin(); it != elements.end(); ++it) {
+    if (it->name == "vertex") {
+      p = read_ply_vertices(p, end, *it, swap, n_threads, vertices);
+    } else if (it->name == "face") {
+      p = read_ply_faces(p, end, *it, swap, n_vertices, n_threads, corners);
+    } else if (it->stride() != 0) {
+      need_items(p, end, it->count, it->stride());
+      p += it->count * it->stride();
+    } else {
+      for (size_t i = 0; i < it->count; ++i) {
+        p = skip_ply_item(p, end, *it, swap);
+      }
+    }
+  }
+}
+
+// Binary STL files hold an 80 byte header, the number of triangles, and then
+// 50 bytes per triangle: its normal and three corners as little-endian floats
+// followed by an attribute count that is ignored
+static void read_stl(const char* p, const char* end, size_t n_threads,
+                     std::vector<double>& vertices, std::vector<int>& corners) {
+  const size_t HEADER_SIZE = 84;
+  const size_t TRIANGLE_SIZE = 50;
+  bool is_text = size_t(end - p) >= 5 && std::strncmp(p, "solid", 5) == 0;
+  if (size_t(end - p) < HEADER_SIZE) {
+    throw std::runtime_error("The file is too small to be a binary STL file");
+  }
+  bool swap = !host_is_little_endian();
+  size_t n = read_scalar(p + 80, UINT32, swap);
+  if ((size_t(end - p) - HEADER_SIZE) / TRIANGLE_SIZE < n) {
+    if (is_text) {
+      throw std::runtime_error("ASCII STL files are not supported. Only binary STL files can be read");
+    }
+    throw std::runtime_error("Unexpected end of mesh file");
+  }
+  if (n * 3 >= size_t(UINT32_MAX)) {
+    throw std::runtime_error("The STL file has too many triangles");
+  }
+
+  p += HEADER_SIZE;
+  std::vector<double> x(n * 3), y(n * 3), z(n * 3);
+  size_t n_chunks = (n + CHUNK_SIZE - 1) / CHUNK_SIZE;
+  parallel_for(n_chunks, n_threads, [&](size_t chunk) {
+    size_t last = std::min(n, (chunk + 1) * CHUNK_SIZE);
+    for (size_t i = chunk * CHUNK_SIZE; i < last; ++i) {
+      const char* corner = p + i * TRIANGLE_SIZE + 12;
+      for (int k = 0; k < 3; ++k) {
+        x[i * 3 + k] = read_scalar(corner, FLOAT32, swap);
+        y[i * 3 + k] = read_scalar(corner + 4, FLOAT32, swap);
+        z[i * 3 + k] = read_scalar(corner + 8, FLOAT32, swap);
+        corner += 12;
+      }
+    }
+  });
+
+  std::vector<uint32_t> index;
+  std::vector<uint32_t> first;
+  weld_vertices(x.data(), y.data(), z.data(), n * 3, 0.0, n_threads, index, first);
+  if (first.size() >= size_t(INT_MAX)) {
+    throw std::runtime_error("The STL file has too many vertices");
+  }
+  vertices.resize(first.size() * 4);
+  double* coord = vertices.data();
+  for (auto it = first.begin(); it != first.end(); ++it) {
+    *coord++ = x[*it];
+    *coord++ = y[*it];
+    *coord++ = z[*it];
+    *coord++ = 1.0;
+  }
+  corners.resize(index.size());
+  for (size_t i = 0; i < index.size(); ++i) {
+    corners[i] = index[i] + 1;
+  }
+}
+
+void read_mesh_file(const std::string& path, size_t n_threads,
+                    std::vector<double>& vertices, std::vector<int>& corners) {
+  mapped_file file(path);
+  const char* p = file.data();
+  const char* end = p + file.size();
+  vertices.clear();
+  corners.clear();
+  if (file.size() >= 4 && std::strncmp(p, "ply", 3) == 0 && (p[3] == '\n' || p[3] == '\r')) {
+    read_ply(p, end, n_threads, vertices, corners);
+  } else {
+    read_stl(p, end, n_threads, vertices, corners);
+  }
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstddef>
+
+// A file mapped read-only into memory for the lifetime of the object, so it can
+// be parsed in place without reading it into a buffer first
+class mapped_file {
+private:
+  const char* begin = nullptr;
+  size_t length = 0;
+#ifdef _WIN32
+  void* file = nullptr;
+  void* mapping = nullptr;
+#endif
+public:
+  explicit mapped_file(const std::string& path);
+  ~mapped_file();
+  mapped_file(const mapped_file&) = delete;
+  mapped_file& operator=(const mapped_file&) = delete;
+
+  const char* data() const { return begin; }
+  size_t size() const { return length; }
+};
+
+// Reads a mesh from a binary PLY or STL file, telling them apart by the
+// contents rather than the extension. vertices receives x, y, z, and 1 for
+// every vertex in the layout of the vb matrix of a trimesh, and corners the
+// 1-based indices of the three vertices of every triangle. Polygonal faces
+// in PLY files are split into a fan of triangles. STL files store every
+// triangle with its own corners so identical corners are welded into one
+// vertex. Malformed files throw std::runtime_error
+void read_mesh_file(const std::string& path, size_t n_threads,
+                    std::vector<double>& vertices, std::vector<int>& corners);
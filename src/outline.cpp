@@ -0,0 +1,318 @@
+#include "outline.h"
+#include "weld.h"
+
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <cstdint>
+
+// An edge of a fragment in the winding of the fragment
+struct fragment_edge {
+  uint32_t a;
+  uint32_t b;
+  uint32_t fragment;
+};
+
+// A corner of an edge placed along the line shared by its group
+template <typename T>
+struct line_stop {
+  T t;
+  uint32_t vertex;
+  uint32_t corner;
+  bool operator<(const line_stop& stop) const {
+    if (t != stop.t) return t < stop.t;
+    return corner < stop.corner;
+  }
+};
+
+// An edge as a range of stops along its line. forward is true if the edge
+// runs in the direction of the line
+struct line_span {
+  uint32_t from;
+  uint32_t to;
+  uint32_t edge;
+  bool forward;
+  bool operator<(const line_span& span) const {
+    if (from != span.from) return from < span.from;
+    return edge < span.edge;
+  }
+};
+
+static uint32_t find_root(std::vector<uint32_t>& parent, uint32_t i) {
+  while (parent[i] != i) {
+    parent[i] = parent[parent[i]];
+    i = parent[i];
+  }
+  return i;
+}
+
+static void join_roots(std::vector<uint32_t>& parent, uint32_t i, uint32_t j) {
+  i = find_root(parent, i);
+  j = find_root(parent, j);
+  if (i < j) {
+    parent[j] = i;
+  } else if (j < i) {
+    parent[i] = j;
+  }
+}
+
+// Groups edges lying on the same line. Edges are joined when they meet at a
+// vertex and the far corner of the shorter one is within tolerance of the line
+// through the longer one. A line split at different places by the fragments on
+// either side of it still ends up in one group as both sides meet at the ends
+template <typename T>
+static void group_collinear(const vertex_pool_t<T>& vertices,
+                            const std::vector<fragment_edge>& edges, T tolerance,
+                            std::vector<uint32_t>& parent) {
+  typedef vec3_t<T> vec3;
+  std::vector<uint32_t> offset(vertices.size() + 1, 0);
+  for (auto it = edges.begin(); it != edges.end(); ++it) {
+    ++offset[it->a + 1];
+    ++offset[it->b + 1];
+  }
+  for (size_t i = 1; i < offset.size(); ++i) offset[i] += offset[i - 1];
+  std::vector<uint32_t> meeting(offset.back());
+  std::vector<uint32_t> fill(offset.begin(), offset.end() - 1);
+  for (uint32_t i = 0; i < edges.size(); ++i) {
+    meeting[fill[edges[i].a]++] = i;
+    meeting[fill[edges[i].b]++] = i;
+  }
+
+  parent.resize(edges.size());
+  for (uint32_t i = 0; i < parent.size(); ++i) parent[i] = i;
+  std::vector<vec3> away;
+  std::vector<T> length;
+  for (uint32_t v = 0; v < vertices.size(); ++v) {
+    uint32_t first = offset[v];
+    uint32_t n = offset[v + 1] - first;
+    if (n < 2) continue;
+    away.clear();
+    length.clear();
+    for (uint32_t i = 0; i < n; ++i) {
+      const fragment_edge& edge = edges[meeting[first + i]];
+      vec3 d = vertices[edge.a == v ? edge.b : edge.a] - vertices[v];
+      length.push_back(d.length());
+      away.push_back(length.back() > 0 ? d.normalize() : d);
+    }
+    for (uint32_t i = 0; i < n; ++i) {
+      for (uint32_t j = i + 1; j < n; ++j) {
+        T shortest = std::min(length[i], length[j]);
+        if (away[i].cross(away[j]).length() * shortest <= tolerance) {
+          join_roots(parent, meeting[first + i], meeting[first + j]);
+        }
+      }
+    }
+  }
+}
+
+// Joins segments given as pairs of pool indices into polylines. Corners are
+// matched by position so segments from different lines meet even if their
+// corners are different vertices in the pool. Open polylines start and end
+// where the segments don't continue in exactly one way, what remains are
+// closed loops that end where they started
+template <typename T>
+static void chain_segments(const vertex_pool_t<T>& vertices,
+                           const std::vector<uint32_t>& segments,
+                           std::vector<std::vector<point_t<T> > >& lines) {
+  size_t n = segments.size();
+  std::vector<double> x(n), y(n), z(n);
+  for (size_t i = 0; i < n; ++i) {
+    const point_t<T>& p = vertices[segments[i]];
+    x[i] = p.x;
+    y[i] = p.y;
+    z[i] = p.z;
+  }
+  std::vector<uint32_t> corner;
+  std::vector<uint32_t> first;
+  weld_vertices(x.data(), y.data(), z.data(), n, 0.0, 1, corner, first);
+
+  std::vector<uint32_t> offset(first.size() + 1, 0);
+  for (size_t i = 0; i < n; ++i) ++offset[corner[i] + 1];
+  for (size_t i = 1; i < offset.size(); ++i) offset[i] += offset[i - 1];
+  std::vector<uint32_t> touching(n);
+  std::vector<uint32_t> fill(offset.begin(), offset.end() - 1);
+  for (uint32_t i = 0; i < n; ++i) touching[fill[corner[i]]++] = i;
+
+  std::vector<bool> used(n / 2, false);
+  auto follow = [&](uint32_t v, uint32_t segment) {
+    std::vector<point_t<T> > line;
+    line.push_back(vertices[segments[first[v]]]);
+    while (true) {
+      used[segment] = true;
+      uint32_t end = segment * 2 + (corner[segment * 2] == v ? 1 : 0);
+      v = corner[end];
+      line.push_back(vertices[segments[first[v]]]);
+      if (offset[v + 1] - offset[v] != 2) break;
+      uint32_t next = touching[offset[v]] / 2;
+      if (next == segment) next = touching[offset[v] + 1] / 2;
+      if (used[next]) break;
+      segment = next;
+    }
+    lines.push_back(std::move(line));
+  };
+  for (uint32_t v = 0; v < first.size(); ++v) {
+    if (offset[v + 1] - offset[v] == 2) continue;
+    for (uint32_t i = offset[v]; i < offset[v + 1]; ++i) {
+      if (!used[touching[i] / 2]) follow(v, touching[i] / 2);
+    }
+  }
+  for (uint32_t segment = 0; segment < used.size(); ++segment) {
+    if (!used[segment]) follow(corner[segment * 2], segment);
+  }
+}
+
+template <typename T>
+void visible_lines(const vertex_pool_t<T>& vertices,
+                   const std::vector<indexed_triangle_t<T> >& triangles,
+                   const point_t<T>& from, T crease_angle,
+                   std::vector<std::vector<point_t<T> > >& lines) {
+  typedef vec3_t<T> vec3;
+  typedef point_t<T> point;
+  lines.clear();
+
+  std::vector<bool> front(triangles.size());
+  std::vector<bool> drawn(triangles.size());
+  std::vector<fragment_edge> edges;
+  edges.reserve(triangles.size() * 3);
+  T scale = 0;
+  for (uint32_t i = 0; i < triangles.size(); ++i) {
+    const indexed_triangle_t<T>& tri = triangles[i];
+    front[i] = tri.normal().dot(from - vertices[tri[0]]) > 0;
+    drawn[i] = front[i] && tri.is_visible();
+    for (int j = 0; j < 3; ++j) {
+      const point& p = vertices[tri[j]];
+      scale = std::max(scale, std::max(std::abs(p.x), std::max(std::abs(p.y), std::abs(p.z))));
+      if (tri[j] != tri[j + 1]) {
+        edges.push_back({tri[j], tri[j + 1], i});
+      }
+    }
+  }
+  T tolerance = 256 * std::numeric_limits<T>::epsilon() * scale;
+  T min_cos = std::cos(crease_angle);
+
+  std::vector<uint32_t> parent;
+  group_collinear(vertices, edges, tolerance, parent);
+  std::vector<uint32_t> order(edges.size());
+  for (uint32_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+    find_root(parent, i);
+  }
+  std::stable_sort(order.begin(), order.end(), [&](uint32_t i, uint32_t j) {
+    return parent[i] < parent[j];
+  });
+
+  // Is the other side of a stretch of edge a surface that continues smoothly
+  // from the fragment of edge
+  auto continues = [&](const fragment_edge& edge, const fragment_edge& other) {
+    return front[other.fragment] &&
+      triangles[edge.fragment].normal().dot(triangles[other.fragment].normal()) >= min_cos;
+  };
+  auto is_drawn = [&](const std::vector<line_span>& active) {
+    for (auto it = active.begin(); it != active.end(); ++it) {
+      const fragment_edge& edge = edges[it->edge];
+      if (!drawn[edge.fragment]) continue;
+      bool hidden = false;
+      for (auto other = active.begin(); other != active.end() && !hidden; ++other) {
+        hidden = other->forward != it->forward && continues(edge, edges[other->edge]);
+      }
+      if (!hidden) return true;
+    }
+    return false;
+  };
+
+  std::vector<uint32_t> segments;
+  std::vector<line_stop<T> > stops;
+  std::vector<uint32_t> stop_of;
+  std::vector<uint32_t> stop_vertex;
+  std::vector<line_span> spans;
+  std::vector<line_span> active;
+  for (size_t start = 0; start < order.size();) {
+    size_t end = start;
+    bool any_drawn = false;
+    uint32_t longest = order[start];
+    T longest_length = -1;
+    while (end < order.size() && parent[order[end]] == parent[order[start]]) {
+      const fragment_edge& edge = edges[order[end]];
+      any_drawn = any_drawn || drawn[edge.fragment];
+      T length = (vertices[edge.b] - vertices[edge.a]).length();
+      if (length > longest_length) {
+        longest_length = length;
+        longest = order[end];
+      }
+      ++end;
+    }
+    if (!any_drawn || longest_length <= 0) {
+      start = end;
+      continue;
+    }
+
+    // Place the corners along the line. Corners closer than the tolerance
+    // share a stop, and edges with both corners at the same stop are dropped
+    const point& origin = vertices[edges[longest].a];
+    vec3 direction = (vertices[edges[longest].b] - origin).normalize();
+    size_t n = end - start;
+    stops.clear();
+    for (size_t i = 0; i < n; ++i) {
+      const fragment_edge& edge = edges[order[start + i]];
+      stops.push_back({(vertices[edge.a] - origin).dot(direction), edge.a, uint32_t(i * 2)});
+      stops.push_back({(vertices[edge.b] - origin).dot(direction), edge.b, uint32_t(i * 2 + 1)});
+    }
+    std::sort(stops.begin(), stops.end());
+    stop_of.assign(n * 2, 0);
+    stop_vertex.clear();
+    T last_t = 0;
+    for (auto it = stops.begin(); it != stops.end(); ++it) {
+      if (stop_vertex.empty() || it->t - last_t > tolerance) {
+        stop_vertex.push_back(it->vertex);
+        last_t = it->t;
+      }
+      stop_of[it->corner] = stop_vertex.size() - 1;
+    }
+    spans.clear();
+    for (size_t i = 0; i < n; ++i) {
+      uint32_t a = stop_of[i * 2];
+      uint32_t b = stop_of[i * 2 + 1];
+      if (a == b) continue;
+      spans.push_back({std::min(a, b), std::max(a, b), order[start + i], a < b});
+    }
+    std::sort(spans.begin(), spans.end());
+
+    // Sweep along the line, deciding for each stretch between two stops if it
+    // is drawn, and merge consecutive drawn stretches
+    active.clear();
+    auto next = spans.begin();
+    bool open = false;
+    for (uint32_t stop = 0; stop + 1 < stop_vertex.size(); ++stop) {
+      active.erase(std::remove_if(active.begin(), active.end(), [&](const line_span& span) {
+        return span.to <= stop;
+      }), active.end());
+      for (; next != spans.end() && next->from == stop; ++next) {
+        active.push_back(*next);
+      }
+      bool draw = is_drawn(active);
+      if (draw && !open) {
+        segments.push_back(stop_vertex[stop]);
+        open = true;
+      } else if (!draw && open) {
+        segments.push_back(stop_vertex[stop]);
+        open = false;
+      }
+    }
+    if (open) {
+      segments.push_back(stop_vertex.back());
+    }
+
+    start = end;
+  }
+
+  chain_segments(vertices, segments, lines);
+}
+
+template void visible_lines<double>(const vertex_pool_t<double>&,
+                                    const std::vector<indexed_triangle_t<double> >&,
+                                    const point_t<double>&, double,
+                                    std::vector<std::vector<point_t<double> > >&);
+template void visible_lines<float>(const vertex_pool_t<float>&,
+                                   const std::vector<indexed_triangle_t<float> >&,
+                                   const point_t<float>&, float,
+                                   std::vector<std::vector<point_t<float> > >&);
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <vector>
+
+#include "vertex_pool.h"
+
+// Finds the lines to draw for fragments occluded as seen from `from`. Only
+// edges of visible, front-facing fragments are considered, and a stretch of
+// such an edge is drawn when nothing lies on the other side of it (the border
+// of the mesh), when the other side faces away from the viewpoint (a
+// silhouette), or when the angle between the two sides is above crease_angle
+// (in radians). Edges between two sides of the same smooth surface, including
+// the border between the visible and hidden part of it, are left out as the
+// occluding silhouette is drawn already.
+//
+// Collinear edges are compared stretch by stretch so fragments don't need to
+// share corners, every stretch is reported once, and the stretches are joined
+// into polylines through the vertices they share
+template <typename T>
+void visible_lines(const vertex_pool_t<T>& vertices,
+                   const std::vector<indexed_triangle_t<T> >& triangles,
+                   const point_t<T>& from, T crease_angle,
+                   std::vector<std::vector<point_t<T> > >& lines);
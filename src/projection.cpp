@@ -0,0 +1,198 @@
+#include "projection.h"
+#include "task_pool.h"
+
+#include <algorithm>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && defined(__SSE2__)
+#define UNMESHY_X86_SIMD
+#include <immintrin.h>
+#endif
+
+// Points are spread over threads in chunks of this size
+static const size_t CHUNK_SIZE = 1 << 16;
+
+// Multiplies and adds are done in the same order in every path, column by
+// column of the matrix, and without FMA so the SIMD paths agree with this one
+static void columns_scalar(const double* m, const double* x, const double* y, const double* z,
+                           size_t first, size_t last, double* px, double* py, double* pz) {
+  for (size_t i = first; i < last; ++i) {
+    double xi = x[i], yi = y[i], zi = z[i];
+    double tx = ((m[0] * xi + m[4] * yi) + m[8] * zi) + m[12];
+    double ty = ((m[1] * xi + m[5] * yi) + m[9] * zi) + m[13];
+    double tz = ((m[2] * xi + m[6] * yi) + m[10] * zi) + m[14];
+    double tw = ((m[3] * xi + m[7] * yi) + m[11] * zi) + m[15];
+    px[i] = tx / tw;
+    py[i] = ty / tw;
+    pz[i] = tz / tw;
+  }
+}
+
+static void vertices_scalar(const double* m, const double* vb, size_t first, size_t last,
+                            double* out) {
+  for (size_t i = first; i < last; ++i) {
+    const double* v = vb + 4 * i;
+    double xi = v[0], yi = v[1], zi = v[2], wi = v[3];
+    double tx = ((m[0] * xi + m[4] * yi) + m[8] * zi) + m[12] * wi;
+    double ty = ((m[1] * xi + m[5] * yi) + m[9] * zi) + m[13] * wi;
+    double tz = ((m[2] * xi + m[6] * yi) + m[10] * zi) + m[14] * wi;
+    double tw = ((m[3] * xi + m[7] * yi) + m[11] * zi) + m[15] * wi;
+    double* o = out + 4 * i;
+    o[0] = tx / tw;
+    o[1] = ty / tw;
+    o[2] = tz / tw;
+    o[3] = 1;
+  }
+}
+
+#ifdef UNMESHY_X86_SIMD
+
+// The columns paths transform a point per lane, the vertices paths a
+// coordinate of a single point per lane
+static size_t columns_sse2(const double* m, const double* x, const double* y, const double* z,
+                           size_t first, size_t last, double* px, double* py, double* pz) {
+  __m128d c[16];
+  for (int k = 0; k < 16; ++k) {
+    c[k] = _mm_set1_pd(m[k]);
+  }
+  size_t i = first;
+  for (; i + 2 <= last; i += 2) {
+    __m128d xi = _mm_loadu_pd(x + i);
+    __m128d yi = _mm_loadu_pd(y + i);
+    __m128d zi = _mm_loadu_pd(z + i);
+    __m128d t[4];
+    for (int r = 0; r < 4; ++r) {
+      t[r] = _mm_add_pd(
+        _mm_add_pd(_mm_add_pd(_mm_mul_pd(c[r], xi), _mm_mul_pd(c[r + 4], yi)),
+                   _mm_mul_pd(c[r + 8], zi)),
+        c[r + 12]
+      );
+    }
+    _mm_storeu_pd(px + i, _mm_div_pd(t[0], t[3]));
+    _mm_storeu_pd(py + i, _mm_div_pd(t[1], t[3]));
+    _mm_storeu_pd(pz + i, _mm_div_pd(t[2], t[3]));
+  }
+  return i;
+}
+
+__attribute__((target("avx")))
+static size_t columns_avx(const double* m, const double* x, const double* y, const double* z,
+                          size_t first, size_t last, double* px, double* py, double* pz) {
+  __m256d c[16];
+  for (int k = 0; k < 16; ++k) {
+    c[k] = _mm256_set1_pd(m[k]);
+  }
+  size_t i = first;
+  for (; i + 4 <= last; i += 4) {
+    __m256d xi = _mm256_loadu_pd(x + i);
+    __m256d yi = _mm256_loadu_pd(y + i);
+    __m256d zi = _mm256_loadu_pd(z + i);
+    __m256d t[4];
+    for (int r = 0; r < 4; ++r) {
+      t[r] = _mm256_add_pd(
+        _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(c[r], xi), _mm256_mul_pd(c[r + 4], yi)),
+                      _mm256_mul_pd(c[r + 8], zi)),
+        c[r + 12]
+      );
+    }
+    _mm256_storeu_pd(px + i, _mm256_div_pd(t[0], t[3]));
+    _mm256_storeu_pd(py + i, _mm256_div_pd(t[1], t[3]));
+    _mm256_storeu_pd(pz + i, _mm256_div_pd(t[2], t[3]));
+  }
+  return i;
+}
+
+static size_t vertices_sse2(const double* m, const double* vb, size_t first, size_t last,
+                            double* out) {
+  // The rows x and y of every column of the matrix, and likewise z and w
+  __m128d xy[4], zw[4];
+  for (int k = 0; k < 4; ++k) {
+    xy[k] = _mm_loadu_pd(m + 4 * k);
+    zw[k] = _mm_loadu_pd(m + 4 * k + 2);
+  }
+  __m128d one = _mm_set1_pd(1);
+  for (size_t i = first; i < last; ++i) {
+    const double* v = vb + 4 * i;
+    __m128d xi = _mm_set1_pd(v[0]);
+    __m128d yi = _mm_set1_pd(v[1]);
+    __m128d zi = _mm_set1_pd(v[2]);
+    __m128d wi = _mm_set1_pd(v[3]);
+    __m128d txy = _mm_add_pd(
+      _mm_add_pd(_mm_add_pd(_mm_mul_pd(xy[0], xi), _mm_mul_pd(xy[1], yi)), _mm_mul_pd(xy[2], zi)),
+      _mm_mul_pd(xy[3], wi)
+    );
+    __m128d tzw = _mm_add_pd(
+      _mm_add_pd(_mm_add_pd(_mm_mul_pd(zw[0], xi), _mm_mul_pd(zw[1], yi)), _mm_mul_pd(zw[2], zi)),
+      _mm_mul_pd(zw[3], wi)
+    );
+    __m128d tw = _mm_unpackhi_pd(tzw, tzw);
+    double* o = out + 4 * i;
+    _mm_storeu_pd(o, _mm_div_pd(txy, tw));
+    _mm_storeu_pd(o + 2, _mm_unpacklo_pd(_mm_div_pd(tzw, tw), one));
+  }
+  return last;
+}
+
+__attribute__((target("avx")))
+static size_t vertices_avx(const double* m, const double* vb, size_t first, size_t last,
+                           double* out) {
+  __m256d c[4];
+  for (int k = 0; k < 4; ++k) {
+    c[k] = _mm256_loadu_pd(m + 4 * k);
+  }
+  __m256d one = _mm256_set1_pd(1);
+  for (size_t i = first; i < last; ++i) {
+    const double* v = vb + 4 * i;
+    __m256d t = _mm256_add_pd(
+      _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(c[0], _mm256_broadcast_sd(v)),
+                                  _mm256_mul_pd(c[1], _mm256_broadcast_sd(v + 1))),
+                    _mm256_mul_pd(c[2], _mm256_broadcast_sd(v + 2))),
+      _mm256_mul_pd(c[3], _mm256_broadcast_sd(v + 3))
+    );
+    // Spreads w over every lane before dividing, and sets the w of the result
+    __m256d high = _mm256_permute2f128_pd(t, t, 0x11);
+    __m256d tw = _mm256_unpackhi_pd(high, high);
+    _mm256_storeu_pd(out + 4 * i, _mm256_blend_pd(_mm256_div_pd(t, tw), one, 0x8));
+  }
+  return last;
+}
+
+static bool has_avx() {
+  static const bool supported = __builtin_cpu_supports("avx");
+  return supported;
+}
+
+#endif
+
+void project_columns(const double* matrix, const double* x, const double* y, const double* z,
+                     size_t n, double* px, double* py, double* pz, size_t n_threads) {
+  size_t n_chunks = (n + CHUNK_SIZE - 1) / CHUNK_SIZE;
+  parallel_for(n_chunks, n_threads, [&](size_t chunk) {
+    size_t first = chunk * CHUNK_SIZE;
+    size_t last = std::min(n, first + CHUNK_SIZE);
+#ifdef UNMESHY_X86_SIMD
+    if (has_avx()) {
+      first = columns_avx(matrix, x, y, z, first, last, px, py, pz);
+    } else {
+      first = columns_sse2(matrix, x, y, z, first, last, px, py, pz);
+    }
+#endif
+    columns_scalar(matrix, x, y, z, first, last, px, py, pz);
+  });
+}
+
+void project_vertices(const double* matrix, const double* vb, size_t n, double* out,
+                      size_t n_threads) {
+  size_t n_chunks = (n + CHUNK_SIZE - 1) / CHUNK_SIZE;
+  parallel_for(n_chunks, n_threads, [&](size_t chunk) {
+    size_t first = chunk * CHUNK_SIZE;
+    size_t last = std::min(n, first + CHUNK_SIZE);
+#ifdef UNMESHY_X86_SIMD
+    if (has_avx()) {
+      first = vertices_avx(matrix, vb, first, last, out);
+    } else {
+      first = vertices_sse2(matrix, vb, first, last, out);
+    }
+#endif
+    vertices_scalar(matrix, vb, first, last, out);
+  });
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstddef>
+
+// Projects points through 4x4 matrices, given column-major as R stores them,
+// dividing the result by its w. Every point is transformed with the same
+// operations in the same order whichever instruction set is used, so the
+// results don't depend on the CPU or the number of threads. Output may alias
+// the input
+
+// Points as separate x, y, and z columns with a w of 1
+void project_columns(const double* matrix, const double* x, const double* y, const double* z,
+                     size_t n, double* px, double* py, double* pz, size_t n_threads);
+// Points as the columns of a 4 x n matrix such as the vb of a mesh, taking their
+// w into account. The projected points get a w of 1
+void project_vertices(const double* matrix, const double* vb, size_t n, double* out,
+                      size_t n_threads);
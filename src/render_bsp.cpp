@@ -1,8 +1,17 @@
 #include "geometry.h"
 #include "bsp.h"
+#include "task_pool.h"
+#include "coalesce.h"
+#include "outline.h"
+#include "projection.h"
+#include "bsp_file.h"
+#include "mesh_file.h"
+#include "adjacency.h"
 #include <vector>
 #include <algorithm>
 #include <random>
+#include <string>
+#include <chrono>
 #include <cpp11/doubles.hpp>
 #include <cpp11/logicals.hpp>
 #include <cpp11/integers.hpp>
@@ -10,182 +19,1059 @@
 #include <cpp11/matrix.hpp>
 #include <cpp11/list.hpp>
 #include <cpp11/named_arg.hpp>
+#include <cpp11/raws.hpp>
+#include <cpp11/strings.hpp>
+#include <cpp11/external_pointer.hpp>
+#include <memory>
 
 using namespace cpp11::literals;
 
-[[cpp11::register]]
-cpp11::writable::data_frame illuminate_mesh_c(
-    cpp11::doubles_matrix vert, cpp11::integers_matrix tri,
-    cpp11::doubles luminance,
-    cpp11::doubles xl, cpp11::doubles yl, cpp11::doubles zl,
-    cpp11::doubles intensity) {
-  std::vector<triangle> triangles;
+bsp::BuildStrategy as_build_strategy(const std::string& strategy) {
+  if (strategy == "first") return bsp::FIRST;
+  if (strategy == "sample") return bsp::SAMPLE;
+  if (strategy == "thorough") return bsp::THOROUGH;
+  cpp11::stop("Unknown build strategy: %s", strategy.c_str());
+}
+
+bool is_single_precision(const std::string& precision) {
+  if (precision == "double") return false;
+  if (precision == "single") return true;
+  cpp11::stop("Unknown precision: %s", precision.c_str());
+}
+
+template <typename T>
+struct prepared_tree {
+  bsp_t<T> tree;
+  point_t<T> origin;
+};
+
+// A BSP tree kept alive between calls from R. The tree itself is never cut;
+// every query works on a copy that shares the tree structure. Only the tree
+// matching the precision the mesh was prepared with is set
+struct prepared_mesh {
+  std::unique_ptr<prepared_tree<double> > tree_double;
+  std::unique_ptr<prepared_tree<float> > tree_single;
+};
+
+// Fills the pool with the vertices of the mesh and the list with triangles
+// indexing into it, so vertices shared in the mesh are shared in the tree too.
+// Triangles are numbered from first_id in the order of the mesh
+template <typename T>
+void triangles_from_mesh(const cpp11::doubles_matrix& vert, const cpp11::integers_matrix& tri,
+                         const cpp11::doubles& luminance, vertex_pool_t<T>& vertices,
+                         std::vector<indexed_triangle_t<T> >& triangles, int first_id = 1) {
+  typedef point_t<T> point;
+  typedef indexed_triangle_t<T> indexed_triangle;
+  vertices.clear();
+  vertices.reserve(vert.ncol());
+  for (int i = 0; i < vert.ncol(); ++i) {
+    vertices.add(point(vert(0, i), vert(1, i), vert(2, i)));
+  }
+  triangles.clear();
+  triangles.reserve(tri.ncol());
 
   for (int i = 0; i < tri.ncol(); ++i) {
-    int f_p = tri(0, i) - 1;
-    int s_p = tri(1, i) - 1;
-    int t_p = tri(2, i) - 1;
-    triangle t({
-      point(vert(0, f_p), vert(1, f_p), vert(2, f_p)),
-      point(vert(0, s_p), vert(1, s_p), vert(2, s_p)),
-      point(vert(0, t_p), vert(1, t_p), vert(2, t_p)),
-      i + 1,
-      luminance[i]
-    });
+    indexed_triangle t = vertices.make_triangle(
+      tri(0, i) - 1,
+      tri(1, i) - 1,
+      tri(2, i) - 1,
+      first_id + i,
+      T(luminance.size() == 0 ? 0.0 : luminance[i])
+    );
     if (t.is_valid()) {
       triangles.push_back(t);
     }
   }
 
   std::shuffle(triangles.begin(), triangles.end(), std::default_random_engine(1));
+}
 
-  bsp tree(triangles);
-  for (int i = 0; i < xl.size(); ++i) {
-    tree.shine_light(point(xl[i], yl[i], zl[i]), intensity[i]);
+// As above but from the vertices and corners filled in by read_mesh_file(),
+// with every triangle unlit
+template <typename T>
+void triangles_from_file(const std::vector<double>& coords, const std::vector<int>& corners,
+                         vertex_pool_t<T>& vertices,
+                         std::vector<indexed_triangle_t<T> >& triangles) {
+  typedef point_t<T> point;
+  typedef indexed_triangle_t<T> indexed_triangle;
+  vertices.clear();
+  vertices.reserve(coords.size() / 4);
+  for (size_t i = 0; i + 3 < coords.size(); i += 4) {
+    vertices.add(point(coords[i], coords[i + 1], coords[i + 2]));
   }
-
   triangles.clear();
-  tree.near_to_far(point(tri(0, 0), tri(1, 0), tri(2, 0)), triangles);
-
-  int full_length = triangles.size() * 3;
-  cpp11::writable::doubles x_new;
-  x_new.reserve(full_length);
-  cpp11::writable::doubles y_new;
-  y_new.reserve(full_length);
-  cpp11::writable::doubles z_new;
-  z_new.reserve(full_length);
-  cpp11::writable::integers id;
-  id.reserve(full_length);
-  cpp11::writable::doubles light;
-  light.reserve(full_length);
+  triangles.reserve(corners.size() / 3);
+
+  for (size_t i = 0; i + 2 < corners.size(); i += 3) {
+    indexed_triangle t = vertices.make_triangle(
+      corners[i] - 1,
+      corners[i + 1] - 1,
+      corners[i + 2] - 1,
+      i / 3 + 1
+    );
+    if (t.is_valid()) {
+      triangles.push_back(t);
+    }
+  }
+
+  std::shuffle(triangles.begin(), triangles.end(), std::default_random_engine(1));
+}
+
+// Wall-clock time spent in the phases of a call, in milliseconds. A disabled
+// timer never reads the clock. Phases timed more than once, e.g. once per
+// view, are summed
+class phase_timer {
+  typedef std::chrono::steady_clock clock;
+  bool enabled;
+  clock::time_point last;
+  std::vector<std::string> phases;
+  std::vector<double> elapsed;
+
+  void add(const std::string& phase, double ms) {
+    auto found = std::find(phases.begin(), phases.end(), phase);
+    if (found == phases.end()) {
+      phases.push_back(phase);
+      elapsed.push_back(ms);
+    } else {
+      elapsed[found - phases.begin()] += ms;
+    }
+  }
+public:
+  explicit phase_timer(bool enabled = false) : enabled(enabled) {
+    restart();
+  }
+  bool is_enabled() const { return enabled; }
+  void restart() {
+    if (enabled) last = clock::now();
+  }
+  // Ends the running phase and starts the next one
+  void lap(const std::string& phase) {
+    if (!enabled) return;
+    clock::time_point now = clock::now();
+    add(phase, std::chrono::duration<double, std::milli>(now - last).count());
+    last = now;
+  }
+  void add(const phase_timer& timer) {
+    for (size_t i = 0; i < timer.phases.size(); ++i) {
+      add(timer.phases[i], timer.elapsed[i]);
+    }
+  }
+  cpp11::writable::doubles as_doubles() const {
+    cpp11::writable::doubles ms(elapsed.begin(), elapsed.end());
+    ms.attr("names") = cpp11::writable::strings(phases.begin(), phases.end());
+    return ms;
+  }
+};
 
+// The triangles of a cut tree in drawing order along with the vertices they
+// index into. The shape of the tree, the work it did and the time it took are
+// only filled in when statistics are asked for
+template <typename T>
+struct tree_mesh {
+  vertex_pool_t<T> vertices;
+  std::vector<indexed_triangle_t<T> > triangles;
+  phase_timer timer;
+  size_t nodes = 0;
+  size_t depth = 0;
+  bsp_stats stats;
+
+  void describe(const bsp_t<T>& tree) {
+    if (!timer.is_enabled()) return;
+    nodes = tree.node_count();
+    depth = tree.depth();
+    stats = tree.stats();
+  }
+};
+
+// The statistics of a call, returned to R as the "stats" attribute of the
+// result when asked for. Trees are described per view (once for illumination)
+// while the timings of phases run per view are summed over the views, so with
+// several threads they can add up to more than the time of the call
+class engine_stats {
+  std::vector<double> nodes;
+  std::vector<double> depth;
+  std::vector<double> build_splits;
+  std::vector<double> shadow_splits;
+  std::vector<double> shadow_nodes;
+  std::vector<double> covered;
+  std::vector<double> fragments;
+public:
+  phase_timer timer;
+
+  explicit engine_stats(bool enabled) : timer(enabled) {}
+  bool is_enabled() const { return timer.is_enabled(); }
+  template <typename T>
+  void add(const tree_mesh<T>& mesh) {
+    if (!is_enabled()) return;
+    timer.add(mesh.timer);
+    timer.restart();
+    nodes.push_back(mesh.nodes);
+    depth.push_back(mesh.depth);
+    build_splits.push_back(mesh.stats.build_splits);
+    shadow_splits.push_back(mesh.stats.shadow_splits);
+    shadow_nodes.insert(shadow_nodes.end(), mesh.stats.shadow_nodes.begin(),
+                        mesh.stats.shadow_nodes.end());
+    covered.push_back(mesh.stats.covered);
+    fragments.push_back(mesh.triangles.size());
+  }
+  cpp11::writable::list attach(cpp11::writable::list result) const {
+    if (!is_enabled()) return result;
+    result.attr("stats") = cpp11::writable::list({
+      "timings"_nm = timer.as_doubles(),
+      "nodes"_nm = cpp11::writable::doubles(nodes.begin(), nodes.end()),
+      "depth"_nm = cpp11::writable::doubles(depth.begin(), depth.end()),
+      "build_splits"_nm = cpp11::writable::doubles(build_splits.begin(), build_splits.end()),
+      "shadow_splits"_nm = cpp11::writable::doubles(shadow_splits.begin(), shadow_splits.end()),
+      "shadow_nodes"_nm = cpp11::writable::doubles(shadow_nodes.begin(), shadow_nodes.end()),
+      "covered"_nm = cpp11::writable::doubles(covered.begin(), covered.end()),
+      "fragments"_nm = cpp11::writable::doubles(fragments.begin(), fragments.end())
+    });
+    return result;
+  }
+};
+
+// Writes the corners of the triangles as a 1-based 3-row index matrix. Only the
+// vertices in use are kept and they are numbered in order of first use. used
+// receives their indices into the pool in the same order
+template <typename T>
+cpp11::writable::integers index_matrix(const std::vector<indexed_triangle_t<T> >& triangles,
+                                       size_t n_vertices, std::vector<uint32_t>& used) {
+  std::vector<int> number(n_vertices, 0);
+  cpp11::writable::integers indices(triangles.size() * 3);
+  int* index = INTEGER(indices);
   for (auto it = triangles.begin(); it != triangles.end(); ++it) {
-    x_new.push_back(it->a().x);
-    y_new.push_back(it->a().y);
-    z_new.push_back(it->a().z);
-    x_new.push_back(it->b().x);
-    y_new.push_back(it->b().y);
-    z_new.push_back(it->b().z);
-    x_new.push_back(it->c().x);
-    y_new.push_back(it->c().y);
-    z_new.push_back(it->c().z);
-    id.push_back(it->id());
-    id.push_back(it->id());
-    id.push_back(it->id());
-    light.push_back(it->light());
-    light.push_back(it->light());
-    light.push_back(it->light());
-  }
-  return cpp11::writable::data_frame({
-    "x"_nm = x_new,
-    "y"_nm = y_new,
-    "z"_nm = z_new,
+    for (int i = 0; i < 3; ++i) {
+      uint32_t v = (*it)[i];
+      if (number[v] == 0) {
+        used.push_back(v);
+        number[v] = used.size();
+      }
+      *index++ = number[v];
+    }
+  }
+  indices.attr("dim") = cpp11::writable::integers({3, (int) triangles.size()});
+  return indices;
+}
+
+// The used vertices as a homogeneous 4-row matrix in the layout of a trimesh
+template <typename T>
+cpp11::writable::doubles vertex_matrix(const vertex_pool_t<T>& vertices,
+                                       const std::vector<uint32_t>& used) {
+  cpp11::writable::doubles coords(used.size() * 4);
+  double* coord = REAL(coords);
+  for (auto it = used.begin(); it != used.end(); ++it) {
+    const point_t<T>& p = vertices[*it];
+    *coord++ = p.x;
+    *coord++ = p.y;
+    *coord++ = p.z;
+    *coord++ = 1.0;
+  }
+  coords.attr("dim") = cpp11::writable::integers({4, (int) used.size()});
+  return coords;
+}
+
+template <typename T>
+cpp11::writable::list illumination_mesh(const tree_mesh<T>& mesh) {
+  std::vector<uint32_t> used;
+  cpp11::writable::integers indices = index_matrix(mesh.triangles, mesh.vertices.size(), used);
+  cpp11::writable::doubles coords = vertex_matrix(mesh.vertices, used);
+
+  R_xlen_t n = mesh.triangles.size();
+  cpp11::writable::integers id(n);
+  cpp11::writable::doubles light(n);
+  int* id_p = INTEGER(id);
+  double* light_p = REAL(light);
+  for (R_xlen_t i = 0; i < n; ++i) {
+    id_p[i] = mesh.triangles[i].id();
+    light_p[i] = mesh.triangles[i].light();
+  }
+  return cpp11::writable::list({
+    "vb"_nm = coords,
+    "it"_nm = indices,
     "id"_nm = id,
     "luminance"_nm = light
   });
 }
 
+template <typename T>
+cpp11::writable::list occlusion_mesh(const tree_mesh<T>& mesh) {
+  std::vector<uint32_t> used;
+  cpp11::writable::integers indices = index_matrix(mesh.triangles, mesh.vertices.size(), used);
+  cpp11::writable::doubles coords = vertex_matrix(mesh.vertices, used);
+
+  R_xlen_t n = mesh.triangles.size();
+  cpp11::writable::integers id(n);
+  cpp11::writable::logicals visible(n);
+  cpp11::writable::logicals back_facing(n);
+  int* id_p = INTEGER(id);
+  int* visible_p = LOGICAL(visible);
+  int* back_facing_p = LOGICAL(back_facing);
+  for (R_xlen_t i = 0; i < n; ++i) {
+    id_p[i] = mesh.triangles[i].id();
+    visible_p[i] = mesh.triangles[i].is_visible();
+    back_facing_p[i] = mesh.triangles[i].is_back_facing();
+  }
+  return cpp11::writable::list({
+    "vb"_nm = coords,
+    "it"_nm = indices,
+    "id"_nm = id,
+    "visible"_nm = visible,
+    "back_facing"_nm = back_facing
+  });
+}
+
+prepared_mesh& get_prepared(SEXP prepared) {
+  cpp11::external_pointer<prepared_mesh> ptr(prepared);
+  if (ptr.get() == nullptr) {
+    cpp11::stop("The prepared mesh is no longer valid. Prepared meshes must be saved with save_prepared() to be used again");
+  }
+  return *ptr;
+}
+
+// The ways of cutting a tree that give up exactness for speed, as chosen from
+// R. Every one is off unless asked for, so by default the result is exact
+struct engine_modes {
+  // Skip triangles found hidden by the coverage cube, on meshes large enough
+  // for it to pay off
+  bool coverage = false;
+  // Cut a single view in slices around it that are occluded on separate
+  // threads. Triangles are split along the borders of the slices, so the
+  // fragments follow the number of threads
+  bool slices = false;
+  // The triangles across the edges of the mesh, for building shadow volumes
+  // from silhouette edges. Left empty to add the planes of every triangle
+  std::shared_ptr<const std::vector<int> > neighbours;
+
+  template <typename T>
+  void apply(bsp_t<T>& tree) const {
+    tree.set_coverage(coverage ? bsp_types::COVERAGE_AUTO : bsp_types::COVERAGE_OFF);
+    tree.set_neighbours(neighbours);
+  }
+};
+
+// The neighbours of the triangles of a mesh, numbered from 1 in its order
+std::shared_ptr<const std::vector<int> > mesh_neighbours(const cpp11::integers_matrix& tri) {
+  std::vector<int> corners(3 * size_t(tri.ncol()));
+  for (int i = 0; i < tri.ncol(); ++i) {
+    for (int k = 0; k < 3; ++k) {
+      corners[3 * size_t(i) + k] = tri(k, i);
+    }
+  }
+  std::shared_ptr<std::vector<int> > neighbours = std::make_shared<std::vector<int> >();
+  find_neighbours(corners.data(), tri.ncol(), 1, *neighbours);
+  return neighbours;
+}
+
+// The lights to illuminate a mesh with. Area lights are kept apart as they are
+// added to the triangles without splitting them
+template <typename T>
+struct light_set {
+  std::vector<point_t<T> > points;
+  std::vector<T> intensity;
+  std::vector<area_light_t<T> > areas;
+  std::vector<T> area_intensity;
+};
+
+// spans holds the half-axes of every light as u and v, with a light only being
+// an area light if it has samples and some extent. probes holds the side of the
+// lattice of probes of every light. An empty spans matrix means there are only
+// point lights
+template <typename T>
+light_set<T> lights_from_coords(const cpp11::doubles& xl, const cpp11::doubles& yl,
+                                const cpp11::doubles& zl, const cpp11::doubles& intensity,
+                                const cpp11::doubles_matrix& spans, const cpp11::logicals& disk,
+                                const cpp11::integers& samples, const cpp11::integers& probes) {
+  typedef vec3_t<T> vec3;
+  light_set<T> lights;
+  for (int i = 0; i < xl.size(); ++i) {
+    point_t<T> position(xl[i], yl[i], zl[i]);
+    if (spans.nrow() != 0 && samples[i] > 0) {
+      vec3 u(spans(i, 0), spans(i, 1), spans(i, 2));
+      vec3 v(spans(i, 3), spans(i, 4), spans(i, 5));
+      if (u.length() > 0 || v.length() > 0) {
+        lights.areas.push_back(area_light_t<T>(
+          position, u, v,
+          disk[i] == TRUE ? area_light_t<T>::DISK : area_light_t<T>::QUAD, samples[i],
+          probes[i]
+        ));
+        lights.area_intensity.push_back(intensity[i]);
+        continue;
+      }
+    }
+    lights.points.push_back(position);
+    lights.intensity.push_back(intensity[i]);
+  }
+  return lights;
+}
+
+template <typename T>
+tree_mesh<T> illuminate_tree(bsp_t<T> tree, const point_t<T>& origin,
+                             const light_set<T>& lights, bool merge_lights, bool coalesce,
+                             const engine_modes& modes, int threads, bool report) {
+  tree_mesh<T> result;
+  result.timer = phase_timer(report);
+  modes.apply(tree);
+  if (merge_lights) {
+    if (!lights.points.empty()) {
+      tree.shine_lights(lights.points, lights.intensity, threads);
+    }
+  } else {
+    for (size_t i = 0; i < lights.points.size(); ++i) {
+      tree.shine_light(lights.points[i], lights.intensity[i]);
+    }
+  }
+  for (size_t i = 0; i < lights.areas.size(); ++i) {
+    tree.shine_area_light(lights.areas[i], lights.area_intensity[i], threads);
+  }
+  result.timer.lap("cut");
+
+  tree.near_to_far(origin, result.triangles);
+  result.vertices = tree.pool();
+  result.timer.lap("sort");
+  if (coalesce) {
+    coalesce_fragments(result.vertices, result.triangles, threads);
+    result.timer.lap("coalesce");
+  }
+  result.describe(tree);
+  return result;
+}
+
+template <typename T>
+cpp11::writable::list illumination_result(const tree_mesh<T>& mesh, engine_stats& stats) {
+  stats.add(mesh);
+  cpp11::writable::list result = illumination_mesh(mesh);
+  stats.timer.lap("marshal");
+  return stats.attach(result);
+}
+
+template <typename T>
+prepared_tree<T>* prepare_tree(const cpp11::doubles_matrix& vert,
+                               const cpp11::integers_matrix& tri,
+                               const cpp11::doubles& luminance,
+                               const std::string& build_strategy, int threads) {
+  vertex_pool_t<T> vertices;
+  std::vector<indexed_triangle_t<T> > triangles;
+  triangles_from_mesh(vert, tri, luminance, vertices, triangles);
+
+  prepared_tree<T>* prepared = new prepared_tree<T>();
+  prepared->tree.build_tree(vertices, triangles, as_build_strategy(build_strategy), threads);
+  prepared->origin = point_t<T>(tri(0, 0), tri(1, 0), tri(2, 0));
+  return prepared;
+}
+
 [[cpp11::register]]
-cpp11::writable::data_frame occlude_mesh_c(
+SEXP prepare_mesh_c(cpp11::doubles_matrix vert, cpp11::integers_matrix tri,
+                    cpp11::doubles luminance, std::string build_strategy,
+                    std::string precision, int threads) {
+  threads = thread_count(threads);
+  prepared_mesh* prepared = new prepared_mesh();
+  if (is_single_precision(precision)) {
+    prepared->tree_single.reset(prepare_tree<float>(vert, tri, luminance, build_strategy, threads));
+  } else {
+    prepared->tree_double.reset(prepare_tree<double>(vert, tri, luminance, build_strategy, threads));
+  }
+  return cpp11::external_pointer<prepared_mesh>(prepared);
+}
+
+template <typename T>
+prepared_tree<T>* prepare_file_tree(const std::vector<double>& coords,
+                                    const std::vector<int>& corners,
+                                    const std::string& build_strategy, int threads) {
+  vertex_pool_t<T> vertices;
+  std::vector<indexed_triangle_t<T> > triangles;
+  triangles_from_file(coords, corners, vertices, triangles);
+
+  prepared_tree<T>* prepared = new prepared_tree<T>();
+  prepared->tree.build_tree(vertices, triangles, as_build_strategy(build_strategy), threads);
+  prepared->origin = point_t<T>(corners[0], corners[1], corners[2]);
+  return prepared;
+}
+
+// Reads a mesh file and prepares it in one go. The tree is built from what was
+// read before the vertices and triangles are handed over to R, so the mesh
+// doesn't have to come back from R to be prepared
+[[cpp11::register]]
+cpp11::list read_mesh_prepared_c(std::string path, std::string build_strategy,
+                                 std::string precision, int threads) {
+  threads = thread_count(threads);
+  std::vector<double> coords;
+  std::vector<int> corners;
+  read_mesh_file(path, threads, coords, corners);
+  if (corners.empty()) {
+    cpp11::stop("The file %s has no triangles to prepare", path.c_str());
+  }
+
+  std::unique_ptr<prepared_mesh> prepared(new prepared_mesh());
+  if (is_single_precision(precision)) {
+    prepared->tree_single.reset(prepare_file_tree<float>(coords, corners, build_strategy, threads));
+  } else {
+    prepared->tree_double.reset(prepare_file_tree<double>(coords, corners, build_strategy, threads));
+  }
+
+  cpp11::writable::doubles vertices(coords.size());
+  std::copy(coords.begin(), coords.end(), REAL(vertices));
+  std::vector<double>().swap(coords);
+  cpp11::writable::integers triangles(corners.size());
+  std::copy(corners.begin(), corners.end(), INTEGER(triangles));
+  std::vector<int>().swap(corners);
+
+  vertices.attr("class") = {"matrix", "array"};
+  vertices.attr("dim") = cpp11::writable::integers({4, (int) (vertices.size() / 4)});
+  triangles.attr("class") = {"matrix", "array"};
+  triangles.attr("dim") = cpp11::writable::integers({3, (int) (triangles.size() / 3)});
+
+  return cpp11::writable::list({
+    "vertices"_nm = vertices,
+    "triangles"_nm = triangles,
+    "tree"_nm = cpp11::external_pointer<prepared_mesh>(prepared.release())
+  });
+}
+
+// Prepared meshes are never changed in place. Inserting and removing geometry
+// works on a copy of the tree, which shares the structure of the original
+// until it is changed
+template <typename T>
+prepared_tree<T>* insert_tree(const prepared_tree<T>& prepared,
+                              const cpp11::doubles_matrix& vert,
+                              const cpp11::integers_matrix& tri,
+                              const cpp11::doubles& luminance, int first_id,
+                              const std::string& build_strategy) {
+  vertex_pool_t<T> vertices;
+  std::vector<indexed_triangle_t<T> > triangles;
+  triangles_from_mesh(vert, tri, luminance, vertices, triangles, first_id);
+
+  prepared_tree<T>* updated = new prepared_tree<T>(prepared);
+  updated->tree.insert(vertices, triangles, as_build_strategy(build_strategy));
+  return updated;
+}
+
+template <typename T>
+prepared_tree<T>* remove_tree(const prepared_tree<T>& prepared, const cpp11::integers& ids,
+                              const std::string& build_strategy) {
+  std::vector<int> sorted(ids.begin(), ids.end());
+  std::sort(sorted.begin(), sorted.end());
+
+  prepared_tree<T>* updated = new prepared_tree<T>(prepared);
+  updated->tree.remove(sorted, as_build_strategy(build_strategy));
+  return updated;
+}
+
+[[cpp11::register]]
+SEXP prepared_insert_c(SEXP prepared, cpp11::doubles_matrix vert, cpp11::integers_matrix tri,
+                       cpp11::doubles luminance, int first_id, std::string build_strategy) {
+  prepared_mesh& mesh = get_prepared(prepared);
+  prepared_mesh* updated = new prepared_mesh();
+  if (mesh.tree_single) {
+    updated->tree_single.reset(insert_tree(*mesh.tree_single, vert, tri, luminance, first_id,
+                                           build_strategy));
+  } else {
+    updated->tree_double.reset(insert_tree(*mesh.tree_double, vert, tri, luminance, first_id,
+                                           build_strategy));
+  }
+  return cpp11::external_pointer<prepared_mesh>(updated);
+}
+
+[[cpp11::register]]
+SEXP prepared_remove_c(SEXP prepared, cpp11::integers ids, std::string build_strategy) {
+  prepared_mesh& mesh = get_prepared(prepared);
+  prepared_mesh* updated = new prepared_mesh();
+  if (mesh.tree_single) {
+    updated->tree_single.reset(remove_tree(*mesh.tree_single, ids, build_strategy));
+  } else {
+    updated->tree_double.reset(remove_tree(*mesh.tree_double, ids, build_strategy));
+  }
+  return cpp11::external_pointer<prepared_mesh>(updated);
+}
+
+// The R side of a prepared mesh is kept as a serialized payload in the file
+[[cpp11::register]]
+void save_prepared_c(SEXP prepared, std::string path, cpp11::raws payload) {
+  prepared_mesh& mesh = get_prepared(prepared);
+  const unsigned char* bytes = RAW(payload);
+  if (mesh.tree_single) {
+    write_tree_file(path, mesh.tree_single->tree, mesh.tree_single->origin, bytes, payload.size());
+  } else {
+    write_tree_file(path, mesh.tree_double->tree, mesh.tree_double->origin, bytes, payload.size());
+  }
+}
+
+[[cpp11::register]]
+cpp11::list read_prepared_c(std::string path) {
+  mapped_file file(path);
+  std::unique_ptr<prepared_mesh> prepared(new prepared_mesh());
+  const unsigned char* payload = nullptr;
+  size_t payload_size = 0;
+  if (tree_file_scalar_size(file) == sizeof(float)) {
+    prepared->tree_single.reset(new prepared_tree<float>());
+    read_tree_file(file, prepared->tree_single->tree, prepared->tree_single->origin,
+                   payload, payload_size);
+  } else {
+    prepared->tree_double.reset(new prepared_tree<double>());
+    read_tree_file(file, prepared->tree_double->tree, prepared->tree_double->origin,
+                   payload, payload_size);
+  }
+  cpp11::writable::raws bytes(payload_size);
+  std::copy(payload, payload + payload_size, RAW(bytes));
+  return cpp11::writable::list({
+    "tree"_nm = cpp11::external_pointer<prepared_mesh>(prepared.release()),
+    "payload"_nm = bytes
+  });
+}
+
+template <typename T>
+cpp11::writable::list illuminate_mesh_impl(
+    const cpp11::doubles_matrix& vert, const cpp11::integers_matrix& tri,
+    const cpp11::doubles& luminance,
+    const cpp11::doubles& xl, const cpp11::doubles& yl, const cpp11::doubles& zl,
+    const cpp11::doubles& intensity, const cpp11::doubles_matrix& spans,
+    const cpp11::logicals& disk, const cpp11::integers& samples, const cpp11::integers& probes,
+    bool merge_lights, bool coalesce, const engine_modes& modes,
+    const std::string& build_strategy, int threads, engine_stats& stats) {
+  vertex_pool_t<T> vertices;
+  std::vector<indexed_triangle_t<T> > triangles;
+  triangles_from_mesh(vert, tri, luminance, vertices, triangles);
+  light_set<T> lights = lights_from_coords<T>(xl, yl, zl, intensity, spans, disk, samples,
+                                              probes);
+  stats.timer.lap("ingest");
+
+  bsp_t<T> tree(vertices, triangles, as_build_strategy(build_strategy), threads);
+  stats.timer.lap("build");
+  return illumination_result(illuminate_tree(std::move(tree),
+                                             point_t<T>(tri(0, 0), tri(1, 0), tri(2, 0)),
+                                             lights, merge_lights, coalesce, modes, threads,
+                                             stats.is_enabled()),
+                             stats);
+}
+
+[[cpp11::register]]
+cpp11::writable::list illuminate_mesh_c(
     cpp11::doubles_matrix vert, cpp11::integers_matrix tri,
-    double xv, double yv, double zv) {
-  std::vector<triangle> triangles;
+    cpp11::doubles luminance,
+    cpp11::doubles xl, cpp11::doubles yl, cpp11::doubles zl,
+    cpp11::doubles intensity, cpp11::doubles_matrix spans, cpp11::logicals disk,
+    cpp11::integers samples, cpp11::integers probes, bool merge_lights, bool coalesce,
+    bool coverage, bool silhouettes, std::string build_strategy, std::string precision,
+    int threads, bool stats) {
+  threads = thread_count(threads);
+  engine_stats report(stats);
+  engine_modes modes;
+  modes.coverage = coverage;
+  if (silhouettes) modes.neighbours = mesh_neighbours(tri);
+  if (is_single_precision(precision)) {
+    return illuminate_mesh_impl<float>(vert, tri, luminance, xl, yl, zl, intensity, spans,
+                                       disk, samples, probes, merge_lights, coalesce, modes,
+                                       build_strategy, threads, report);
+  }
+  return illuminate_mesh_impl<double>(vert, tri, luminance, xl, yl, zl, intensity, spans,
+                                      disk, samples, probes, merge_lights, coalesce, modes,
+                                      build_strategy, threads, report);
+}
 
-  for (int i = 0; i < tri.ncol(); ++i) {
-    int f_p = tri(0, i) - 1;
-    int s_p = tri(1, i) - 1;
-    int t_p = tri(2, i) - 1;
-    triangle t({
-      point(vert(0, f_p), vert(1, f_p), vert(2, f_p)),
-      point(vert(0, s_p), vert(1, s_p), vert(2, s_p)),
-      point(vert(0, t_p), vert(1, t_p), vert(2, t_p)),
-      i + 1
-    });
-    if (t.is_valid()) {
-      triangles.push_back(t);
+[[cpp11::register]]
+cpp11::writable::list illuminate_prepared_c(
+    SEXP prepared,
+    cpp11::doubles xl, cpp11::doubles yl, cpp11::doubles zl,
+    cpp11::doubles intensity, cpp11::doubles_matrix spans, cpp11::logicals disk,
+    cpp11::integers samples, cpp11::integers probes, bool merge_lights, bool coalesce,
+    bool coverage, cpp11::integers_matrix tri, bool silhouettes, int threads, bool stats) {
+  threads = thread_count(threads);
+  prepared_mesh& mesh = get_prepared(prepared);
+  engine_stats report(stats);
+  engine_modes modes;
+  modes.coverage = coverage;
+  if (silhouettes) modes.neighbours = mesh_neighbours(tri);
+
+  if (mesh.tree_single) {
+    return illumination_result(
+      illuminate_tree(mesh.tree_single->tree, mesh.tree_single->origin,
+                      lights_from_coords<float>(xl, yl, zl, intensity, spans, disk, samples,
+                                                probes),
+                      merge_lights, coalesce, modes, threads, stats),
+      report
+    );
+  }
+  return illumination_result(
+    illuminate_tree(mesh.tree_double->tree, mesh.tree_double->origin,
+                    lights_from_coords<double>(xl, yl, zl, intensity, spans, disk, samples,
+                                               probes),
+                    merge_lights, coalesce, modes, threads, stats),
+    report
+  );
+}
+
+// A viewpoint along with the part of space it can see
+template <typename T>
+struct view_spec {
+  point_t<T> from;
+  frustum_t<T> cone;
+};
+
+template <typename T>
+std::vector<view_spec<T> > views_from_coords(const cpp11::doubles& xv, const cpp11::doubles& yv,
+                                             const cpp11::doubles& zv, const cpp11::doubles& xt,
+                                             const cpp11::doubles& yt, const cpp11::doubles& zt,
+                                             double fov) {
+  std::vector<view_spec<T> > views;
+  for (int i = 0; i < xv.size(); ++i) {
+    view_spec<T> view;
+    view.from = point_t<T>(xv[i], yv[i], zv[i]);
+    if (xt.size() != 0) {
+      view.cone = frustum_t<T>(view.from, point_t<T>(xt[i], yt[i], zt[i]), fov);
     }
+    views.push_back(view);
   }
+  return views;
+}
 
-  std::shuffle(triangles.begin(), triangles.end(), std::default_random_engine(1));
+// view_threads is the number of threads for coalescing the fragments and, with
+// slices, for cutting the tree. It is only above one when there is a single
+// view to use them
+template <typename T>
+tree_mesh<T> occlude_tree(bsp_t<T> tree, const view_spec<T>& view, bool coalesce,
+                          const engine_modes& modes, size_t view_threads, bool report) {
+  tree_mesh<T> result;
+  result.timer = phase_timer(report);
+  modes.apply(tree);
+  tree.look_from(view.from, view.cone, modes.slices ? view_threads : 1);
+  result.timer.lap("cut");
 
-  bsp tree(triangles);
-  tree.look_from(point(xv, yv, zv));
+  tree.near_to_far(view.from, result.triangles);
+  result.vertices = tree.pool();
+  result.timer.lap("sort");
+  if (coalesce) {
+    coalesce_fragments(result.vertices, result.triangles, view_threads);
+    result.timer.lap("coalesce");
+  }
+  result.describe(tree);
+  return result;
+}
 
-  triangles.clear();
-  tree.near_to_far(point(xv, yv, zv), triangles);
-
-  int full_length = triangles.size() * 3;
-  cpp11::writable::doubles x_new;
-  x_new.reserve(full_length);
-  cpp11::writable::doubles y_new;
-  y_new.reserve(full_length);
-  cpp11::writable::doubles z_new;
-  z_new.reserve(full_length);
-  cpp11::writable::integers id;
-  id.reserve(full_length);
-  cpp11::writable::logicals visible;
-  visible.reserve(full_length);
-  cpp11::writable::logicals back_facing;
-  back_facing.reserve(full_length);
+// Moves triangles that can't be seen from the view out of the list before the
+// tree is built. They are marked the same way as they would be by the tree
+template <typename T>
+void cull_triangles(std::vector<indexed_triangle_t<T> >& triangles,
+                    const vertex_pool_t<T>& vertices, const view_spec<T>& view,
+                    bool cull_back_faces, std::vector<indexed_triangle_t<T> >& culled) {
+  auto kept = triangles.begin();
+  for (auto iter = triangles.begin(); iter != triangles.end(); ++iter) {
+    bool back_facing = iter->normal().dot(view.from - vertices[(*iter)[0]]) < 0;
+    if (!view.cone.is_empty() &&
+        view.cone.is_outside(vertices[(*iter)[0]], vertices[(*iter)[1]], vertices[(*iter)[2]])) {
+      culled.push_back(*iter);
+      culled.back().set_visibility(false);
+      culled.back().set_back_facing(back_facing);
+    } else if (cull_back_faces && back_facing) {
+      culled.push_back(*iter);
+      culled.back().set_back_facing(true);
+    } else {
+      *kept++ = *iter;
+    }
+  }
+  triangles.erase(kept, triangles.end());
+}
 
-  for (auto it = triangles.begin(); it != triangles.end(); ++it) {
-    x_new.push_back(it->a().x);
-    y_new.push_back(it->a().y);
-    z_new.push_back(it->a().z);
-    x_new.push_back(it->b().x);
-    y_new.push_back(it->b().y);
-    z_new.push_back(it->b().z);
-    x_new.push_back(it->c().x);
-    y_new.push_back(it->c().y);
-    z_new.push_back(it->c().z);
-    id.push_back(it->id());
-    id.push_back(it->id());
-    id.push_back(it->id());
-    visible.push_back( (Rboolean) it->is_visible());
-    visible.push_back( (Rboolean) it->is_visible());
-    visible.push_back( (Rboolean) it->is_visible());
-    back_facing.push_back( (Rboolean) it->is_back_facing());
-    back_facing.push_back( (Rboolean) it->is_back_facing());
-    back_facing.push_back( (Rboolean) it->is_back_facing());
-  }
-  return cpp11::writable::data_frame({
-    "x"_nm = x_new,
-    "y"_nm = y_new,
-    "z"_nm = z_new,
-    "id"_nm = id,
-    "visible"_nm = visible,
-    "back_facing"_nm = back_facing
+template <typename T>
+cpp11::writable::list occlusion_meshes(std::vector<tree_mesh<T> >& views, engine_stats& stats) {
+  for (size_t i = 0; i < views.size(); ++i) {
+    stats.add(views[i]);
+  }
+  cpp11::writable::list result(views.size());
+  for (size_t i = 0; i < views.size(); ++i) {
+    result[i] = occlusion_mesh(views[i]);
+    views[i] = tree_mesh<T>();
+  }
+  stats.timer.lap("marshal");
+  return stats.attach(result);
+}
+
+// Each view cuts its own copy of the tree so views can run on separate threads.
+// The results are converted to R objects afterwards on the main thread
+template <typename T>
+std::vector<tree_mesh<T> > occlude_views(const bsp_t<T>& tree,
+                                         const std::vector<view_spec<T> >& views,
+                                         bool coalesce, const engine_modes& modes, int threads,
+                                         bool report = false) {
+  std::vector<tree_mesh<T> > occluded(views.size());
+  size_t view_threads = views.size() == 1 ? threads : 1;
+  parallel_for(views.size(), threads, [&](size_t i) {
+    occluded[i] = occlude_tree(tree, views[i], coalesce, modes, view_threads, report);
+  });
+  return occluded;
+}
+
+// With culling each view gets its own tree built from the triangles it can
+// see. The culled triangles are added back at the end of the result. Their
+// corners are still valid as the tree only appends to the pool it is given
+template <typename T>
+std::vector<tree_mesh<T> > occlude_culled_views(const vertex_pool_t<T>& vertices,
+                                           const std::vector<indexed_triangle_t<T> >& triangles,
+                                           const std::vector<view_spec<T> >& views,
+                                           bool cull_back_faces, bool coalesce,
+                                           const engine_modes& modes,
+                                           bsp_types::BuildStrategy strategy, int threads,
+                                           bool report) {
+  std::vector<tree_mesh<T> > occluded(views.size());
+  size_t build_threads = views.size() == 1 ? threads : 1;
+  parallel_for(views.size(), threads, [&](size_t i) {
+    phase_timer timer(report);
+    std::vector<indexed_triangle_t<T> > visible = triangles;
+    std::vector<indexed_triangle_t<T> > culled;
+    cull_triangles(visible, vertices, views[i], cull_back_faces, culled);
+    vertex_pool_t<T> pool = vertices;
+    timer.lap("cull");
+    bsp_t<T> tree(pool, visible, strategy, build_threads);
+    timer.lap("build");
+    occluded[i] = occlude_tree(std::move(tree), views[i], coalesce, modes, build_threads,
+                               report);
+    occluded[i].triangles.insert(occluded[i].triangles.end(), culled.begin(), culled.end());
+    occluded[i].timer.add(timer);
   });
+  return occluded;
+}
+
+template <typename T>
+std::vector<tree_mesh<T> > occlude_mesh_impl(
+    const cpp11::doubles_matrix& vert, const cpp11::integers_matrix& tri,
+    const cpp11::doubles& xv, const cpp11::doubles& yv, const cpp11::doubles& zv,
+    const cpp11::doubles& xt, const cpp11::doubles& yt, const cpp11::doubles& zt,
+    double fov, bool cull_back_faces, bool coalesce, const engine_modes& modes,
+    const std::string& build_strategy, int threads, engine_stats& stats) {
+  vertex_pool_t<T> vertices;
+  std::vector<indexed_triangle_t<T> > triangles;
+  triangles_from_mesh(vert, tri, cpp11::doubles(), vertices, triangles);
+  std::vector<view_spec<T> > views = views_from_coords<T>(xv, yv, zv, xt, yt, zt, fov);
+  stats.timer.lap("ingest");
+
+  if (cull_back_faces || xt.size() != 0) {
+    return occlude_culled_views(vertices, triangles, views, cull_back_faces, coalesce, modes,
+                                as_build_strategy(build_strategy), threads,
+                                stats.is_enabled());
+  }
+
+  bsp_t<T> tree(vertices, triangles, as_build_strategy(build_strategy), threads);
+  stats.timer.lap("build");
+
+  return occlude_views(tree, views, coalesce, modes, threads, stats.is_enabled());
 }
 
 [[cpp11::register]]
-cpp11::writable::data_frame project_coords_c(
-    cpp11::doubles x, cpp11::doubles y, cpp11::doubles z,
-    double xv, double yv, double zv,
-    double xp, double yp, double zp) {
-
-  int full_length = x.size();
-  cpp11::writable::doubles x_new;
-  x_new.reserve(full_length);
-  cpp11::writable::doubles y_new;
-  y_new.reserve(full_length);
-  cpp11::writable::doubles z_new;
-  z_new.reserve(full_length);
-
-  vec3 n = vec3(xp - xv, yp - yv, zp - zv).normalize();
-  point v0(xp, yp, zp);
-  point l0(xv, yv, zv);
-  for (size_t i = 0; i < full_length; ++i) {
-    point coord(x[i], y[i], z[i]);
-    coord.project(l0, n, v0);
-    x_new.push_back(coord.x);
-    y_new.push_back(coord.y);
-    z_new.push_back(coord.z);
-  }
-
-  return cpp11::writable::data_frame({
-    "x"_nm = x_new,
-    "y"_nm = y_new,
-    "z"_nm = z_new
+cpp11::writable::list occlude_mesh_c(
+    cpp11::doubles_matrix vert, cpp11::integers_matrix tri,
+    cpp11::doubles xv, cpp11::doubles yv, cpp11::doubles zv,
+    cpp11::doubles xt, cpp11::doubles yt, cpp11::doubles zt, double fov,
+    bool cull_back_faces, bool coalesce, bool coverage, bool slices, bool silhouettes,
+    std::string build_strategy, std::string precision, int threads, bool stats) {
+  threads = thread_count(threads);
+  engine_stats report(stats);
+  engine_modes modes;
+  modes.coverage = coverage;
+  modes.slices = slices;
+  if (silhouettes) modes.neighbours = mesh_neighbours(tri);
+  if (is_single_precision(precision)) {
+    std::vector<tree_mesh<float> > occluded = occlude_mesh_impl<float>(
+      vert, tri, xv, yv, zv, xt, yt, zt, fov, cull_back_faces, coalesce, modes, build_strategy,
+      threads, report
+    );
+    return occlusion_meshes(occluded, report);
+  }
+  std::vector<tree_mesh<double> > occluded = occlude_mesh_impl<double>(
+    vert, tri, xv, yv, zv, xt, yt, zt, fov, cull_back_faces, coalesce, modes, build_strategy,
+    threads, report
+  );
+  return occlusion_meshes(occluded, report);
+}
+
+[[cpp11::register]]
+cpp11::writable::list occlude_prepared_c(SEXP prepared, cpp11::doubles xv,
+                                         cpp11::doubles yv, cpp11::doubles zv,
+                                         cpp11::doubles xt, cpp11::doubles yt,
+                                         cpp11::doubles zt, double fov, bool coalesce,
+                                         bool coverage, bool slices,
+                                         cpp11::integers_matrix tri, bool silhouettes,
+                                         int threads, bool stats) {
+  threads = thread_count(threads);
+  prepared_mesh& mesh = get_prepared(prepared);
+  engine_stats report(stats);
+  engine_modes modes;
+  modes.coverage = coverage;
+  modes.slices = slices;
+  if (silhouettes) modes.neighbours = mesh_neighbours(tri);
+
+  if (mesh.tree_single) {
+    std::vector<tree_mesh<float> > occluded = occlude_views(
+      mesh.tree_single->tree, views_from_coords<float>(xv, yv, zv, xt, yt, zt, fov), coalesce,
+      modes, threads, stats
+    );
+    return occlusion_meshes(occluded, report);
+  }
+  std::vector<tree_mesh<double> > occluded = occlude_views(
+    mesh.tree_double->tree, views_from_coords<double>(xv, yv, zv, xt, yt, zt, fov), coalesce,
+    modes, threads, stats
+  );
+  return occlusion_meshes(occluded, report);
+}
+
+// The visible lines of each view as a data frame with a row per point and a
+// `line` column numbering the polylines from 1. The lines are found in parallel
+// and converted to R objects afterwards on the main thread
+template <typename T>
+cpp11::writable::list outline_views(const std::vector<tree_mesh<T> >& occluded,
+                                    const std::vector<view_spec<T> >& views,
+                                    double crease_angle, int threads) {
+  std::vector<std::vector<std::vector<point_t<T> > > > lines(views.size());
+  parallel_for(views.size(), threads, [&](size_t i) {
+    visible_lines(occluded[i].vertices, occluded[i].triangles, views[i].from, T(crease_angle),
+                  lines[i]);
   });
+
+  cpp11::writable::list result(views.size());
+  for (size_t i = 0; i < views.size(); ++i) {
+    R_xlen_t n = 0;
+    for (auto it = lines[i].begin(); it != lines[i].end(); ++it) n += it->size();
+    cpp11::writable::doubles x(n);
+    cpp11::writable::doubles y(n);
+    cpp11::writable::doubles z(n);
+    cpp11::writable::integers line(n);
+    double* x_p = REAL(x);
+    double* y_p = REAL(y);
+    double* z_p = REAL(z);
+    int* line_p = INTEGER(line);
+    int number = 0;
+    for (auto it = lines[i].begin(); it != lines[i].end(); ++it) {
+      ++number;
+      for (auto p = it->begin(); p != it->end(); ++p) {
+        *x_p++ = p->x;
+        *y_p++ = p->y;
+        *z_p++ = p->z;
+        *line_p++ = number;
+      }
+    }
+    std::vector<std::vector<point_t<T> > >().swap(lines[i]);
+    result[i] = cpp11::writable::data_frame({
+      "x"_nm = x,
+      "y"_nm = y,
+      "z"_nm = z,
+      "line"_nm = line
+    });
+  }
+  return result;
+}
+
+[[cpp11::register]]
+cpp11::writable::list outline_mesh_c(
+    cpp11::doubles_matrix vert, cpp11::integers_matrix tri,
+    cpp11::doubles xv, cpp11::doubles yv, cpp11::doubles zv,
+    cpp11::doubles xt, cpp11::doubles yt, cpp11::doubles zt, double fov,
+    double crease_angle, std::string build_strategy, std::string precision,
+    int threads) {
+  threads = thread_count(threads);
+  engine_stats report(false);
+  if (is_single_precision(precision)) {
+    std::vector<tree_mesh<float> > occluded = occlude_mesh_impl<float>(
+      vert, tri, xv, yv, zv, xt, yt, zt, fov, false, false, engine_modes(), build_strategy,
+      threads, report
+    );
+    return outline_views(occluded, views_from_coords<float>(xv, yv, zv, xt, yt, zt, fov),
+                         crease_angle, threads);
+  }
+  std::vector<tree_mesh<double> > occluded = occlude_mesh_impl<double>(
+    vert, tri, xv, yv, zv, xt, yt, zt, fov, false, false, engine_modes(), build_strategy,
+    threads, report
+  );
+  return outline_views(occluded, views_from_coords<double>(xv, yv, zv, xt, yt, zt, fov),
+                       crease_angle, threads);
+}
+
+[[cpp11::register]]
+cpp11::writable::list outline_prepared_c(SEXP prepared, cpp11::doubles xv,
+                                         cpp11::doubles yv, cpp11::doubles zv,
+                                         cpp11::doubles xt, cpp11::doubles yt,
+                                         cpp11::doubles zt, double fov, double crease_angle,
+                                         int threads) {
+  threads = thread_count(threads);
+  prepared_mesh& mesh = get_prepared(prepared);
+
+  if (mesh.tree_single) {
+    std::vector<view_spec<float> > views = views_from_coords<float>(xv, yv, zv, xt, yt, zt, fov);
+    return outline_views(occlude_views(mesh.tree_single->tree, views, false, engine_modes(),
+                                       threads),
+                         views, crease_angle, threads);
+  }
+  std::vector<view_spec<double> > views = views_from_coords<double>(xv, yv, zv, xt, yt, zt, fov);
+  return outline_views(occlude_views(mesh.tree_double->tree, views, false, engine_modes(),
+                                     threads),
+                       views, crease_angle, threads);
+}
+
+// matrices holds any number of 4x4 matrices one after another, as in a 4 x 4 x n
+// array. Every matrix gives a separate result
+static size_t matrix_count(const cpp11::doubles& matrices) {
+  if (matrices.size() % 16 != 0) {
+    cpp11::stop("Projection matrices must be 4 x 4");
+  }
+  return matrices.size() / 16;
+}
+
+[[cpp11::register]]
+cpp11::writable::list project_coords_c(cpp11::doubles x, cpp11::doubles y, cpp11::doubles z,
+                                       cpp11::doubles matrices, int threads) {
+  threads = thread_count(threads);
+  size_t n_matrices = matrix_count(matrices);
+  R_xlen_t n = x.size();
+  cpp11::writable::list projected(n_matrices);
+  for (size_t i = 0; i < n_matrices; ++i) {
+    cpp11::writable::doubles x_new(n);
+    cpp11::writable::doubles y_new(n);
+    cpp11::writable::doubles z_new(n);
+    project_columns(REAL(matrices) + 16 * i, REAL(x), REAL(y), REAL(z), n, REAL(x_new),
+                    REAL(y_new), REAL(z_new), threads);
+    projected[i] = cpp11::writable::data_frame({
+      "x"_nm = x_new,
+      "y"_nm = y_new,
+      "z"_nm = z_new
+    });
+  }
+  return projected;
+}
+
+// Vertices are the columns of a matrix with 4 rows, such as the vb of a mesh
+static size_t vertex_count(const cpp11::doubles& vert) {
+  if (vert.size() % 4 != 0) {
+    cpp11::stop("Vertices must be given as a matrix with 4 rows");
+  }
+  return vert.size() / 4;
+}
+
+[[cpp11::register]]
+cpp11::writable::list project_vertices_c(cpp11::doubles vert, cpp11::doubles matrices,
+                                         int threads) {
+  threads = thread_count(threads);
+  size_t n_matrices = matrix_count(matrices);
+  size_t n = vertex_count(vert);
+  cpp11::writable::list projected(n_matrices);
+  for (size_t i = 0; i < n_matrices; ++i) {
+    cpp11::writable::doubles vertices(vert.size());
+    project_vertices(REAL(matrices) + 16 * i, REAL(vert), n, REAL(vertices), threads);
+    vertices.attr("class") = {"matrix", "array"};
+    vertices.attr("dim") = cpp11::writable::integers({4, (int) n});
+    projected[i] = vertices;
+  }
+  return projected;
+}
+
+// Writes the projected vertices into target, which may be the vertices
+// themselves, so nothing is allocated
+[[cpp11::register]]
+void project_vertices_into_c(cpp11::doubles vert, cpp11::doubles matrix, SEXP target,
+                             int threads) {
+  threads = thread_count(threads);
+  if (matrix_count(matrix) != 1) {
+    cpp11::stop("Vertices can only be projected in place with a single matrix");
+  }
+  size_t n = vertex_count(vert);
+  cpp11::doubles out(target);
+  if (out.size() != vert.size()) {
+    cpp11::stop("The target must be a double matrix of the same size as the vertices");
+  }
+  project_vertices(REAL(matrix), REAL(vert), n, REAL(target), threads);
 }
@@ -0,0 +1,117 @@
+#include "task_pool.h"
+#include <algorithm>
+
+static thread_local task_pool* current_pool = nullptr;
+static thread_local size_t current_worker = 0;
+
+task_pool::task_pool(size_t n_threads) : next_queue(0) {
+  n_threads = std::max<size_t>(1, n_threads);
+  for (size_t i = 0; i < n_threads; ++i) {
+    queues.emplace_back(new worker_queue());
+  }
+  for (size_t i = 0; i < n_threads; ++i) {
+    workers.emplace_back(&task_pool::run_worker, this, i);
+  }
+}
+
+task_pool::~task_pool() {
+  {
+    std::lock_guard<std::mutex> lock(state_mutex);
+    stopping = true;
+  }
+  work_available.notify_all();
+  for (auto iter = workers.begin(); iter != workers.end(); ++iter) {
+    iter->join();
+  }
+}
+
+void task_pool::submit(std::function<void()> task) {
+  size_t queue = current_pool == this ? current_worker : next_queue++ % queues.size();
+  // Counted before it is published, as a worker may pop it and count it off
+  // as soon as it is in the deque
+  {
+    std::lock_guard<std::mutex> lock(state_mutex);
+    ++pending;
+    ++queued;
+  }
+  {
+    std::lock_guard<std::mutex> lock(queues[queue]->mutex);
+    queues[queue]->tasks.push_back(std::move(task));
+  }
+  work_available.notify_one();
+}
+
+bool task_pool::pop_task(size_t worker, std::function<void()>& task) {
+  {
+    worker_queue& own = *queues[worker];
+    std::lock_guard<std::mutex> lock(own.mutex);
+    if (!own.tasks.empty()) {
+      task = std::move(own.tasks.back());
+      own.tasks.pop_back();
+      return true;
+    }
+  }
+  for (size_t i = 1; i < queues.size(); ++i) {
+    worker_queue& other = *queues[(worker + i) % queues.size()];
+    std::lock_guard<std::mutex> lock(other.mutex);
+    if (!other.tasks.empty()) {
+      task = std::move(other.tasks.front());
+      other.tasks.pop_front();
+      return true;
+    }
+  }
+  return false;
+}
+
+void task_pool::run_worker(size_t worker) {
+  current_pool = this;
+  current_worker = worker;
+  std::function<void()> task;
+  while (true) {
+    if (pop_task(worker, task)) {
+      {
+        std::lock_guard<std::mutex> lock(state_mutex);
+        --queued;
+      }
+      try {
+        task();
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(state_mutex);
+        if (!error) error = std::current_exception();
+      }
+      task = nullptr;
+      std::lock_guard<std::mutex> lock(state_mutex);
+      if (--pending == 0) work_done.notify_all();
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(state_mutex);
+    work_available.wait(lock, [this] { return queued > 0 || stopping; });
+    if (stopping) return;
+  }
+}
+
+void task_pool::wait() {
+  std::unique_lock<std::mutex> lock(state_mutex);
+  work_done.wait(lock, [this] { return pending == 0; });
+  if (error) {
+    std::exception_ptr rethrow = error;
+    error = nullptr;
+    std::rethrow_exception(rethrow);
+  }
+}
+
+void parallel_for(size_t n, size_t n_threads, const std::function<void(size_t)>& fun) {
+  n_threads = std::min(n_threads, n);
+  if (n_threads <= 1) {
+    for (size_t i = 0; i < n; ++i) fun(i);
+    return;
+  }
+  std::atomic<size_t> next(0);
+  task_pool pool(n_threads);
+  for (size_t t = 0; t < n_threads; ++t) {
+    pool.submit([&] {
+      for (size_t i = next++; i < n; i = next++) fun(i);
+    });
+  }
+  pool.wait();
+}
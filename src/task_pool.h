@@ -0,0 +1,52 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <memory>
+#include <atomic>
+#include <cstddef>
+
+// A small work-stealing pool. Every worker owns a deque; tasks submitted from
+// within a worker go to the back of its own deque and are popped from there
+// (depth first), while idle workers steal from the front of other deques. Tasks
+// must not touch the R API.
+class task_pool {
+private:
+  struct worker_queue {
+    std::mutex mutex;
+    std::deque<std::function<void()> > tasks;
+  };
+
+  std::vector<std::unique_ptr<worker_queue> > queues;
+  std::vector<std::thread> workers;
+  std::mutex state_mutex;
+  std::condition_variable work_available;
+  std::condition_variable work_done;
+  size_t pending = 0;
+  size_t queued = 0;
+  std::atomic<size_t> next_queue;
+  bool stopping = false;
+  std::exception_ptr error;
+
+  bool pop_task(size_t worker, std::function<void()>& task);
+  void run_worker(size_t worker);
+public:
+  task_pool(size_t n_threads);
+  ~task_pool();
+
+  size_t size() const { return workers.size(); }
+  void submit(std::function<void()> task);
+  void wait();
+};
+
+// The number of threads asked for through the R API, where NA and anything
+// below one mean the calling thread alone
+inline int thread_count(int threads) { return threads > 1 ? threads : 1; }
+
+// Runs fun(i) for i in [0, n) across at most n_threads threads
+void parallel_for(size_t n, size_t n_threads, const std::function<void(size_t)>& fun);
@@ -1,44 +1,71 @@
-#include "geometry.h"
+#include "weld.h"
+#include "mesh_file.h"
+#include "task_pool.h"
 
 #include <cpp11/doubles.hpp>
 #include <cpp11/integers.hpp>
 #include <cpp11/list.hpp>
 #include <cpp11/named_arg.hpp>
-#include <unordered_map>
+#include <vector>
+#include <string>
+#include <algorithm>
 
 using namespace cpp11::literals;
 
 [[cpp11::register]]
-cpp11::list join_triangles(cpp11::doubles x, cpp11::doubles y, cpp11::doubles z) {
-  std::unordered_map<point, int> vertice_map;
-  cpp11::writable::doubles vertices;
-  vertices.reserve(x.size() * 4);
-  cpp11::writable::integers triangles;
-  triangles.reserve(x.size() * 3);
-
-  int j = 0;
-  for (size_t i = 0; i < x.size(); ++i) {
-    point vert = {x[i], y[i], z[i]};
-    auto it = vertice_map.find(vert);
-    if (it == vertice_map.end()) {
-      vertices.push_back(vert.x);
-      vertices.push_back(vert.y);
-      vertices.push_back(vert.z);
-      vertices.push_back(1.0);
-      j = vertices.size() / 4;
-      vertice_map[vert] = j;
-    } else {
-      j = it->second;
-    }
-    triangles.push_back(j);
+cpp11::list join_triangles(cpp11::doubles x, cpp11::doubles y, cpp11::doubles z,
+                           double tolerance, int threads) {
+  threads = thread_count(threads);
+  const double* px = REAL(x);
+  const double* py = REAL(y);
+  const double* pz = REAL(z);
+  std::vector<uint32_t> index;
+  std::vector<uint32_t> first;
+  weld_vertices(px, py, pz, x.size(), tolerance, threads, index, first);
+
+  cpp11::writable::doubles vertices(first.size() * 4);
+  double* coord = REAL(vertices);
+  for (auto it = first.begin(); it != first.end(); ++it) {
+    *coord++ = px[*it];
+    *coord++ = py[*it];
+    *coord++ = pz[*it];
+    *coord++ = 1.0;
+  }
+  cpp11::writable::integers triangles(index.size());
+  int* corner = INTEGER(triangles);
+  for (auto it = index.begin(); it != index.end(); ++it) {
+    *corner++ = *it + 1;
   }
-  vertices.resize(vertices.size());
-  triangles.resize(triangles.size());
 
   vertices.attr("class") = {"matrix", "array"};
-  vertices.attr("dim") = cpp11::writable::integers({4, (int) vertices.size() / 4});
+  vertices.attr("dim") = cpp11::writable::integers({4, (int) first.size()});
+  triangles.attr("class") = {"matrix", "array"};
+  triangles.attr("dim") = cpp11::writable::integers({3, (int) index.size() / 3});
+
+  return cpp11::writable::list({
+    "vertices"_nm = vertices,
+    "triangles"_nm = triangles
+  });
+}
+
+[[cpp11::register]]
+cpp11::list read_mesh_c(std::string path, int threads) {
+  threads = thread_count(threads);
+  std::vector<double> coords;
+  std::vector<int> corners;
+  read_mesh_file(path, threads, coords, corners);
+
+  cpp11::writable::doubles vertices(coords.size());
+  std::copy(coords.begin(), coords.end(), REAL(vertices));
+  std::vector<double>().swap(coords);
+  cpp11::writable::integers triangles(corners.size());
+  std::copy(corners.begin(), corners.end(), INTEGER(triangles));
+  std::vector<int>().swap(corners);
+
+  vertices.attr("class") = {"matrix", "array"};
+  vertices.attr("dim") = cpp11::writable::integers({4, (int) (vertices.size() / 4)});
   triangles.attr("class") = {"matrix", "array"};
-  triangles.attr("dim") = cpp11::writable::integers({3, (int) triangles.size() / 3});
+  triangles.attr("dim") = cpp11::writable::integers({3, (int) (triangles.size() / 3)});
 
   return cpp11::writable::list({
     "vertices"_nm = vertices,
@@ -0,0 +1,260 @@
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+#include <utility>
+#include <cstdint>
+#include <cstddef>
+
+#include "geometry.h"
+
+// A triangle referring to its corners by index into a vertex_pool_t. Pieces cut
+// from a triangle keep its normal so they stay exactly coplanar with it
+template <typename T>
+class indexed_triangle_t {
+public:
+  typedef vec3_t<T> vec3;
+  typedef indexed_triangle_t<T> indexed_triangle;
+
+private:
+  vec3 _n;
+  uint32_t _v[3];
+  int _id = 0;
+  T _light = 0;
+  bool _visible = true;
+  bool _back = false;
+
+public:
+  indexed_triangle_t() : _v{0, 0, 0} {}
+  indexed_triangle_t(uint32_t a, uint32_t b, uint32_t c, const vec3& n, int id = 0, T light = 0,
+                     bool visible = true, bool back = false) :
+    _n(n),
+    _v{a, b, c},
+    _id(id),
+    _light(light),
+    _visible(visible),
+    _back(back) {}
+  // A piece of parent with new corners
+  indexed_triangle_t(uint32_t a, uint32_t b, uint32_t c, const indexed_triangle& parent) :
+    _n(parent._n),
+    _v{a, b, c},
+    _id(parent._id),
+    _light(parent._light),
+    _visible(parent._visible),
+    _back(parent._back) {}
+
+  uint32_t operator[](int index) const { return _v[index % 3]; }
+  uint32_t& operator[](int index) { return _v[index % 3]; }
+  const vec3& normal() const { return _n; }
+  int id() const { return _id; }
+  T light() const { return _light; }
+  void illuminate(T light = 1) { _light += light; }
+  bool is_visible() const { return _visible; }
+  bool is_back_facing() const { return _back; }
+  void set_visibility(bool visible = true) { _visible = visible; }
+  void set_back_facing(bool back = true) { _back = back; }
+  bool is_valid() const { return std::isfinite(_n.x) && std::isfinite(_n.y) && std::isfinite(_n.z); }
+};
+
+template <typename T>
+struct indexed_cut_t {
+  typedef indexed_triangle_t<T> indexed_triangle;
+
+  indexed_triangle front;
+  indexed_triangle back;
+  indexed_triangle extra;
+
+  bool last_is_front;
+  bool last_is_valid;
+};
+
+// The vertices shared by the triangles of a tree. A pool can be layered on top
+// of a parent pool that must stay unchanged while it is in use. Vertices added
+// to it get indices following those of the parent, which lets separate threads
+// extend the same pool and have their additions appended afterwards
+template <typename T>
+class vertex_pool_t {
+public:
+  typedef vec3_t<T> vec3;
+  typedef point_t<T> point;
+  typedef triangle_t<T> triangle;
+  typedef plane_t<T> plane;
+  typedef indexed_triangle_t<T> indexed_triangle;
+  typedef indexed_cut_t<T> indexed_cut;
+  typedef vertex_pool_t<T> vertex_pool;
+
+private:
+  struct split_key {
+    uint32_t a;
+    uint32_t b;
+    uint32_t plane;
+    bool operator==(const split_key& key) const {
+      return a == key.a && b == key.b && plane == key.plane;
+    }
+  };
+  struct split_hash {
+    size_t operator()(const split_key& key) const {
+      uint64_t h = (uint64_t(key.a) << 32 | key.b) * 0x9E3779B97F4A7C15ULL;
+      h ^= (h >> 29) + key.plane * 0xBF58476D1CE4E5B9ULL;
+      return h ^ (h >> 32);
+    }
+  };
+
+  const vertex_pool* parent = nullptr;
+  uint32_t offset = 0;
+  T tol = plane::EPSILON;
+  std::vector<point> points;
+  std::unordered_map<split_key, uint32_t, split_hash> splits;
+
+public:
+  vertex_pool_t() {}
+  explicit vertex_pool_t(const vertex_pool* parent) :
+    parent(parent),
+    offset(parent->size()),
+    tol(parent->tol) {}
+
+  size_t size() const { return offset + points.size(); }
+  // The number of vertices that belong to the parent
+  uint32_t base_size() const { return offset; }
+  // The vertices added to this pool, excluding those of the parent
+  const std::vector<point>& local() const { return points; }
+  void reserve(size_t n) { points.reserve(n > offset ? n - offset : 0); }
+  void clear() {
+    parent = nullptr;
+    offset = 0;
+    tol = plane::EPSILON;
+    points.clear();
+    splits.clear();
+  }
+  const point& operator[](uint32_t index) const {
+    return index < offset ? (*parent)[index] : points[index - offset];
+  }
+  uint32_t add(const point& p) {
+    points.push_back(p);
+    return size() - 1;
+  }
+  void append(const std::vector<point>& more) {
+    points.insert(points.end(), more.begin(), more.end());
+  }
+  // The tolerance given to the planes of triangles in the pool, see
+  // plane_t::tolerance_for(). Pools layered on a parent start out with the
+  // tolerance of the parent
+  T tolerance() const { return tol; }
+  void set_tolerance(T tolerance) { tol = tolerance; }
+
+  // The vertex where the edge between a and b crosses the plane with the given
+  // id. It is created once per edge and plane so triangles sharing the edge
+  // share the new vertex as well. The crossing is always computed from the
+  // lower index so it doesn't depend on the winding of the triangle
+  uint32_t split_edge(uint32_t a, uint32_t b, uint32_t plane_id, const plane& partition) {
+    if (a > b) std::swap(a, b);
+    split_key key = {a, b, plane_id};
+    auto found = splits.find(key);
+    if (found != splits.end()) return found->second;
+    const point& pt_a = (*this)[a];
+    const point& pt_b = (*this)[b];
+    point cross = plane::crossing(pt_a, pt_b, partition.classify_point(pt_a),
+                                  partition.classify_point(pt_b));
+    uint32_t index = add(cross);
+    splits.emplace(key, index);
+    return index;
+  }
+  // Forgets which edges have been split. Must be called before plane ids are
+  // reused for a different set of planes
+  void clear_splits() {
+    if (!splits.empty()) splits.clear();
+  }
+
+  // Same as plane_t::split_triangle() but the new corners are added to the pool
+  // through split_edge()
+  indexed_cut split_triangle(const plane& partition, uint32_t plane_id, const indexed_triangle& tri) {
+    uint32_t a = tri[0];
+    uint32_t b = tri[1];
+    uint32_t c = tri[2];
+    indexed_cut result = {};
+
+    T side_a = partition.classify_point((*this)[a]);
+    T side_b = partition.classify_point((*this)[b]);
+    T side_c = partition.classify_point((*this)[c]);
+    result.last_is_valid = side_a != 0.0 && side_b != 0.0 && side_c != 0.0;
+
+    if (side_a == 0.0) {
+      uint32_t bc = split_edge(b, c, plane_id, partition);
+      if (side_b > 0.0) {
+        result.front = {a, b, bc, tri};
+        result.back = {bc, c, a, tri};
+      } else {
+        result.back = {a, b, bc, tri};
+        result.front = {bc, c, a, tri};
+      }
+    } else if (side_b == 0.0) {
+      uint32_t ca = split_edge(c, a, plane_id, partition);
+      if (side_c > 0.0) {
+        result.front = {b, c, ca, tri};
+        result.back = {ca, a, b, tri};
+      } else {
+        result.back = {b, c, ca, tri};
+        result.front = {ca, a, b, tri};
+      }
+    } else if (side_c == 0.0) {
+      uint32_t ab = split_edge(a, b, plane_id, partition);
+      if (side_a > 0.0) {
+        result.front = {c, a, ab, tri};
+        result.back = {ab, b, c, tri};
+      } else {
+        result.back = {c, a, ab, tri};
+        result.front = {ab, b, c, tri};
+      }
+    } else if ((side_a > 0.0) == (side_b > 0.0)) {
+      uint32_t bc = split_edge(b, c, plane_id, partition);
+      uint32_t ca = split_edge(c, a, plane_id, partition);
+      indexed_triangle& with_a = side_a > 0.0 ? result.front : result.back;
+      indexed_triangle& without_a = side_a > 0.0 ? result.back : result.front;
+      with_a = {a, b, bc, tri};
+      result.extra = {a, bc, ca, tri};
+      without_a = {bc, c, ca, tri};
+      result.last_is_front = side_a > 0.0;
+    } else if ((side_a > 0.0) == (side_c > 0.0)) {
+      uint32_t ab = split_edge(a, b, plane_id, partition);
+      uint32_t bc = split_edge(b, c, plane_id, partition);
+      indexed_triangle& with_a = side_a > 0.0 ? result.front : result.back;
+      indexed_triangle& without_a = side_a > 0.0 ? result.back : result.front;
+      with_a = {c, a, ab, tri};
+      result.extra = {c, ab, bc, tri};
+      without_a = {ab, b, bc, tri};
+      result.last_is_front = side_a > 0.0;
+    } else {
+      uint32_t ab = split_edge(a, b, plane_id, partition);
+      uint32_t ca = split_edge(c, a, plane_id, partition);
+      indexed_triangle& with_a = side_a > 0.0 ? result.front : result.back;
+      indexed_triangle& without_a = side_a > 0.0 ? result.back : result.front;
+      with_a = {a, ab, ca, tri};
+      result.extra = {b, ca, ab, tri};
+      without_a = {b, c, ca, tri};
+      result.last_is_front = side_a <= 0.0;
+    }
+
+    return result;
+  }
+
+  indexed_triangle make_triangle(uint32_t a, uint32_t b, uint32_t c, int id = 0, T light = 0) const {
+    const point& pt_a = (*this)[a];
+    const point& pt_b = (*this)[b];
+    const point& pt_c = (*this)[c];
+    return indexed_triangle(a, b, c, ((pt_b - pt_a).cross(pt_c - pt_b)).normalize(), id, light);
+  }
+  triangle to_triangle(const indexed_triangle& tri) const {
+    return triangle((*this)[tri[0]], (*this)[tri[1]], (*this)[tri[2]], tri.id(), tri.light(),
+                    tri.is_visible(), tri.is_back_facing());
+  }
+  plane plane_of(const indexed_triangle& tri) const {
+    return plane(tri.normal(), -(*this)[tri[0]].dot(tri.normal()), tol);
+  }
+  int classify(const plane& partition, const indexed_triangle& tri) const {
+    return partition.classify_corners((*this)[tri[0]], (*this)[tri[1]], (*this)[tri[2]]);
+  }
+  T area(const indexed_triangle& tri) const {
+    const point& pt_a = (*this)[tri[0]];
+    return (((*this)[tri[1]] - pt_a).cross((*this)[tri[2]] - pt_a)).length() / 2;
+  }
+};
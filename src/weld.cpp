@@ -0,0 +1,177 @@
+#include "weld.h"
+#include "geometry.h"
+#include "task_pool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// Inputs with fewer vertices than this are always welded through the hash
+// table as sorting doesn't pay off before then
+static const size_t PARALLEL_CUTOFF = 1 << 20;
+static const uint32_t EMPTY_SLOT = 0xFFFFFFFF;
+
+// The identity of a vertex for welding: the bits of its coordinates, or the
+// cell it falls in when welding with a tolerance
+struct weld_key {
+  uint64_t k[3];
+
+  bool operator==(const weld_key& key) const {
+    return k[0] == key.k[0] && k[1] == key.k[1] && k[2] == key.k[2];
+  }
+  bool operator<(const weld_key& key) const {
+    if (k[0] != key.k[0]) return k[0] < key.k[0];
+    if (k[1] != key.k[1]) return k[1] < key.k[1];
+    return k[2] < key.k[2];
+  }
+  uint64_t hash() const {
+    return mix_bits(k[0] ^ mix_bits(k[1] ^ mix_bits(k[2])));
+  }
+};
+
+struct weld_keys {
+  const double* x;
+  const double* y;
+  const double* z;
+  double tolerance;
+
+  // -0 and 0 are the same coordinate so they must have the same bits
+  static uint64_t bits(double v) {
+    if (v == 0.0) v = 0.0;
+    uint64_t b;
+    std::memcpy(&b, &v, sizeof(b));
+    return b;
+  }
+  // Coordinates too large to have a cell keep their exact value
+  uint64_t cell(double v) const {
+    double c = std::floor(v / tolerance);
+    if (!(std::abs(c) < 9.2e18)) return bits(v);
+    return static_cast<uint64_t>(static_cast<int64_t>(c));
+  }
+  weld_key operator()(size_t i) const {
+    if (tolerance > 0.0) {
+      return {{cell(x[i]), cell(y[i]), cell(z[i])}};
+    }
+    return {{bits(x[i]), bits(y[i]), bits(z[i])}};
+  }
+};
+
+// Open addressing with linear probing. Slots hold welded vertex numbers and
+// keys are looked up through the vertex representing them, so the table only
+// costs 4 bytes per slot
+static void weld_hashed(const weld_keys& key_of, size_t n, std::vector<uint32_t>& index,
+                        std::vector<uint32_t>& first) {
+  size_t capacity = 64;
+  while (capacity < std::min(n, size_t(1 << 16)) * 2) capacity <<= 1;
+  std::vector<uint32_t> slots(capacity, EMPTY_SLOT);
+  size_t mask = capacity - 1;
+
+  for (size_t i = 0; i < n; ++i) {
+    weld_key key = key_of(i);
+    size_t slot = key.hash() & mask;
+    while (true) {
+      uint32_t v = slots[slot];
+      if (v == EMPTY_SLOT) {
+        v = first.size();
+        first.push_back(i);
+        slots[slot] = v;
+        index[i] = v;
+        break;
+      }
+      if (key_of(first[v]) == key) {
+        index[i] = v;
+        break;
+      }
+      slot = (slot + 1) & mask;
+    }
+
+    // Keep the load below one half
+    if (first.size() * 2 > capacity) {
+      capacity <<= 1;
+      mask = capacity - 1;
+      std::vector<uint32_t>(capacity, EMPTY_SLOT).swap(slots);
+      for (uint32_t v = 0; v < first.size(); ++v) {
+        size_t s = key_of(first[v]).hash() & mask;
+        while (slots[s] != EMPTY_SLOT) s = (s + 1) & mask;
+        slots[s] = v;
+      }
+    }
+  }
+}
+
+struct keyed_vertex {
+  weld_key key;
+  uint32_t i;
+
+  bool operator<(const keyed_vertex& v) const {
+    if (key == v.key) return i < v.i;
+    return key < v.key;
+  }
+};
+
+// Sorts the vertices by key so equal vertices form runs. The first vertex in a
+// run has the lowest input position and represents the rest, which gives the
+// same numbering as weld_hashed() once the runs are numbered in input order
+static void weld_sorted(const weld_keys& key_of, size_t n, size_t n_threads,
+                        std::vector<uint32_t>& index, std::vector<uint32_t>& first) {
+  std::vector<keyed_vertex> order(n);
+  size_t n_chunks = n_threads;
+  size_t chunk_size = (n + n_chunks - 1) / n_chunks;
+  parallel_for(n_chunks, n_threads, [&](size_t chunk) {
+    size_t from = std::min(n, chunk * chunk_size);
+    size_t to = std::min(n, from + chunk_size);
+    for (size_t i = from; i < to; ++i) {
+      order[i] = {key_of(i), (uint32_t) i};
+    }
+    std::sort(order.begin() + from, order.begin() + to);
+  });
+  for (size_t width = chunk_size; width < n; width *= 2) {
+    size_t n_merges = (n + 2 * width - 1) / (2 * width);
+    parallel_for(n_merges, n_threads, [&](size_t merge) {
+      size_t from = merge * 2 * width;
+      size_t middle = std::min(n, from + width);
+      size_t to = std::min(n, middle + width);
+      std::inplace_merge(order.begin() + from, order.begin() + middle, order.begin() + to);
+    });
+  }
+
+  // Each chunk handles the runs starting within it. index temporarily holds
+  // the input position of the representative vertex
+  parallel_for(n_chunks, n_threads, [&](size_t chunk) {
+    size_t from = std::min(n, chunk * chunk_size);
+    size_t to = std::min(n, from + chunk_size);
+    while (from < to && from > 0 && order[from].key == order[from - 1].key) ++from;
+    while (from < to) {
+      uint32_t representative = order[from].i;
+      size_t run = from;
+      do {
+        index[order[run].i] = representative;
+        ++run;
+      } while (run < n && order[run].key == order[from].key);
+      from = run;
+    }
+  });
+  std::vector<keyed_vertex>().swap(order);
+
+  for (size_t i = 0; i < n; ++i) {
+    if (index[i] == i) {
+      index[i] = first.size();
+      first.push_back(i);
+    } else {
+      index[i] = index[index[i]];
+    }
+  }
+}
+
+void weld_vertices(const double* x, const double* y, const double* z, size_t n,
+                   double tolerance, size_t n_threads,
+                   std::vector<uint32_t>& index, std::vector<uint32_t>& first) {
+  weld_keys key_of = {x, y, z, tolerance};
+  index.assign(n, 0);
+  first.clear();
+  if (n_threads > 1 && n >= PARALLEL_CUTOFF) {
+    weld_sorted(key_of, n, n_threads, index, first);
+  } else {
+    weld_hashed(key_of, n, index, first);
+  }
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// Merges coincident vertices. index receives the welded vertex of every input
+// vertex, numbered from 0 in order of first appearance, and first receives the
+// input position of the vertex that represents each welded vertex.
+//
+// With a positive tolerance, vertices falling in the same cell of a grid with
+// that spacing are merged, otherwise only vertices with identical coordinates
+// are. Large inputs are welded with a parallel sort when more than one thread
+// is given. Both ways give the same result
+void weld_vertices(const double* x, const double* y, const double* z, size_t n,
+                   double tolerance, size_t n_threads,
+                   std::vector<uint32_t>& index, std::vector<uint32_t>& first);